@@ -0,0 +1,119 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_BENCH_BENCH_H_
+#define QSMP_BENCH_BENCH_H_
+
+#include <qsmp_gui/common.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <string>
+#include <vector>
+
+#define QSMPBENCH_BEGIN namespace qsmp_bench {
+#define QSMPBENCH_END  }
+
+QSMPBENCH_BEGIN
+
+namespace fs = ::boost::filesystem;
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//Each benchmark gets the arguments after its name and returns the exit code. A benchmark which
+//also checks its results returns non-zero if they are wrong.
+typedef std::vector<std::string> Arguments;
+typedef int (*Benchmark)(const Arguments& arguments);
+
+int BenchScan(const Arguments& arguments);
+int BenchWorkers(const Arguments& arguments);
+int BenchPaths(const Arguments& arguments);
+int BenchTreeModel(const Arguments& arguments);
+int BenchFastImport(const Arguments& arguments);
+
+//-----------------------------------------------------------------------------
+
+class Stopwatch
+{
+public:
+  Stopwatch():start_(Now()){}
+
+  void   Restart(){start_ = Now();}
+  double seconds()const{return (Now() - start_).total_microseconds() / 1e6;}
+
+private:
+  static boost::posix_time::ptime Now(){return boost::posix_time::microsec_clock::universal_time();}
+  boost::posix_time::ptime start_;
+};
+
+//Prints "<name>: <count> <unit> in <seconds>s, <rate> <unit>/s", with MB/s as well if bytes is
+//non-zero
+void Report(const std::string& name, boost::uint64_t count, const char* unit, double seconds,
+            boost::uint64_t bytes = 0);
+
+//Sets the cache up to read from repository, call it before the cache is first leased. Lookups
+//would be answered by the snapshot in the user's home directory left by earlier runs, so the home
+//directory is pointed at an emptied one in the temp directory. The cache's normal log output is
+//turned off as writing it takes longer than the reads being timed, warnings still get through.
+void PrepareCache(const std::string& repository);
+
+//Lets the main thread wait for callbacks made on the cache thread
+class Countdown
+{
+public:
+  explicit Countdown(size_t count):count_(count){}
+
+  void Done()
+  {
+    boost::lock_guard<boost::mutex> lock(lock_);
+    if (count_ > 0 && --count_ == 0)
+      done_.notify_all();
+  }
+  void Wait()
+  {
+    boost::unique_lock<boost::mutex> lock(lock_);
+    while (count_ > 0)
+      done_.wait(lock);
+  }
+
+private:
+  boost::mutex              lock_;
+  boost::condition_variable done_;
+  size_t                    count_;
+};
+
+//Returns the argument at index converted to T, or fallback if there aren't that many
+template<class T>
+T Argument(const Arguments& arguments, size_t index, const T& fallback)
+{
+  if (index >= arguments.size())
+    return fallback;
+  return boost::lexical_cast<T>(arguments[index]);
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMPBENCH_END
+
+#endif
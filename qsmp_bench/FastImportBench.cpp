@@ -0,0 +1,128 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include <qsmp_bench/Bench.h>
+
+#include <qsmp_indexer/FastImportWriter.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <stdio.h>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+QSMPBENCH_BEGIN
+
+using qsmp_indexer::FastImportWriter;
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //The values the indexer writes for each file, about the size of real tags
+  const char* const Fields[] = {"artist", "album", "title", "track", "year", "genre"};
+  const size_t FieldCount = sizeof(Fields) / sizeof(Fields[0]);
+
+  //A blob with a mark for each value, then the commit referring to the marks, the same shape as
+  //the indexer's output
+  void WriteStream(FastImportWriter& out, size_t files)
+  {
+    char value[64];
+    for (size_t file = 0; file < files; file++)
+    {
+      for (size_t field = 0; field < FieldCount; field++)
+      {
+        int length = sprintf(value, "%s value for file %lu", Fields[field], static_cast<unsigned long>(file));
+        out.Write("blob\nmark :");
+        out.WriteNumber(file * FieldCount + field + 1);
+        out.Write('\n');
+        out.Data(value, length);
+      }
+    }
+
+    const char message[] = "qsmp_indexer benchmark";
+    out.Write("commit refs/heads/master\ncommitter qsmp_indexer <qsmp_indexer> now\n");
+    out.Data(message, sizeof(message) - 1);
+    for (size_t file = 0; file < files; file++)
+    {
+      char path[64];
+      int path_length = sprintf(path, "files/Artist %lu/Album %lu/%lu.mp3/", static_cast<unsigned long>(file / 1000),
+                                static_cast<unsigned long>(file / 10), static_cast<unsigned long>(file));
+      for (size_t field = 0; field < FieldCount; field++)
+      {
+        out.Write("M 100644 :");
+        out.WriteNumber(file * FieldCount + field + 1);
+        out.Write(' ');
+        out.Write(path, path_length);
+        out.Write(Fields[field], strlen(Fields[field]));
+        out.Write('\n');
+      }
+    }
+    out.Write('\n');
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+int BenchFastImport(const Arguments& arguments)
+{
+  size_t files = Argument<size_t>(arguments, 0, 1000000);
+#ifdef WIN32
+  std::string output = Argument<std::string>(arguments, 1, "NUL");
+  int fd = _open(output.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+  std::string output = Argument<std::string>(arguments, 1, "/dev/null");
+  int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+  if (fd < 0)
+    throw std::runtime_error("unable to open " + output);
+
+  Stopwatch timer;
+  bool ok;
+  boost::uint64_t written;
+  {
+    FastImportWriter out(fd);
+    WriteStream(out, files);
+    ok      = out.Flush();
+    written = out.written();
+    out.Close();
+  }
+  double seconds = timer.seconds();
+#ifdef WIN32
+  _close(fd);
+#else
+  close(fd);
+#endif
+
+  if (!ok)
+  {
+    fprintf(stderr, "fastimport: failed writing to %s\n", output.c_str());
+    return 1;
+  }
+  Report("fastimport", files, "files", seconds, written);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMPBENCH_END
@@ -0,0 +1,93 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include <qsmp_bench/Bench.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <qsmp_gui/Cache.h>
+#include <stdexcept>
+#include <stdio.h>
+
+QSMPBENCH_BEGIN
+
+using qsmp::Cache;
+using qsmp::CacheId;
+using qsmp::Tree;
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //Called on the cache thread for each path
+  void CountPath(size_t* found, Countdown* resolved, const Cache::Path& path, const Tree::Entry& entry)
+  {
+    if (entry.kind_ != Tree::Entry::Kind_None)
+      ++*found;
+    else
+      fprintf(stderr, "paths: %s not found\n", path.string().c_str());
+    resolved->Done();
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+int BenchPaths(const Arguments& arguments)
+{
+  if (arguments.size() < 3)
+    throw std::invalid_argument("paths needs a repository, a tree id and a path list");
+  CacheId root(arguments[1].c_str());
+  size_t rounds = Argument<size_t>(arguments, 3, 3);
+
+  std::vector<Cache::Path> paths;
+  fs::ifstream list(arguments[2]);
+  std::string line;
+  while (std::getline(list, line))
+  {
+    if (!line.empty())
+      paths.push_back(line);
+  }
+  if (paths.empty())
+    throw std::invalid_argument("no paths in " + arguments[2]);
+
+  PrepareCache(arguments[0]);
+
+  //The first round fetches the trees from git a level at a time, later ones only go through the
+  //path index and the trees already loaded
+  bool ok = true;
+  for (size_t round = 0; round < rounds; round++)
+  {
+    size_t found = 0;
+    Countdown resolved(paths.size());
+    Stopwatch timer;
+    Cache::lease()->ResolvePaths(root, paths, boost::bind(&CountPath, &found, &resolved, _1, _2));
+    resolved.Wait();
+    double seconds = timer.seconds();
+
+    Report(round == 0 ? "paths cold" : "paths warm", paths.size(), "paths", seconds);
+    ok &= (found == paths.size());
+  }
+  return ok ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMPBENCH_END
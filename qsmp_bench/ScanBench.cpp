@@ -0,0 +1,238 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include <qsmp_bench/Bench.h>
+
+#include <qsmp_gui/CatFileScanner.h>
+
+#include <cstring>
+#include <stdio.h>
+
+QSMPBENCH_BEGIN
+
+using namespace qsmp::cache;
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  const size_t EntriesPerTree  = 64;
+  //One object in this many is a commit, every other one of which is signed
+  const size_t CommitEvery     = 16;
+  const size_t Passes          = 10;
+
+  const char* const SignedMessage = "Signed commit\n\nWith a body\n";
+
+  std::string HexId(size_t n)
+  {
+    char id[41];
+    sprintf(id, "%040lx", static_cast<unsigned long>(n));
+    return std::string(id, 40);
+  }
+
+  std::string Tree(size_t n)
+  {
+    std::string tree;
+    for (size_t i = 0; i < EntriesPerTree; i++)
+    {
+      char name[32];
+      sprintf(name, "%s %02lu - Track %lu.mp3", i % 8 ? "100644" : "40000", static_cast<unsigned long>(i),
+              static_cast<unsigned long>(n));
+      tree.append(name, strlen(name) + 1);
+      char id[20] = {0};
+      memcpy(id, &n, std::min(sizeof(n), sizeof(id)));
+      id[19] = char(i);
+      tree.append(id, 20);
+    }
+    return tree;
+  }
+
+  std::string Commit(size_t n, bool sign)
+  {
+    std::string commit;
+    commit += "tree " + HexId(n) + "\n";
+    commit += "parent " + HexId(n + 1) + "\n";
+    commit += "author A U Thor <author@example.com> 1234567890 +0000\n";
+    commit += "committer C O Mitter <committer@example.com> 1234567890 +0000\n";
+    if (sign)
+    {
+      //The signature's lines carry on the gpgsig header, the blank one among them is a single space
+      commit += "gpgsig -----BEGIN PGP SIGNATURE-----\n";
+      commit += " \n";
+      commit += " iQEzBAABCAAdFiEEexampleexampleexampleexampleexampleFAlexample\n";
+      commit += " =abcd\n";
+      commit += " -----END PGP SIGNATURE-----\n";
+      commit += "\n";
+      commit += SignedMessage;
+    }
+    else
+    {
+      commit += "\nCommit message\n";
+    }
+    return commit;
+  }
+
+  void AddObject(std::string& stream, size_t n, const char* type, const std::string& data)
+  {
+    char length[32];
+    sprintf(length, " %lu\n", static_cast<unsigned long>(data.size()));
+    stream += HexId(n) + " " + type + length;
+    stream += data;
+    stream += '\n';
+  }
+
+  //What was read out of a commit
+  struct CommitScan
+  {
+    CommitScan():headers_(0){}
+    std::string tree_;
+    std::string parent_;
+    std::string committer_;
+    size_t      headers_;
+    std::string message_;
+  };
+
+  //Consumes the headers the way cache::CommitState does: continuation lines are skipped and only
+  //a blank line ends the headers
+  void ScanCommit(const char* start, const char* end, CommitScan& commit)
+  {
+    while (start < end)
+    {
+      CommitHeaderScan header;
+      const char* next = ScanCommitHeader(start, end, header);
+      if (!next)
+        break;
+      start = next;
+      if (header.continuation_)
+        continue;
+      if (header.key_length_ == 0)
+        break;
+      ++commit.headers_;
+      if (KeyEquals(header, "tree"))
+        commit.tree_.assign(header.value_, header.value_length_);
+      else if (KeyEquals(header, "parent"))
+        commit.parent_.assign(header.value_, header.value_length_);
+      else if (KeyEquals(header, "committer"))
+        commit.committer_.assign(header.value_, header.value_length_);
+    }
+    commit.message_.assign(start, end);
+  }
+
+  bool Check(bool condition, const char* what)
+  {
+    if (!condition)
+      fprintf(stderr, "scan: signed commit: %s\n", what);
+    return condition;
+  }
+
+  bool CheckSignedCommit()
+  {
+    std::string data = Commit(7, true);
+    CommitScan commit;
+    ScanCommit(data.data(), data.data() + data.size(), commit);
+    bool ok = true;
+    ok &= Check(commit.tree_ == HexId(7), "wrong tree");
+    ok &= Check(commit.parent_ == HexId(8), "wrong parent");
+    ok &= Check(commit.committer_ == "C O Mitter <committer@example.com> 1234567890 +0000", "wrong committer");
+    //tree, parent, author, committer and gpgsig
+    ok &= Check(commit.headers_ == 5, "signature lines read as headers");
+    ok &= Check(commit.message_ == SignedMessage, "signature left in the message");
+    return ok;
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+int BenchScan(const Arguments& arguments)
+{
+  size_t objects = Argument<size_t>(arguments, 0, 20000);
+
+  if (!CheckSignedCommit())
+    return 1;
+
+  std::string stream;
+  for (size_t n = 0; n < objects; n++)
+  {
+    if (n % CommitEvery == 0)
+      AddObject(stream, n, "commit", Commit(n, n % (2 * CommitEvery) == 0));
+    else
+      AddObject(stream, n, "tree", Tree(n));
+  }
+
+  //Scans the stream the way the cat-file read thread does, one object at a time
+  size_t entries = 0;
+  size_t scanned = 0;
+  size_t invalid = 0;
+  Stopwatch timer;
+  for (size_t pass = 0; pass < Passes; pass++)
+  {
+    const char* start = stream.data();
+    const char* end   = stream.data() + stream.size();
+    while (start < end)
+    {
+      CatFileHeaderScan declaration;
+      bool bad;
+      const char* data = ScanCatFileHeader(start, end, declaration, bad);
+      if (!data || bad)
+      {
+        ++invalid;
+        break;
+      }
+      const char* object_end = data + declaration.length_;
+      if (declaration.type_length_ == 4 && !memcmp(declaration.type_, "tree", 4))
+      {
+        while (data < object_end)
+        {
+          TreeEntryScan entry;
+          data = ScanTreeEntry(data, object_end, entry, bad);
+          if (!data || bad)
+          {
+            ++invalid;
+            break;
+          }
+          ++entries;
+        }
+      }
+      else
+      {
+        CommitScan commit;
+        ScanCommit(data, object_end, commit);
+      }
+      ++scanned;
+      //Skip the newline cat-file ends each object with
+      start = object_end + 1;
+    }
+  }
+  double seconds = timer.seconds();
+
+  if (invalid != 0)
+  {
+    fprintf(stderr, "scan: %lu objects failed to scan\n", static_cast<unsigned long>(invalid));
+    return 1;
+  }
+  Report("scan", scanned, "objects", seconds, boost::uint64_t(stream.size()) * Passes);
+  Report("scan", entries, "tree entries", seconds);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMPBENCH_END
@@ -0,0 +1,154 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include <qsmp_bench/Bench.h>
+
+#include <qsmp_gui/TreeModel.h>
+#include <stdio.h>
+
+QSMPBENCH_BEGIN
+
+using qsmp::TreeModel;
+using qsmp::TreeModelNode;
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  class BenchModel;
+
+  class BenchNode : public TreeModelNode<BenchNode, BenchModel>
+  {
+  public:
+    typedef TreeModelNode<BenchNode, BenchModel> Base;
+
+    BenchNode(BenchModel* model)
+      : Base(model)
+    {}
+
+    int columnCount()const{return 1;}
+
+  private:
+    friend class BenchModel;
+  };
+
+  //---------------------------------------------------------------------------
+
+  class BenchModel : public TreeModel<BenchNode, BenchModel>
+  {
+  public:
+    typedef TreeModel<BenchNode, BenchModel> Base;
+
+    BenchModel()
+      : Base(this)
+    {}
+
+    //Gives each node children_per_node children, breadth first, until there are nodes in all.
+    //Returns the number added.
+    size_t Build(size_t nodes, size_t children_per_node)
+    {
+      std::vector<BenchNode*> level(1, root());
+      size_t added = 0;
+      while (added < nodes && !level.empty())
+      {
+        std::vector<BenchNode*> next;
+        next.reserve(level.size() * children_per_node);
+        for (size_t i = 0; i < level.size() && added < nodes; i++)
+        {
+          size_t count = std::min(children_per_node, nodes - added);
+          level[i]->BeginAddChildren(count);
+          BenchNode* first = level[i]->AddChildren(count);
+          BenchNode::EndAddChildren(this);
+          for (size_t j = 0; j < count; j++)
+            next.push_back(first + j);
+          added += count;
+        }
+        level.swap(next);
+      }
+      return added;
+    }
+
+    //Walks the whole tree through index() and parent() the way a view does, returns the number
+    //of indexes visited
+    size_t Walk(const QModelIndex& parent)
+    {
+      size_t visited = 0;
+      int rows = rowCount(parent);
+      for (int row = 0; row < rows; row++)
+      {
+        QModelIndex child = index(row, 0, parent);
+        if (this->parent(child).internalPointer() != parent.internalPointer())
+          return visited;
+        visited += 1 + Walk(child);
+      }
+      return visited;
+    }
+
+    //Inserts count single rows one at a time into the middle of the root's first child
+    void InsertMiddle(size_t count)
+    {
+      BenchNode* directory = root()->child(0);
+      for (size_t i = 0; i < count; i++)
+      {
+        int row = directory->rowCount() / 2;
+        directory->BeginInsertChildren(row, 1);
+        directory->InsertChildren(row, 1);
+        BenchNode::EndInsertChildren(this);
+      }
+    }
+  };
+}
+
+//-----------------------------------------------------------------------------
+
+int BenchTreeModel(const Arguments& arguments)
+{
+  size_t nodes             = Argument<size_t>(arguments, 0, 1000000);
+  size_t children_per_node = Argument<size_t>(arguments, 1, 1000);
+  size_t inserts           = Argument<size_t>(arguments, 2, 10000);
+
+  BenchModel model;
+  Stopwatch timer;
+  size_t added = model.Build(nodes, children_per_node);
+  Report("treemodel build", added, "nodes", timer.seconds());
+
+  timer.Restart();
+  size_t visited = model.Walk(QModelIndex());
+  Report("treemodel walk", visited, "indexes", timer.seconds());
+  if (visited != added)
+  {
+    fprintf(stderr, "treemodel: walked %lu of %lu nodes\n", static_cast<unsigned long>(visited),
+            static_cast<unsigned long>(added));
+    return 1;
+  }
+
+  if (inserts > 0 && added > 0)
+  {
+    timer.Restart();
+    model.InsertMiddle(inserts);
+    Report("treemodel insert", inserts, "rows", timer.seconds());
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMPBENCH_END
@@ -0,0 +1,107 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include <qsmp_bench/Bench.h>
+
+#include <boost/bind.hpp>
+#include <qsmp_gui/Cache.h>
+#include <stdexcept>
+#include <stdio.h>
+
+QSMPBENCH_BEGIN
+
+using qsmp::Cache;
+using qsmp::CacheId;
+using qsmp::CachePin;
+using qsmp::CacheThread;
+using qsmp::CacheTreeRef;
+using qsmp::Tree;
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //Called on the cache thread as each tree finishes loading, the main thread only reads the
+  //counts once the prefetch is done
+  struct Counts
+  {
+    Counts():trees_(0),blobs_(0),blob_bytes_(0){}
+    size_t          trees_;
+    size_t          blobs_;
+    boost::uint64_t blob_bytes_;
+  };
+
+  void CountTree(Counts* counts, CacheTreeRef tree)
+  {
+    ++counts->trees_;
+    CachePin<Tree> pin(tree);
+    if (!pin)
+      return;
+    const Tree::Children& children = tree->data_.children_;
+    for (Tree::Children::const_iterator ii = children.begin(); ii != children.end(); ++ii)
+    {
+      if (!ii->blob())
+        continue;
+      CachePin<qsmp::Blob> blob(ii->blob());
+      if (!blob)
+        continue;
+      ++counts->blobs_;
+      counts->blob_bytes_ += ii->blob()->data_.size();
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+int BenchWorkers(const Arguments& arguments)
+{
+  if (arguments.size() < 2)
+    throw std::invalid_argument("workers needs a repository and a commit id");
+  CacheId commit(arguments[1].c_str());
+  size_t workers        = Argument<size_t>(arguments, 2, 0);
+  size_t request_window = Argument<size_t>(arguments, 3, 0);
+  std::string mode      = Argument<std::string>(arguments, 4, "native");
+  size_t depth          = Argument<size_t>(arguments, 5, 64);
+
+  PrepareCache(arguments[0]);
+  Cache::SetReaders(mode == "cat-file" ? CacheThread::Mode_CatFile : CacheThread::Mode_Native,
+                    workers, request_window);
+
+  //Nothing is evicted so every object read is still there to be counted
+  Cache::lease()->SetMemoryBudget(size_t(-1));
+
+  Counts counts;
+  Countdown finished(1);
+  Stopwatch timer;
+  Cache::lease()->PrefetchCommit(commit, depth, boost::bind(&CountTree, &counts, _1),
+                                 boost::bind(&Countdown::Done, &finished));
+  finished.Wait();
+  double seconds = timer.seconds();
+
+  printf("workers: %s, %lu workers (0 is one per core), window %lu (0 is the default)\n",
+         mode.c_str(), static_cast<unsigned long>(workers), static_cast<unsigned long>(request_window));
+  Report("workers", counts.trees_ + counts.blobs_, "objects", seconds, counts.blob_bytes_);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMPBENCH_END
@@ -0,0 +1,138 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include <qsmp_bench/Bench.h>
+
+#include <boost/filesystem/operations.hpp>
+#include <qsmp_gui/Cache.h>
+#include <qsmp_lib/Log.h>
+#include <exception>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+
+QSMPBENCH_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  struct Entry
+  {
+    const char* name_;
+    const char* arguments_;
+    const char* description_;
+    Benchmark   run_;
+  };
+
+  const Entry benchmarks[] =
+  {
+    {"scan", "[objects]",
+     "Scans an in-memory cat-file stream of trees and commits, and checks a signed commit",
+     &BenchScan},
+    {"workers", "<repository> <commit id> [workers] [request window] [native|cat-file] [depth]",
+     "Times prefetching a commit's whole tree with an empty cache",
+     &BenchWorkers},
+    {"paths", "<repository> <tree id> <path list> [rounds]",
+     "Resolves every path in the list below the tree, eg the sort3 paths from git ls-tree -r",
+     &BenchPaths},
+    {"treemodel", "[nodes] [children per node] [inserts]",
+     "Builds a TreeModel breadth first, looks up every index then inserts rows in a large directory",
+     &BenchTreeModel},
+    {"fastimport", "[files] [output file]",
+     "Writes an indexer-like fast-import stream through FastImportWriter, to the null device by default",
+     &BenchFastImport},
+  };
+  const size_t benchmark_count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+  void Usage()
+  {
+    std::cerr << "Usage: qsmp_bench <benchmark> [arguments]\n";
+    for (size_t i = 0; i < benchmark_count; i++)
+      std::cerr << "  " << benchmarks[i].name_ << " " << benchmarks[i].arguments_ << "\n"
+                << "    " << benchmarks[i].description_ << "\n";
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void Report(const std::string& name, boost::uint64_t count, const char* unit, double seconds,
+            boost::uint64_t bytes)
+{
+  if (seconds <= 0)
+    seconds = 1e-6;
+  printf("%s: %llu %s in %.3fs, %.0f %s/s", name.c_str(), (unsigned long long)count, unit,
+         seconds, count / seconds, unit);
+  if (bytes != 0)
+    printf(", %.1f MB/s", bytes / seconds / (1024 * 1024));
+  printf("\n");
+  fflush(stdout);
+}
+
+//-----------------------------------------------------------------------------
+
+void PrepareCache(const std::string& repository)
+{
+  fs::path home = fs::temp_directory_path() / "qsmp_bench";
+  fs::remove_all(home);
+  fs::create_directories(home);
+#ifdef WIN32
+  _putenv_s("APPDATA", home.string().c_str());
+#else
+  setenv("HOME", home.string().c_str(), 1);
+#endif
+
+  //The first context made for a key sets its defaults, the cache's own contexts inherit this
+  qsmp::LogContext("Cache", qsmp::LogDefaults_Disable);
+  qsmp::Cache::SetRepository(repository);
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMPBENCH_END
+
+int main(int argc, char* argv[])
+{
+  using namespace qsmp_bench;
+  if (argc < 2)
+  {
+    Usage();
+    return 1;
+  }
+
+  const std::string name = argv[1];
+  for (size_t i = 0; i < benchmark_count; i++)
+  {
+    if (name != benchmarks[i].name_)
+      continue;
+    try
+    {
+      return benchmarks[i].run_(Arguments(argv + 2, argv + argc));
+    }
+    catch (std::exception& e)
+    {
+      std::cerr << "qsmp_bench: " << e.what() << "\n";
+      return 1;
+    }
+  }
+  Usage();
+  return 1;
+}
@@ -19,26 +19,18 @@
 #include <qsmp_gui/Cache.h>
 
 #include <boost/assign/list_of.hpp>
-#include <boost/iostreams/device/array.hpp>
+#include <boost/date_time/posix_time/conversion.hpp>
+#include <boost/format.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/range.hpp>
-#include <boost/regex.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <qsmp_gui/CatFileScanner.h>
 #include <qsmp_lib/Log.h>
-#include <qsmp_gui/Cache.h>
-
-namespace boost
-{
-  inline range_iterator<sub_match<char*> >::type
-    range_begin(const sub_match<char*>& match)
-  {
-    return match.first;
-  }
-
-  inline range_iterator<sub_match<char*> >::type
-    range_end(const sub_match<char*>& match)
-  {
-    return match.second;
-  }
-}
+#include <qsmp_lib/PersistantPath.h>
+#ifdef UNIX
+#include <sys/uio.h>
+#endif
 
 QSMP_BEGIN
 
@@ -122,42 +114,47 @@ namespace cache
   {
   public:
     CatFileState(LogContext parent)
-      : log_(parent / "HeaderState"),
-        regex_("\\A\\n?([[:xdigit:]]{40}) (\\w+) (\\d+)\\n"),
-        missing_regex_("\\A\\n?([[:xdigit:]]{40}) missing\\n")
+      : log_(parent / "HeaderState")
     {
     }
     boost::function<void (const CatFileDeclaration&)> OnDeclaration;
+    boost::function<void (const CacheId&)>            OnMissing;
 
     virtual void  Reset(const CatFileDeclaration& declaration)
     {
     }
     virtual char* ProcessData(char* start, char* end)
     {
-      boost::match_results<char*> matches;
-      if (boost::regex_search(start,end,matches,regex_))
-      {
-        declaration_.id_.FromTextString(matches[1]);
-        declaration_.type_ = FromString(matches[2]);
-        io::stream<io::array_source> length(matches[3].first,matches[3].second);
-        length >> declaration_.length_;
+      CatFileHeaderScan header;
+      bool invalid;
+      char* next = const_cast<char*>(ScanCatFileHeader(start,end,header,invalid));
+      if (!next)
+        return start;
 
-        start += boost::size(matches[0]);
+      if (invalid)
+      {
+        FWARNING(log_, "Invalid header: %1%") % std::string(start,next);
+      }
+      else if (header.missing_)
+      {
+        FLOG(log_, "Missing: %1%") % std::string(header.id_,40);
+        CacheId id;
+        id.FromTextString(boost::make_iterator_range(header.id_,header.id_ + 40));
+        OnMissing(id);
+      }
+      else
+      {
+        declaration_.id_.FromTextString(boost::make_iterator_range(header.id_,header.id_ + 40));
+        declaration_.type_   = FromString(boost::make_iterator_range(header.type_,header.type_ + header.type_length_));
+        declaration_.length_ = header.length_;
 
         FLOG(log_, "Header: %1%") % declaration_;
         OnDeclaration(declaration_);
       }
-      else if (boost::regex_search(start,end,matches,missing_regex_))
-      {
-        FLOG(log_, "Missing: %1%") % matches[1];
-        start += boost::size(matches[0]);
-      }
-      return start;
+      return next;
     }
   private:
     const LogContext         log_;
-    const boost::regex       regex_;
-    const boost::regex       missing_regex_;
     CatFileDeclaration declaration_;
   };
 
@@ -166,9 +163,6 @@ namespace cache
   public:
     CommitState(LogContext parent)
       : log_(parent/"CommitState"),
-        tree_("\\Atree ([[:xdigit:]]{40})\\n"),
-        parent_("\\Aparent ([[:xdigit:]]{40})\\n"),
-        header_tail_("\\n\\n"),
         header_finished_(false)
     {
     }
@@ -184,34 +178,51 @@ namespace cache
     }
     virtual char* ProcessData(char* start, char* end)
     {
-      if (!header_finished_)
+      char* object_end = start + std::min(size_t(end - start),declaration_.length_);
+      while (!header_finished_)
       {
-        boost::match_results<char*> matches;
-        if (boost::regex_search(start,end,matches,tree_))
+        CommitHeaderScan header;
+        char* next = const_cast<char*>(ScanCommitHeader(start,object_end,header));
+        if (!next)
+          break;
+
+        if (header.continuation_)
+        {
+          //None of the headers we read span more than one line
+        }
+        else if (header.key_length_ == 0)
+        {
+          header_finished_ = true;
+          LOG(log_) << "Header finished";
+        }
+        else if (KeyEquals(header,"tree") && header.value_length_ == 40)
         {
           CacheId id;
-          id.FromTextString(matches[1]);
+          id.FromTextString(boost::make_iterator_range(header.value_,header.value_ + 40));
           commit_.tree_ = Cache::lease()->LookupCacheTree(id);
-          start = matches[0].second;
-          declaration_.length_ -= boost::size(matches[0]);
           FLOG(log_, "Tree: Id %1%") % id;
         }
-        if (boost::regex_search(start,end,matches,parent_))
+        else if (KeyEquals(header,"parent") && header.value_length_ == 40)
         {
           CacheId id;
-          id.FromTextString(matches[1]);
+          id.FromTextString(boost::make_iterator_range(header.value_,header.value_ + 40));
           commit_.parents_.push_back(Cache::lease()->LookupCacheCommit(id));
-          start = matches[0].second;
-          declaration_.length_ -= boost::size(matches[0]);
           FLOG(log_, "Parent: Id %1%") % id;
         }
-        if (boost::regex_search(start,end,matches,header_tail_))
+        else if (KeyEquals(header,"committer"))
         {
-          header_finished_ = true;
-          declaration_.length_ -= matches[0].second - start;
-          start = matches[0].second;
-          LOG(log_) << "Header finished";
+          //"<name> <<email>> <seconds since epoch> <timezone>"
+          const char* value_end = header.value_ + header.value_length_;
+          const char* email_end = std::find(std::reverse_iterator<const char*>(value_end),
+                                            std::reverse_iterator<const char*>(header.value_),
+                                            '>').base();
+          std::time_t seconds = 0;
+          for (const char* ii = email_end + 1; ii < value_end && '0' <= *ii && *ii <= '9'; ++ii)
+            seconds = seconds * 10 + (*ii - '0');
+          commit_.commit_date_ = boost::posix_time::from_time_t(seconds);
         }
+        declaration_.length_ -= next - start;
+        start = next;
       }
       if (header_finished_)
       {
@@ -235,9 +246,6 @@ namespace cache
     CatFileDeclaration declaration_;
     LogContext         log_;
     Commit             commit_;
-    boost::regex       tree_;
-    boost::regex       parent_;
-    boost::regex       header_tail_;
     bool               header_finished_;
   };
 
@@ -245,9 +253,7 @@ namespace cache
   {
   public:
     TreeState(LogContext parent)
-      : log_(parent/"TreeState"),
-        item_("\\A([0-7]+) ([^\\x00]+)\\x00(.{20})")
-        
+      : log_(parent/"TreeState")
     {}
     boost::function<void (CacheTreeRef)> OnTree;
 
@@ -259,36 +265,44 @@ namespace cache
     }
     virtual char* ProcessData(char* start, char* end)
     {
-      boost::match_results<char*> matches;
-      while(declaration_.length_ > 0 && boost::regex_search(start,end,matches,item_))
+      Cache::lease cache;
+      char* object_end = start + std::min(size_t(end - start),declaration_.length_);
+      while(declaration_.length_ > 0)
       {
-        //Grab the item type
-        io::stream<io::array_source> item_type_source(matches[1].first,matches[1].second);
-        uint item_type;
-        std::oct(item_type_source);
-        item_type_source >> item_type;
+        TreeEntryScan item;
+        bool invalid;
+        char* next = const_cast<char*>(ScanTreeEntry(start,object_end,item,invalid));
+        if (!next)
+          break;
 
-        //Grab the name
-        Tree::Entry entry;
-        entry.name_ = QString::fromUtf8(boost::begin(matches[2]),boost::size(matches[2]));
+        if (invalid)
+        {
+          FWARNING(log_, "Invalid tree entry in %1%") % declaration_.id_;
+        }
+        else
+        {
+          //Grab the name
+          Tree::Entry entry;
+          entry.name_ = cache->names().Intern(item.name_,item.name_length_);
 
-        //Grab the id
-        CacheId id;
-        id.FromBinString(matches[3]);
-        if (item_type & TIF_Blob)
-          entry.blob_ = Cache::lease()->LookupCacheBlob(id);
-        else if (item_type & TIF_Tree)
-          entry.tree_ = Cache::lease()->LookupCacheTree(id);
-
-        //Insert into list
-        tree_.children_.push_back(entry);
-        declaration_.length_ -= boost::size(matches[0]);
-        start += boost::size(matches[0]);
-
-        FLOG(log_, "Processed item: Type %1%, Id %2%, Name %3%") 
-          % boost::io::group(std::oct,item_type)
-          % id
-          % entry.name_;
+          //Grab the id
+          CacheId id;
+          id.FromBinString(boost::make_iterator_range(item.id_,item.id_ + 20));
+          if (item.mode_ & TIF_Blob)
+            entry = Tree::Entry(entry.name_, cache->LookupCacheBlob(id));
+          else if (item.mode_ & TIF_Tree)
+            entry = Tree::Entry(entry.name_, cache->LookupCacheTree(id));
+
+          //Insert into list
+          tree_.children_.push_back(entry);
+
+          FLOG(log_, "Processed item: Type %1%, Id %2%, Name %3%") 
+            % boost::io::group(std::oct,item.mode_)
+            % id
+            % std::string(item.name_,item.name_length_);
+        }
+        declaration_.length_ -= next - start;
+        start = next;
       }
       if (declaration_.length_ == 0)
       {
@@ -296,14 +310,13 @@ namespace cache
         //Remove a trailing newline if necessary
         if (end-start > 0 && *start == '\n')
           start++;
-        CacheTreeRef tree = Cache::lease()->SetTree(declaration_.id_,tree_);
+        CacheTreeRef tree = cache->SetTree(declaration_.id_,tree_,true);
         OnTree(tree);
       }
       return start;
     }
   private:
     const LogContext         log_;
-    const boost::regex       item_;
     CatFileDeclaration       declaration_;
     Tree                     tree_;
   };
@@ -312,7 +325,8 @@ namespace cache
   {
   public:
     BlobState(LogContext parent)
-      : log_(parent/"BlobState")
+      : log_(parent/"BlobState"),
+        filled_(0)
     {}
     boost::function<void (CacheBlobRef)> OnBlob;
 
@@ -320,26 +334,103 @@ namespace cache
     {
       LOG(log_) << "Reset";
       declaration_ = declaration;
-      blob_        = Blob();
+      //The blob gets its own buffer sized up front so the data can be read straight into it
+      data_        = Blob();
+      data_.resize(int(declaration_.length_));
+      filled_      = 0;
     }
     virtual char* ProcessData(char* start, char* end)
     {
-      size_t length_to_use = std::min(size_t(end-start), declaration_.length_);
-      declaration_.length_ -= length_to_use;
-      blob_ += QString::fromUtf8(start,length_to_use);
-      start += length_to_use;
-      if (declaration_.length_ == 0)
+      size_t length_to_use = std::min(size_t(end-start), remaining());
+      std::copy(start, start + length_to_use, remaining_begin());
+      Filled(length_to_use);
+      return start + length_to_use;
+    }
+
+    char*  remaining_begin(){return data_.data() + filled_;}
+    size_t remaining()const{return declaration_.length_ - filled_;}
+
+    //Called once length bytes have been written to remaining_begin()
+    void Filled(size_t length)
+    {
+      filled_ += length;
+      if (filled_ == declaration_.length_)
       {
         LOG(log_) << "Finish";
-        CacheBlobRef blob = Cache::lease()->SetBlob(declaration_.id_,blob_);
+        CacheBlobRef blob = Cache::lease()->SetBlob(declaration_.id_,data_,true);
+        data_ = Blob();
         OnBlob(blob);
       }
-      return start;
     }
   private:
     CatFileDeclaration declaration_;
     LogContext         log_;
-    Blob               blob_;
+    Blob               data_;
+    size_t             filled_;
+  };
+
+  //-----------------------------------------------------------------------------
+  //-----------------------------------------------------------------------------
+  //-----------------------------------------------------------------------------
+
+  //Buffer for the git output. Data is consumed from the front and read into the back, the
+  //unconsumed data is only moved back to the front when we run out of space. It grows when an
+  //object declares itself larger than the buffer so that it can be parsed in one go.
+  class ReadBuffer
+  {
+  public:
+    enum
+    {
+      ReadSize      = 64 * 1024,
+      MaxIdleSize   = 4 * ReadSize,
+    };
+    ReadBuffer()
+      : data_(ReadSize),begin_(0),end_(0)
+    {}
+
+    char*  begin(){return &data_[0] + begin_;}
+    char*  end(){return &data_[0] + end_;}
+    size_t size()const{return end_ - begin_;}
+    size_t space()const{return data_.size() - end_;}
+
+    void Consume(char* new_begin)
+    {
+      begin_ = new_begin - &data_[0];
+      if (begin_ == end_)
+      {
+        begin_ = end_ = 0;
+        //Don't hang on to the space used by a huge tree
+        if (data_.size() > MaxIdleSize)
+          std::vector<char>(ReadSize).swap(data_);
+      }
+    }
+    void Commit(size_t length)
+    {
+      end_ += length;
+    }
+
+    //Makes sure length bytes starting at begin() fit in the buffer
+    void Reserve(size_t length)
+    {
+      if (begin_ + length <= data_.size())
+        return;
+      if (length <= data_.size())
+      {
+        memmove(&data_[0], begin(), size());
+      }
+      else
+      {
+        std::vector<char> data(std::max(length, data_.size() * 2));
+        std::copy(begin(), end(), data.begin());
+        data_.swap(data);
+      }
+      end_  -= begin_;
+      begin_ = 0;
+    }
+  private:
+    std::vector<char> data_;
+    size_t            begin_;
+    size_t            end_;
   };
 
   //-----------------------------------------------------------------------------
@@ -349,30 +440,34 @@ namespace cache
   struct ProcessData
   {
   public:
-    ProcessData(LogContext context, CacheThread* cache_thread);
+    ProcessData(LogContext context, CacheWorker* worker);
     void operator()(Process::Fd stdout_fd);
+    void ProcessObject(const CacheId& id, GitObject& object);
   private:
+    bool Read(Process::Fd stdout_fd);
     void OnDeclaration(const cache::CatFileDeclaration& declaration);
 
     void OnCommit(CacheCommitRef commit);
     void OnTree(CacheTreeRef tree);
     void OnBlob(CacheBlobRef blob);
+    void OnMissing(const CacheId& id);
 
     LogContext log_;
     LogContext log_profile_;
     bool more_to_process_;
+    ReadBuffer buffer_;
     CatFileDeclaration  declaration_;
     State* state_;
     CatFileState cat_file_state_;
     BlobState    blob_state_;
     TreeState    tree_state_;
     CommitState  commit_state_;
-    CacheThread* cache_thread_;
+    CacheWorker* worker_;
   };
 
   //-----------------------------------------------------------------------------
 
-  ProcessData::ProcessData(LogContext context, CacheThread* cache_thread)
+  ProcessData::ProcessData(LogContext context, CacheWorker* worker)
     : log_(context),
       log_profile_(context,"Profile"),
       more_to_process_(false),
@@ -380,7 +475,7 @@ namespace cache
       blob_state_(log_),
       tree_state_(log_),
       commit_state_(log_),
-      cache_thread_(cache_thread)
+      worker_(worker)
   {
   }
 
@@ -390,56 +485,138 @@ namespace cache
   {
     LOG(log_) << "Starting";
     cat_file_state_.OnDeclaration = boost::bind(&ProcessData::OnDeclaration,this,_1);
+    cat_file_state_.OnMissing     = boost::bind(&ProcessData::OnMissing,this,_1);
     commit_state_.OnCommit = boost::bind(&ProcessData::OnCommit,this,_1);
     tree_state_.OnTree     = boost::bind(&ProcessData::OnTree,this,_1);
     blob_state_.OnBlob     = boost::bind(&ProcessData::OnBlob,this,_1);
     state_ = &cat_file_state_;
 
-    boost::array<char,4096> buffer;
-#ifdef WIN32
-    DWORD just_read = 0;
-#else
-    ssize_t just_read = 0;
-#endif
-    size_t already_read = 0;
     for(;;)
     {
       LOG(log_) << "Main loop";
       QSMP_PROFILE(log_profile_,"Main loop");
-      if (!more_to_process_)
-      {
-#ifdef WIN32
-        ReadFile(stdout_fd, &buffer[already_read], buffer.size() - already_read, &just_read, NULL);
-#else
-        just_read = read(stdout_fd, &buffer[already_read], buffer.size() - already_read);
-        if (just_read == -1)
-        {
-          //ERROR
-          ERRNO_LOG(log_);
-          break;
-        }
-        else if (just_read == 0)
-        {
-          //EOF
-          LOG(log_) << "EOF";
-          break;
-        }
-#endif
-      }
-      FLOG(log_, "Git input: Read %1%, Already in buffer %2%") % just_read % already_read;
+      if (!more_to_process_ && !Read(stdout_fd))
+        break;
+
       more_to_process_ = false;
-      char* start = &buffer[0];
-      char* end   = start + already_read + just_read;
+      char* start = buffer_.begin();
+      char* end   = buffer_.end();
       char* new_start = state_->ProcessData(start,end);
       LOG(log_) << "Data processed: " << new_start - start;
-      ASSERTE(log_, &*buffer.begin() <= new_start && new_start <= &*buffer.end());
-      if (new_start < end)
-        memmove(start,new_start,end - new_start);
-      else
-        more_to_process_ = false;
-      already_read = end - new_start;
-      just_read = 0;
+      ASSERTE(log_, start <= new_start && new_start <= end);
+      buffer_.Consume(new_start);
+
+      //If we got somewhere then there may well be another complete header or object waiting
+      if (new_start != start && buffer_.size() > 0)
+        more_to_process_ = true;
+    }
+  }
+
+  //-----------------------------------------------------------------------------
+
+  bool ProcessData::Read(Process::Fd stdout_fd)
+  {
+    //Anything still sitting in the buffer has already been given to the blob so the rest of the
+    //blob can go straight into its own storage with anything after it going into the buffer
+    bool direct = (state_ == &blob_state_ && buffer_.size() == 0 && blob_state_.remaining() > 0);
+    if (!direct)
+    {
+      //Make room for the whole of a tree or commit so that it gets parsed in one pass
+      if (state_ == &tree_state_ || state_ == &commit_state_)
+        buffer_.Reserve(declaration_.length_ + 1);
+      if (buffer_.space() < ReadBuffer::ReadSize / 2)
+        buffer_.Reserve(buffer_.size() + ReadBuffer::ReadSize);
+    }
+
+#ifdef WIN32
+    DWORD just_read = 0;
+    BOOL  success;
+    if (direct)
+      success = ReadFile(stdout_fd, blob_state_.remaining_begin(), blob_state_.remaining(), &just_read, NULL);
+    else
+      success = ReadFile(stdout_fd, buffer_.end(), buffer_.space(), &just_read, NULL);
+    if (!success || just_read == 0)
+    {
+      LOG(log_) << "EOF";
+      return false;
+    }
+    size_t to_blob = direct ? just_read : 0;
+#else
+    ssize_t just_read;
+    size_t  to_blob = 0;
+    if (direct)
+    {
+      boost::array<iovec,2> io;
+      io[0].iov_base = blob_state_.remaining_begin();
+      io[0].iov_len  = blob_state_.remaining();
+      io[1].iov_base = buffer_.end();
+      io[1].iov_len  = buffer_.space();
+      just_read = readv(stdout_fd, &io[0], io.size());
+      if (just_read > 0)
+        to_blob = std::min(size_t(just_read), blob_state_.remaining());
+    }
+    else
+    {
+      just_read = read(stdout_fd, buffer_.end(), buffer_.space());
+    }
+
+    if (just_read == -1)
+    {
+      //ERROR
+      ERRNO_LOG(log_);
+      return false;
+    }
+    else if (just_read == 0)
+    {
+      //EOF
+      LOG(log_) << "EOF";
+      return false;
+    }
+#endif
+    FLOG(log_, "Git input: Read %1%, To blob %2%, Already in buffer %3%") % just_read % to_blob % buffer_.size();
+    buffer_.Commit(just_read - to_blob);
+    if (to_blob > 0)
+      blob_state_.Filled(to_blob);
+    return true;
+  }
+
+  //-----------------------------------------------------------------------------
+
+  //Objects read natively arrive whole so we can skip the header state and hand the data straight
+  //to the appropriate object state
+  void ProcessData::ProcessObject(const CacheId& id, GitObject& object)
+  {
+    commit_state_.OnCommit = boost::bind(&ProcessData::OnCommit,this,_1);
+    tree_state_.OnTree     = boost::bind(&ProcessData::OnTree,this,_1);
+    blob_state_.OnBlob     = boost::bind(&ProcessData::OnBlob,this,_1);
+
+    CatFileDeclaration declaration;
+    declaration.id_     = id;
+    declaration.length_ = object.data_.size();
+    switch(object.type_)
+    {
+    case GitObjectType_Commit:
+      declaration.type_ = GitDataType_Commit;
+      break;
+    case GitObjectType_Tree:
+      declaration.type_ = GitDataType_Tree;
+      break;
+    case GitObjectType_Tag:
+      declaration.type_ = GitDataType_Tag;
+      break;
+    case GitObjectType_Blob:
+    default:
+      declaration.type_ = GitDataType_Blob;
+      break;
     }
+    FLOG(log_, "Native object: %1%") % declaration;
+    OnDeclaration(declaration);
+
+    char* start = object.data_.empty() ? NULL : &object.data_[0];
+    char* end   = start + object.data_.size();
+    char* new_start = state_->ProcessData(start,end);
+    if (new_start != end)
+      FWARNING(log_, "Object not fully processed: Id %1%, %2% bytes left") % id % (end - new_start);
   }
 
   //-----------------------------------------------------------------------------
@@ -472,7 +649,7 @@ namespace cache
     more_to_process_ = true;
     state_ = &cat_file_state_;
     state_->Reset(declaration_);
-    cache_thread_->OnCommit(commit);
+    worker_->OnCommit(commit);
   }
 
   //-----------------------------------------------------------------------------
@@ -482,7 +659,7 @@ namespace cache
     more_to_process_ = true;
     state_ = &cat_file_state_;
     state_->Reset(declaration_);
-    cache_thread_->OnTree(tree);
+    worker_->OnTree(tree);
   }
 
   //-----------------------------------------------------------------------------
@@ -492,7 +669,14 @@ namespace cache
     more_to_process_ = true;
     state_ = &cat_file_state_;
     state_->Reset(declaration_);
-    cache_thread_->OnBlob(blob);
+    worker_->OnBlob(blob);
+  }
+
+  //-----------------------------------------------------------------------------
+
+  void ProcessData::OnMissing(const CacheId& id)
+  {
+    worker_->OnMissing(id);
   }
 
 }
@@ -502,256 +686,1495 @@ namespace cache
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
-class RecursiveListing : public CacheThread::Task
+//Loads a tree breadth first down to a fixed depth. Each level is only requested once the level
+//above it has arrived, at which point every unknown subtree in the next level and every unknown
+//blob in this level go out together.
+class CachePrefetch : public CacheThread::Task
 {
 public:
+  CachePrefetch(LogContext log, const CacheId& id, bool commit, size_t depth,
+                Cache::SubtreeCallback on_subtree, Cache::PrefetchCallback on_finish)
+    : log_(log),
+      id_(id),
+      commit_(commit),
+      depth_(depth),
+      on_subtree_(on_subtree),
+      on_finish_(on_finish),
+      level_pending_(0)
+  {
+  }
+
   void operator()(CacheThread::FinishCallback finish,
                   CacheThread::RequestCallback request)
   {
     finish_  = finish;
     request_ = request;
-    count_   = 0;
-    second_count_ = 0;
-    count_++;
-    second_count_++;
-    request_(CacheId("7a1e8b5b31087018f993cfd39e104d33344fe86b"));
-  }
-private:
-  virtual void OnTree(CacheTreeRef tree)
-  {
-    for(Tree::Children::const_iterator ii = tree->data_.children_.begin();
-        ii != tree->data_.children_.end();
-        ++ii)
+    FLOG(log_, "Prefetching %1% to depth %2%") % id_ % depth_;
+    if (commit_)
     {
-      if (ii->tree_ && !ii->tree_->valid_)
-      {
-        second_count_++;
-        count_++;
-        request_(ii->tree_->id_);
-      }
-      else if (ii->blob_ && !ii->blob_->valid_)
-      {
-        second_count_++;
-        count_++;
-        request_(ii->blob_->id_);
-      }
+      CacheCommitRef commit = Cache::lease()->LookupCacheCommit(id_);
+      if (commit->valid_)
+        OnCommit(commit);
+      else
+        request_(id_);
     }
-    if (--count_ == 0)
+    else
     {
-      Cache::lease lease;
-      LOG("test") << "finished";
-      finish_();
+      Start(Cache::lease()->LookupCacheTree(id_));
     }
   }
-  virtual void OnBlob(CacheBlobRef blob)
+
+private:
+  struct Node
+  {
+    Node(CacheTreeRef tree, Node* parent, size_t depth)
+      : tree_(tree),parent_(parent),depth_(depth),pending_(0),pinned_(false){}
+    CacheTreeRef  tree_;
+    Node*         parent_;
+    size_t        depth_;
+    //Blobs and subtrees still to be loaded
+    size_t        pending_;
+    //The tree is pinned from when it's loaded until its level is expanded, so a tree which came
+    //in early in the level can't be evicted while the rest of the level loads
+    bool          pinned_;
+  };
+  typedef std::vector<Node*>                        Nodes;
+  typedef boost::unordered_map<CacheId,Nodes>       Waiting;
+
+  virtual void OnCommit(CacheCommitRef commit)
   {
-    if (--count_ == 0)
+    if (!commit->valid_ || !commit->data_.tree() || depth_ == 0)
     {
-      Cache::lease lease;
-      LOG("test") << "finished";
-      finish_();
+      Finish();
+      return;
     }
+    Start(commit->data_.tree());
   }
-  int second_count_;
-  int count_;
-  CacheThread::FinishCallback  finish_;
-  CacheThread::RequestCallback request_;
-};
-
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-
-CacheThread::CacheThread(LogContext log, const fs::path& path)
-: log_(log),
-  log_read_(log/"Read"),
-  log_write_(log/"Write"),
-  log_write_profile_(log_write_/"Profile"),
-  git_(log/"Git", "/usr/bin/git", path, boost::assign::list_of("git")("cat-file")("--batch")),
-  git_stdin_(git_.stdin_fd()),
-  read_thread_(boost::bind(&CacheThread::ReadThread,this)),
-  write_thread_(boost::bind(&CacheThread::WriteThread,this))
-{
-  LOG(log_) << "Launching git";
-  //git_stdin_ << "73d23d6bb61c8e41dba58dc2576910c3738f21ef\n" //head commit
-             //<< "ed448d4618c266cfbbc2ae74daf85d98bed66976\n" //head tree
-             //<< "3914f69f2daa00a492a570998e15477c82f228a0\n" //some random blob
-             //<< std::flush;
-  //AddTask(spnew<RecursiveListing>());
-}
 
-//-----------------------------------------------------------------------------
-
-void CacheThread::AddTask(shared_ptr<Task> task)
-{
-  LOG(log_) << "Adding task";
-  guard g(task_queue_lock_);
-  bool start = task_queue_.empty();
-  task_queue_.push(task);
-  task_signal_.notify_one();
-}
-
-//-----------------------------------------------------------------------------
+  virtual void OnTree(CacheTreeRef tree)
+  {
+    TreeLoaded(tree->id_);
+  }
 
-void CacheThread::ReadThread()
-{
-  LOG(log_read_) << "Init";
-  try
+  virtual void OnBlob(CacheBlobRef blob)
   {
-    cache::ProcessData data(log_read_,this);
-    data(git_.stdout_fd());
+    BlobLoaded(blob->id_);
   }
-  catch(std::exception& e)
+
+  virtual void OnMissing(const CacheId& id)
   {
-    FATAL(log_read_) << e.what();
+    FWARNING(log_, "Missing: %1%") % id;
+    if (commit_ && id == id_)
+      Finish();
+    else if (trees_.count(id))
+      TreeLoaded(id);
+    else
+      BlobLoaded(id);
   }
-}
 
-//-----------------------------------------------------------------------------
+  void Start(CacheTreeRef tree)
+  {
+    if (depth_ == 0)
+    {
+      Finish();
+      return;
+    }
+    nodes_.push_back(new Node(tree, NULL, depth_));
+    Nodes level(1, &nodes_.back());
+    StartLevel(level);
+  }
 
-void CacheThread::WriteThread()
-{
-  LOG(log_write_) << "Init";
-  try
+  //Requests every tree in the level which isn't already loaded
+  void StartLevel(const Nodes& level)
   {
-    for(;;)
+    Cache::lease cache;
+    level_ = level;
+    for (Nodes::const_iterator ii = level.begin(); ii != level.end(); ++ii)
     {
-      if (task_queue_.empty())
+      (*ii)->pinned_ = cache->Pin((*ii)->tree_);
+      if ((*ii)->pinned_)
+        continue;
+      Nodes& waiting = trees_[(*ii)->tree_->id_];
+      if (waiting.empty())
       {
-        boost::unique_lock<boost::mutex> lock(task_queue_lock_);
-        while (task_queue_.empty())
-        {
-          task_signal_.wait(lock);
-        }
+        ++level_pending_;
+        request_((*ii)->tree_->id_);
       }
+      waiting.push_back(*ii);
+    }
+    if (level_pending_ == 0)
+      ExpandLevel();
+  }
 
-      LOG(log_write_) << "Starting new task";
+  //Also called if git doesn't have the tree, in which case it can't be pinned and is expanded as
+  //if it were empty
+  void TreeLoaded(const CacheId& id)
+  {
+    Waiting::iterator ii = trees_.find(id);
+    if (ii == trees_.end())
+      return;
+    Cache::lease cache;
+    for (Nodes::iterator node = ii->second.begin(); node != ii->second.end(); ++node)
+      (*node)->pinned_ = cache->Pin((*node)->tree_);
+    trees_.erase(ii);
+    if (--level_pending_ == 0)
+      ExpandLevel();
+  }
+
+  //Every tree in the level has been loaded, queue up their blobs and the next level down
+  void ExpandLevel()
+  {
+    Cache::lease cache;
+    Nodes next;
+    Nodes done;
+    for (Nodes::iterator ii = level_.begin(); ii != level_.end(); ++ii)
+    {
+      Node* node = *ii;
+      if (!node->pinned_)
       {
-        guard g(task_queue_lock_);
-        current_task_ = task_queue_.front();
-        task_queue_.pop();
+        done.push_back(node);
+        continue;
       }
-      current_task_->operator()(boost::bind(&CacheThread::Finish,this),boost::bind(&CacheThread::RequestId,this,_1));
-      LOG(log_write_) << "Flushing";
-      git_stdin_ << std::flush;
-
-      while(current_task_)
+      const Tree::Children& children = node->tree_->data_.children_;
+      for (Tree::Children::const_iterator child = children.begin(); child != children.end(); ++child)
       {
-        QSMP_PROFILE(log_write_profile_,"Main loop");
+        if (CacheBlobRef blob = child->blob())
         {
-          boost::unique_lock<boost::mutex> lock(cache_queues_lock_);
-          while(commit_queue_.empty() && tree_queue_.empty() && blob_queue_.empty())
-          {
-            cache_queues_signal_.wait(lock);
-          }
+          if (blob->valid_)
+            continue;
+          Nodes& waiting = blobs_[blob->id_];
+          if (waiting.empty())
+            request_(blob->id_);
+          waiting.push_back(node);
+          ++node->pending_;
         }
-        for(;;)
+        else if (CacheTreeRef tree = child->tree())
         {
-          CacheCommitRef commit = NULL;
-          CacheTreeRef tree = NULL;
-          CacheBlobRef blob = NULL;
-          {
-            guard g(cache_queues_lock_);
-            if (!commit_queue_.empty())
-            {
-              commit = commit_queue_.front();
-              commit_queue_.pop_front();
-            }
-            if (!tree_queue_.empty())
-            {
-              tree = tree_queue_.front();
-              tree_queue_.pop_front();
-            }
-            if (!blob_queue_.empty())
-            {
-              blob = blob_queue_.front();
-              blob_queue_.pop_front();
-            }
-          }
-          if (commit)
-          {
-            FLOG(log_write_, "Giving commit to task: Id %1%") % commit->id_;
-            current_task_->OnCommit(commit);
-          }
-          if (tree)
-          {
-            FLOG(log_write_, "Giving tree to task: Id %1%") % tree->id_;
-            current_task_->OnTree(tree);
-          }
-          if (blob)
-          {
-            FLOG(log_write_, "Giving blob to task: Id %1%") % blob->id_;
-            current_task_->OnBlob(blob);
-          }
-          if (!commit && !tree && !blob)
-            break;
+          if (node->depth_ <= 1)
+            continue;
+          nodes_.push_back(new Node(tree, node, node->depth_ - 1));
+          next.push_back(&nodes_.back());
+          ++node->pending_;
         }
-        LOG(log_write_) << "Flushing";
-        git_stdin_ << std::flush;
       }
+      cache->Unpin(node->tree_);
+      node->pinned_ = false;
+      if (node->pending_ == 0)
+        done.push_back(node);
     }
+
+    //Completing a node can finish the whole prefetch so only do it once the level has been walked
+    if (!next.empty())
+      StartLevel(next);
+    for (Nodes::iterator ii = done.begin(); ii != done.end(); ++ii)
+      Complete(*ii);
   }
-  catch(std::exception& e)
+
+  void BlobLoaded(const CacheId& id)
   {
-    FATAL(log_write_) << e.what();
+    Waiting::iterator ii = blobs_.find(id);
+    if (ii == blobs_.end())
+      return;
+    Nodes waiting;
+    waiting.swap(ii->second);
+    blobs_.erase(ii);
+    for (Nodes::iterator node = waiting.begin(); node != waiting.end(); ++node)
+    {
+      if (--(*node)->pending_ == 0)
+        Complete(*node);
+    }
   }
-}
 
-//-----------------------------------------------------------------------------
+  void Complete(Node* node)
+  {
+    for (;;)
+    {
+      if (on_subtree_)
+        on_subtree_(node->tree_);
+      node = node->parent_;
+      if (!node)
+      {
+        Finish();
+        return;
+      }
+      if (--node->pending_ != 0)
+        return;
+    }
+  }
 
-void CacheThread::Finish()
-{
-  LOG(log_write_) << "Finish";
-  current_task_.reset();
-}
+  void Finish()
+  {
+    FLOG(log_, "Finished prefetching %1%") % id_;
+    if (on_finish_)
+      on_finish_();
+    finish_();
+  }
+
+  LogContext                    log_;
+  CacheId                       id_;
+  bool                          commit_;
+  size_t                        depth_;
+  Cache::SubtreeCallback        on_subtree_;
+  Cache::PrefetchCallback       on_finish_;
+  CacheThread::FinishCallback   finish_;
+  CacheThread::RequestCallback  request_;
+
+  boost::ptr_vector<Node>       nodes_;
+  Nodes                         level_;
+  size_t                        level_pending_;
+  //The nodes waiting on each requested id, an id is only requested by its first waiter
+  Waiting                       trees_;
+  Waiting                       blobs_;
+};
 
 //-----------------------------------------------------------------------------
 
-void CacheThread::RequestId(const CacheId& id)
+//Fetches a batch of objects, making the promise ready once every one of them has come back
+class CacheFetch : public CacheThread::Task
 {
-  FLOG(log_write_, "Getting %1%") % id;
-  git_stdin_ << id << "\n";
-}
+public:
+  CacheFetch(const std::vector<CacheId>& ids, CachePromise promise)
+    : ids_(ids),promise_(promise),pending_(0){}
 
-//-----------------------------------------------------------------------------
+  void operator()(CacheThread::FinishCallback finish,
+                  CacheThread::RequestCallback request)
+  {
+    finish_  = finish;
+    pending_ = ids_.size();
+    if (pending_ == 0)
+    {
+      Finish();
+      return;
+    }
+    for (std::vector<CacheId>::const_iterator ii = ids_.begin(); ii != ids_.end(); ++ii)
+      request(*ii);
+  }
+private:
+  virtual void OnCommit(CacheCommitRef commit){Arrived();}
+  virtual void OnTree(CacheTreeRef tree){Arrived();}
+  virtual void OnBlob(CacheBlobRef blob){Arrived();}
+  virtual void OnMissing(const CacheId& id){Arrived();}
 
-void CacheThread::OnCommit(CacheCommitRef commit)
-{
-  FLOG(log_read_, "Got commit: %1%") % commit->id_;
-  guard g(cache_queues_lock_);
-  commit_queue_.push_back(commit);
-  cache_queues_signal_.notify_one();
-}
+  void Arrived()
+  {
+    if (--pending_ == 0)
+      Finish();
+  }
 
-//-----------------------------------------------------------------------------
+  void Finish()
+  {
+    promise_.SetReady();
+    finish_();
+  }
 
-void CacheThread::OnTree(CacheTreeRef tree)
-{
-  FLOG(log_read_, "Got tree: %1%") % tree->id_;
-  guard g(cache_queues_lock_);
-  tree_queue_.push_back(tree); 
-  cache_queues_signal_.notify_one();
-}
+  std::vector<CacheId>          ids_;
+  CachePromise                  promise_;
+  size_t                        pending_;
+  CacheThread::FinishCallback   finish_;
+};
 
 //-----------------------------------------------------------------------------
 
-void CacheThread::OnBlob(CacheBlobRef blob)
+//Resolves a set of paths below one tree. Each path is walked as far as it can go with what is
+//already loaded, then the tree it stopped at is requested. As every request goes out in the same
+//pass of the write thread the trees missing at each level for all of the paths are sent together.
+class CachePathResolve : public CacheThread::Task
 {
-  FLOG(log_read_, "Got blob: %1%") % blob->id_;
-  guard g(cache_queues_lock_);
-  blob_queue_.push_back(blob);
-  cache_queues_signal_.notify_one();
-}
+public:
+  CachePathResolve(LogContext log, const CacheId& root, const std::vector<Cache::Path>& paths,
+                   Cache::ResolveCallback on_resolved)
+    : log_(log),
+      root_(root),
+      paths_(paths),
+      on_resolved_(on_resolved)
+  {
+  }
+
+  void operator()(CacheThread::FinishCallback finish,
+                  CacheThread::RequestCallback request)
+  {
+    finish_  = finish;
+    request_ = request;
+    FLOG(log_, "Resolving %1% paths below %2%") % paths_.size() % root_;
+
+    Cache::lease cache;
+    Tree::Entry root(0, cache->LookupCacheTree(root_));
+    for (std::vector<Cache::Path>::const_iterator ii = paths_.begin(); ii != paths_.end(); ++ii)
+    {
+      requests_.push_back(new Request(*ii, Cache::SplitPath(*ii), root));
+      Advance(&requests_.back());
+    }
+    FinishIfDone();
+  }
+
+private:
+  struct Request
+  {
+    Request(const Cache::Path& path, const Cache::PathComponents& components, const Tree::Entry& entry)
+      : path_(path),components_(components),depth_(0),entry_(entry){}
+    Cache::Path           path_;
+    Cache::PathComponents components_;
+    size_t                depth_;
+    Tree::Entry           entry_;
+  };
+  typedef std::vector<Request*>                     Requests;
+  typedef boost::unordered_map<CacheId,Requests>    Waiting;
+
+  virtual void OnTree(CacheTreeRef tree)
+  {
+    Requests waiting = Pop(tree->id_);
+    for (Requests::iterator ii = waiting.begin(); ii != waiting.end(); ++ii)
+      Advance(*ii);
+    FinishIfDone();
+  }
+
+  virtual void OnMissing(const CacheId& id)
+  {
+    FWARNING(log_, "Missing: %1%") % id;
+    Requests waiting = Pop(id);
+    for (Requests::iterator ii = waiting.begin(); ii != waiting.end(); ++ii)
+      on_resolved_((*ii)->path_, Tree::Entry());
+    FinishIfDone();
+  }
+
+  void Advance(Request* request)
+  {
+    if (Cache::lease()->WalkPath(request->components_, &request->depth_, &request->entry_))
+    {
+      on_resolved_(request->path_, request->entry_);
+      return;
+    }
+    const CacheId& id = request->entry_.tree()->id_;
+    Requests& waiting = waiting_[id];
+    if (waiting.empty())
+      request_(id);
+    waiting.push_back(request);
+  }
+
+  Requests Pop(const CacheId& id)
+  {
+    Requests waiting;
+    Waiting::iterator ii = waiting_.find(id);
+    if (ii != waiting_.end())
+    {
+      waiting.swap(ii->second);
+      waiting_.erase(ii);
+    }
+    return waiting;
+  }
+
+  void FinishIfDone()
+  {
+    if (waiting_.empty())
+    {
+      FLOG(log_, "Resolved paths below %1%") % root_;
+      finish_();
+    }
+  }
+
+  LogContext                    log_;
+  CacheId                       root_;
+  std::vector<Cache::Path>      paths_;
+  Cache::ResolveCallback        on_resolved_;
+  CacheThread::FinishCallback   finish_;
+  CacheThread::RequestCallback  request_;
+
+  boost::ptr_vector<Request>    requests_;
+  //The requests stopped at each tree which has been requested
+  Waiting                       waiting_;
+};
+
+//-----------------------------------------------------------------------------
+
+//Walks two trees in lockstep. Children are kept in git's order so each pair of trees is compared
+//with a single merge, and pairs of subtrees which differ are queued up to be compared in turn.
+//Every subtree pair which needs loading is requested as soon as it is found, so each level of
+//the diff goes out to git together.
+class CacheTreeDiff : public CacheThread::Task
+{
+public:
+  CacheTreeDiff(LogContext log, const CacheId& old_id, const CacheId& new_id, bool commits,
+                Cache::DiffCallback on_change, Cache::PrefetchCallback on_finish)
+    : log_(log),
+      old_id_(old_id),
+      new_id_(new_id),
+      commits_(commits),
+      old_commit_(NULL),
+      new_commit_(NULL),
+      commits_pending_(0),
+      on_change_(on_change),
+      on_finish_(on_finish),
+      names_(NULL),
+      changes_(0)
+  {
+  }
+
+  void operator()(CacheThread::FinishCallback finish,
+                  CacheThread::RequestCallback request)
+  {
+    finish_  = finish;
+    request_ = request;
+    FLOG(log_, "Diffing %1% against %2%") % old_id_ % new_id_;
+
+    Cache::lease cache;
+    names_ = &cache->names();
+    if (commits_)
+    {
+      old_commit_ = cache->LookupCacheCommit(old_id_);
+      new_commit_ = cache->LookupCacheCommit(new_id_);
+      if (!old_commit_->valid_)
+      {
+        ++commits_pending_;
+        request_(old_id_);
+      }
+      if (!new_commit_->valid_ && new_id_ != old_id_)
+      {
+        ++commits_pending_;
+        request_(new_id_);
+      }
+      if (commits_pending_ == 0)
+        StartCommits();
+      return;
+    }
+    Start(cache->LookupCacheTree(old_id_), cache->LookupCacheTree(new_id_));
+  }
+
+private:
+  struct Pair
+  {
+    Pair(const Cache::Path& path, CacheTreeRef old_tree, CacheTreeRef new_tree)
+      : path_(path),old_(old_tree),new_(new_tree),pending_(0),old_pinned_(false),new_pinned_(false){}
+    Cache::Path   path_;
+    CacheTreeRef  old_;
+    CacheTreeRef  new_;
+    //Trees still to be loaded
+    size_t        pending_;
+    //Each side is pinned once it's loaded until the pair has been compared, otherwise loading
+    //the other side could evict it
+    bool          old_pinned_;
+    bool          new_pinned_;
+  };
+  typedef std::vector<Pair*>                      Pairs;
+  typedef boost::unordered_map<CacheId,Pairs>     Waiting;
+
+  virtual void OnCommit(CacheCommitRef commit)
+  {
+    if (--commits_pending_ == 0)
+      StartCommits();
+  }
+
+  virtual void OnTree(CacheTreeRef tree)
+  {
+    Cache::lease cache;
+    Pairs waiting = Pop(tree->id_);
+    for (Pairs::iterator ii = waiting.begin(); ii != waiting.end(); ++ii)
+    {
+      Pair& pair = **ii;
+      //The other side was missing and the pair has already been reported
+      if (pair.pending_ == size_t(-1))
+        continue;
+      if (pair.old_ == tree)
+        pair.old_pinned_ = cache->Pin(tree);
+      else
+        pair.new_pinned_ = cache->Pin(tree);
+      if (--pair.pending_ == 0)
+        Compare(pair);
+    }
+    FinishIfDone();
+  }
+
+  virtual void OnMissing(const CacheId& id)
+  {
+    FWARNING(log_, "Missing: %1%") % id;
+    if (commits_ && commits_pending_ > 0 && (id == old_id_ || id == new_id_))
+    {
+      if (--commits_pending_ == 0)
+        StartCommits();
+      return;
+    }
+
+    //We can't tell what changed inside, so the whole directory is reported as modified
+    Pairs waiting = Pop(id);
+    for (Pairs::iterator ii = waiting.begin(); ii != waiting.end(); ++ii)
+    {
+      Pair& pair = **ii;
+      //Both sides were missing and the pair has already been reported
+      if (pair.pending_ == size_t(-1))
+        continue;
+      Report(Cache::TreeChange::Change_Modified, pair.path_, Tree::Entry(0, pair.old_), Tree::Entry(0, pair.new_));
+      //Stop the pair from being compared when the other side comes in
+      pair.pending_ = size_t(-1);
+      Unpin(pair);
+    }
+    FinishIfDone();
+  }
+
+  void StartCommits()
+  {
+    CacheTreeRef old_tree = old_commit_->valid_ ? old_commit_->data_.tree() : NULL;
+    CacheTreeRef new_tree = new_commit_->valid_ ? new_commit_->data_.tree() : NULL;
+    if (!old_tree || !new_tree)
+    {
+      FWARNING(log_, "Unable to load the commits");
+      Finish();
+      return;
+    }
+    Start(old_tree, new_tree);
+  }
+
+  void Start(CacheTreeRef old_tree, CacheTreeRef new_tree)
+  {
+    Queue(Cache::Path(), old_tree, new_tree);
+    FinishIfDone();
+  }
+
+  void Queue(const Cache::Path& path, CacheTreeRef old_tree, CacheTreeRef new_tree)
+  {
+    if (old_tree->id_ == new_tree->id_)
+      return;
+
+    pairs_.push_back(new Pair(path, old_tree, new_tree));
+    Pair& pair = pairs_.back();
+    Request(pair, pair.old_, &pair.old_pinned_);
+    Request(pair, pair.new_, &pair.new_pinned_);
+    if (pair.pending_ == 0)
+      Compare(pair);
+  }
+
+  void Request(Pair& pair, CacheTreeRef& tree, bool* pinned)
+  {
+    //The snapshot may have it, which also marks it as used
+    Cache::lease cache;
+    tree = cache->LookupCacheTree(tree->id_);
+    *pinned = cache->Pin(tree);
+    if (*pinned)
+      return;
+    Pairs& waiting = waiting_[tree->id_];
+    if (waiting.empty())
+      request_(tree->id_);
+    waiting.push_back(&pair);
+    ++pair.pending_;
+  }
+
+  Pairs Pop(const CacheId& id)
+  {
+    Pairs waiting;
+    Waiting::iterator ii = waiting_.find(id);
+    if (ii != waiting_.end())
+    {
+      waiting.swap(ii->second);
+      waiting_.erase(ii);
+    }
+    return waiting;
+  }
+
+  //The same ordering as git's base_name_compare, directories sort as if their name ends in a /
+  int CompareNames(const Tree::Entry& left, const Tree::Entry& right)const
+  {
+    const char* left_name  = names_->data(left.name_);
+    const char* right_name = names_->data(right.name_);
+    size_t left_length     = names_->length(left.name_);
+    size_t right_length    = names_->length(right.name_);
+    size_t length          = std::min(left_length, right_length);
+
+    int cmp = memcmp(left_name, right_name, length);
+    if (cmp != 0)
+      return cmp;
+    uint8_t left_next  = length < left_length  ? uint8_t(left_name[length])  : (left.tree()  ? '/' : 0);
+    uint8_t right_next = length < right_length ? uint8_t(right_name[length]) : (right.tree() ? '/' : 0);
+    return int(left_next) - int(right_next);
+  }
+
+  Cache::Path ChildPath(const Cache::Path& path, const Tree::Entry& entry)const
+  {
+    return path / std::string(names_->data(entry.name_), names_->length(entry.name_));
+  }
+
+  void Unpin(Pair& pair)
+  {
+    Cache::lease cache;
+    if (pair.old_pinned_)
+      cache->Unpin(pair.old_);
+    if (pair.new_pinned_)
+      cache->Unpin(pair.new_);
+    pair.old_pinned_ = false;
+    pair.new_pinned_ = false;
+  }
+
+  //Both sides are pinned, and are unpinned once they have been compared
+  void Compare(Pair& pair)
+  {
+    const Tree::Children& old_children = pair.old_->data_.children_;
+    const Tree::Children& new_children = pair.new_->data_.children_;
+    Tree::Children::const_iterator old_child = old_children.begin();
+    Tree::Children::const_iterator new_child = new_children.begin();
+    while (old_child != old_children.end() || new_child != new_children.end())
+    {
+      int cmp;
+      if (old_child == old_children.end())
+        cmp = 1;
+      else if (new_child == new_children.end())
+        cmp = -1;
+      else
+        cmp = CompareNames(*old_child, *new_child);
+
+      if (cmp < 0)
+      {
+        Report(Cache::TreeChange::Change_Removed, ChildPath(pair.path_, *old_child), *old_child, Tree::Entry());
+        ++old_child;
+      }
+      else if (cmp > 0)
+      {
+        Report(Cache::TreeChange::Change_Added, ChildPath(pair.path_, *new_child), Tree::Entry(), *new_child);
+        ++new_child;
+      }
+      else
+      {
+        //Same name and kind. There is only ever one entry per id so the ids differ if and only
+        //if the objects do.
+        if (old_child->object_ != new_child->object_)
+        {
+          if (old_child->tree())
+            Queue(ChildPath(pair.path_, *new_child), old_child->tree(), new_child->tree());
+          else
+            Report(Cache::TreeChange::Change_Modified, ChildPath(pair.path_, *new_child), *old_child, *new_child);
+        }
+        ++old_child;
+        ++new_child;
+      }
+    }
+    Unpin(pair);
+  }
+
+  void Report(Cache::TreeChange::Kind kind, const Cache::Path& path, const Tree::Entry& old_entry, const Tree::Entry& new_entry)
+  {
+    ++changes_;
+    on_change_(Cache::TreeChange(kind, path, old_entry, new_entry));
+  }
+
+  void FinishIfDone()
+  {
+    if (waiting_.empty() && commits_pending_ == 0)
+      Finish();
+  }
+
+  void Finish()
+  {
+    FLOG(log_, "Finished diffing %1% against %2%: %3% changes, compared %4% trees")
+      % old_id_ % new_id_ % changes_ % pairs_.size();
+    if (on_finish_)
+      on_finish_();
+    finish_();
+  }
+
+  LogContext                    log_;
+  CacheId                       old_id_;
+  CacheId                       new_id_;
+  bool                          commits_;
+  CacheCommitRef                old_commit_;
+  CacheCommitRef                new_commit_;
+  size_t                        commits_pending_;
+  Cache::DiffCallback           on_change_;
+  Cache::PrefetchCallback       on_finish_;
+  CacheThread::FinishCallback   finish_;
+  CacheThread::RequestCallback  request_;
+
+  const NameArena*              names_;
+  size_t                        changes_;
+  boost::ptr_vector<Pair>       pairs_;
+  //The pairs waiting on each requested tree
+  Waiting                       waiting_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+CacheThread::CacheThread(LogContext log, const fs::path& path, Mode mode, size_t workers)
+: log_(log),
+  log_write_(log/"Write"),
+  log_write_profile_(log_write_/"Profile"),
+  requests_in_flight_(0),
+  request_window_(DefaultRequestWindow),
+  requests_(0),
+  coalesced_requests_(0)
+{
+  if (workers == 0)
+    workers = std::max<size_t>(boost::thread::hardware_concurrency(), 1);
+  FLOG(log_, "Starting %1% workers") % workers;
+
+  for (size_t i = 0; i < workers; i++)
+  {
+    std::string name = (boost::format("Worker%1%") % i).str();
+    workers_.push_back(new CacheWorker(log/name.c_str(), this, path, mode));
+    for (size_t j = 0; j < VirtualNodes; j++)
+    {
+      size_t point = 0;
+      boost::hash_combine(point, i);
+      boost::hash_combine(point, j);
+      ring_.push_back(std::make_pair(point, i));
+    }
+  }
+  std::sort(ring_.begin(), ring_.end());
+
+  write_thread_ = boost::thread(boost::bind(&CacheThread::WriteThread,this));
+}
+
+//-----------------------------------------------------------------------------
+
+CacheThread::~CacheThread()
+{
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheThread::AddTask(shared_ptr<Task> task)
+{
+  LOG(log_) << "Adding task";
+  {
+    guard g(cache_queues_lock_);
+    task_queue_.push_back(task);
+  }
+  idle_signal_.Notify();
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheThread::SetRequestWindow(size_t window)
+{
+  FLOG(log_, "Request window: %1%") % window;
+  request_window_ = std::max<size_t>(window, 1);
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheThread::PopWaiters(const CacheId& id, Waiters* waiters)
+{
+  PendingRequests::iterator ii = pending_.find(id);
+  if (ii == pending_.end())
+  {
+    FWARNING(log_write_, "Nobody is waiting for %1%") % id;
+    return false;
+  }
+
+  waiters->swap(ii->second);
+  pending_.erase(ii);
+  --requests_in_flight_;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+template<class Ref>
+void CacheThread::Deliver(Ref object, void (Task::*callback)(Ref))
+{
+  //Holding the tasks keeps them alive even if they finish inside the callback
+  Waiters waiters;
+  if (!PopWaiters(object->id_, &waiters))
+    return;
+  for (Waiters::iterator ii = waiters.begin(); ii != waiters.end(); ++ii)
+  {
+    //The task may have already finished and no longer care about this object
+    if (!active_tasks_.count(ii->get()))
+      continue;
+    FLOG(log_write_, "Giving object to task: Id %1%") % object->id_;
+    (ii->get()->*callback)(object);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheThread::DeliverMissing(const CacheId& id)
+{
+  Waiters waiters;
+  if (!PopWaiters(id, &waiters))
+    return;
+  for (Waiters::iterator ii = waiters.begin(); ii != waiters.end(); ++ii)
+  {
+    if (active_tasks_.count(ii->get()))
+      (*ii)->OnMissing(id);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheThread::WriteThread()
+{
+  LOG(log_write_) << "Init";
+  try
+  {
+    std::deque<shared_ptr<Task> > tasks;
+    std::deque<CacheId>           missing;
+    for(;;)
+    {
+      {
+        guard g(cache_queues_lock_);
+        tasks.swap(task_queue_);
+        missing.swap(missing_queue_);
+      }
+      bool worked = !tasks.empty() || !missing.empty();
+
+      QSMP_PROFILE(log_write_profile_,"Main loop");
+      for (; !tasks.empty(); tasks.pop_front())
+        StartTask(tasks.front());
+      if (DrainWorkers())
+        worked = true;
+      for (; !missing.empty(); missing.pop_front())
+        DeliverMissing(missing.front());
+
+      //Top the pipe back up with whatever the tasks asked for in the meantime
+      SendRequests();
+
+      if (!worked)
+      {
+        idle_signal_.PrepareWait();
+        if (IsIdle())
+          idle_signal_.Wait();
+        else
+          idle_signal_.CancelWait();
+      }
+    }
+  }
+  catch(std::exception& e)
+  {
+    FATAL(log_write_) << e.what();
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheThread::DrainWorkers()
+{
+  //Each ring is only emptied by as much as it can hold at once so one busy worker can't keep
+  //the others or new tasks waiting
+  bool drained = false;
+  for (boost::ptr_vector<CacheWorker>::iterator ii = workers_.begin(); ii != workers_.end(); ++ii)
+  {
+    CacheWorker::TaggedObject object;
+    for (size_t i = 0; i < CacheWorker::RingCapacity && ii->Pop(object); i++)
+    {
+      drained = true;
+      const void* pointer = reinterpret_cast<const void*>(object & ~CacheWorker::TaggedObject(CacheWorker::TagMask));
+      switch (object & CacheWorker::TagMask)
+      {
+      case CacheWorker::Tag_Commit:
+        Deliver(static_cast<CacheCommitRef>(pointer), &Task::OnCommit);
+        break;
+      //Trees and blobs were pinned by the worker when it set them. Tasks which want them for longer
+      //than the callback pin them again.
+      case CacheWorker::Tag_Tree:
+        Deliver(static_cast<CacheTreeRef>(pointer), &Task::OnTree);
+        Cache::lease()->Unpin(static_cast<CacheTreeRef>(pointer));
+        break;
+      case CacheWorker::Tag_Blob:
+        Deliver(static_cast<CacheBlobRef>(pointer), &Task::OnBlob);
+        Cache::lease()->Unpin(static_cast<CacheBlobRef>(pointer));
+        break;
+      }
+    }
+  }
+  return drained;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheThread::IsIdle()
+{
+  for (boost::ptr_vector<CacheWorker>::iterator ii = workers_.begin(); ii != workers_.end(); ++ii)
+  {
+    if (!ii->empty())
+      return false;
+  }
+  guard g(cache_queues_lock_);
+  return task_queue_.empty() && missing_queue_.empty();
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheThread::StartTask(shared_ptr<Task> task)
+{
+  LOG(log_write_) << "Starting new task";
+  active_tasks_[task.get()] = task;
+  task->operator()(boost::bind(&CacheThread::Finish,this,task.get()),
+                   boost::bind(&CacheThread::RequestId,this,task.get(),_1));
+}
+
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+
+void CacheThread::Finish(Task* task)
+{
+  LOG(log_write_) << "Finish";
+  active_tasks_.erase(task);
+  FLOG(log_write_profile_, "Requests: %1%, Coalesced: %2%, Pending: %3%")
+    % requests_
+    % coalesced_requests_
+    % pending_.size();
+  Cache::lease()->LogStatistics();
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheThread::RequestId(Task* task, const CacheId& id)
+{
+  FLOG(log_write_, "Getting %1%") % id;
+  ActiveTasks::iterator ii = active_tasks_.find(task);
+  if (ii == active_tasks_.end())
+  {
+    FWARNING(log_write_, "Request from a finished task: %1%") % id;
+    return;
+  }
+  ++requests_;
+  Waiters& waiters = pending_[id];
+  //Someone else has already asked for this, we'll get a copy when it comes back
+  if (!waiters.empty())
+    ++coalesced_requests_;
+  else
+    unsent_requests_.push_back(id);
+  waiters.push_back(ii->second);
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheThread::SendRequests()
+{
+  if (unsent_requests_.empty())
+    return;
+  for (; !unsent_requests_.empty() && requests_in_flight_ < request_window_; unsent_requests_.pop_front())
+  {
+    Route(unsent_requests_.front()).Request(unsent_requests_.front());
+    ++requests_in_flight_;
+  }
+  for (boost::ptr_vector<CacheWorker>::iterator ii = workers_.begin(); ii != workers_.end(); ++ii)
+    ii->Flush();
+}
+
+//-----------------------------------------------------------------------------
+
+CacheWorker& CacheThread::Route(const CacheId& id)
+{
+  //The id is already a hash so any of its bits will do as the position on the ring
+  HashRing::const_iterator ii = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(hash_value(id), size_t(0)));
+  if (ii == ring_.end())
+    ii = ring_.begin();
+  return workers_[ii->second];
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheThread::OnMissing(const CacheId& id)
+{
+  {
+    guard g(cache_queues_lock_);
+    missing_queue_.push_back(id);
+  }
+  idle_signal_.Notify();
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+CacheWorker::CacheWorker(LogContext log, CacheThread* thread, const fs::path& path, CacheThread::Mode mode)
+: log_(log),
+  thread_(thread),
+  mode_(mode),
+  store_(log/"Store")
+{
+  if (mode_ == CacheThread::Mode_Native && !store_.Open(path))
+  {
+    WARNING(log_) << "Falling back to git cat-file";
+    mode_ = CacheThread::Mode_CatFile;
+  }
+
+  if (mode_ == CacheThread::Mode_CatFile)
+  {
+    LOG(log_) << "Launching git";
+    git_.reset(new Process(log/"Git", "/usr/bin/git", path, boost::assign::list_of("git")("cat-file")("--batch")));
+    git_stdin_.reset(new io::stream<io::file_descriptor_sink>(git_->stdin_fd()));
+  }
+
+  read_thread_ = boost::thread(boost::bind(&CacheWorker::ReadThread,this));
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheWorker::ReadThread()
+{
+  LOG(log_) << "Init";
+  try
+  {
+    if (mode_ == CacheThread::Mode_Native)
+    {
+      NativeReadThread();
+    }
+    else
+    {
+      cache::ProcessData data(log_/"Read",this);
+      data(git_->stdout_fd());
+    }
+  }
+  catch(std::exception& e)
+  {
+    FATAL(log_) << e.what();
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheWorker::NativeReadThread()
+{
+  cache::ProcessData data(log_/"Read",this);
+  GitObject object;
+  for(;;)
+  {
+    CacheId id;
+    {
+      boost::unique_lock<boost::mutex> lock(request_queue_lock_);
+      while (request_queue_.empty())
+      {
+        request_queue_signal_.wait(lock);
+      }
+      id = request_queue_.front();
+      request_queue_.pop_front();
+    }
+
+    if (store_.Read(id, object))
+    {
+      data.ProcessObject(id, object);
+    }
+    else
+    {
+      OnMissing(id);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_STATIC_ASSERT(boost::alignment_of<CacheCommit>::value > CacheWorker::TagMask);
+BOOST_STATIC_ASSERT(boost::alignment_of<CacheTree>::value > CacheWorker::TagMask);
+BOOST_STATIC_ASSERT(boost::alignment_of<CacheBlob>::value > CacheWorker::TagMask);
+
+void CacheWorker::Push(const void* object, Tag tag)
+{
+  TaggedObject tagged = reinterpret_cast<TaggedObject>(object) | tag;
+  //The write thread is behind, make sure it's awake and give it a chance to catch up
+  while (!ring_.TryPush(tagged))
+  {
+    thread_->Wake();
+    boost::this_thread::yield();
+  }
+  thread_->Wake();
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheWorker::OnCommit(CacheCommitRef commit)
+{
+  FLOG(log_, "Got commit: %1%") % commit->id_;
+  Push(commit, Tag_Commit);
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheWorker::OnTree(CacheTreeRef tree)
+{
+  FLOG(log_, "Got tree: %1%") % tree->id_;
+  Push(tree, Tag_Tree);
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheWorker::OnBlob(CacheBlobRef blob)
+{
+  FLOG(log_, "Got blob: %1%") % blob->id_;
+  Push(blob, Tag_Blob);
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheWorker::OnMissing(const CacheId& id)
+{
+  FLOG(log_, "Missing: %1%") % id;
+  thread_->OnMissing(id);
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheWorker::Request(const CacheId& id)
+{
+  FLOG(log_, "Getting %1%") % id;
+  if (mode_ == CacheThread::Mode_Native)
+    request_batch_.push_back(id);
+  else
+    *git_stdin_ << id << "\n";
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheWorker::Flush()
+{
+  if (mode_ == CacheThread::Mode_Native)
+  {
+    if (request_batch_.empty())
+      return;
+    guard g(request_queue_lock_);
+    request_queue_.insert(request_queue_.end(), request_batch_.begin(), request_batch_.end());
+    request_batch_.clear();
+    request_queue_signal_.notify_one();
+  }
+  else
+  {
+    *git_stdin_ << std::flush;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //The default memory budget for blob data and tree children
+  const size_t DefaultMemoryBudget = 128 * 1024 * 1024;
+  //The default size the snapshot is trimmed to
+  const boost::uint64_t DefaultSnapshotBudget = 256 * 1024 * 1024;
+
+  size_t DataSize(const Blob& blob)
+  {
+    return size_t(blob.size());
+  }
+
+  size_t DataSize(const Tree& tree)
+  {
+    //The names are shared through the arena and stay behind when the tree is evicted
+    return tree.children_.capacity() * sizeof(Tree::Entry);
+  }
+
+  size_t DataSize(const Tree::Children& children)
+  {
+    return children.capacity() * sizeof(Tree::Entry);
+  }
+
+  void ReleaseData(Blob& blob)
+  {
+    blob = Blob();
+  }
+
+  void ReleaseData(Tree& tree)
+  {
+    Tree::Children().swap(tree.children_);
+  }
+
+  void ReleaseData(Tree::Children& children)
+  {
+    Tree::Children().swap(children);
+  }
+
+  struct NameLess
+  {
+    bool operator()(const Tree::Entry& left, const Tree::Entry& right)const
+    {return left.name_ < right.name_;}
+    bool operator()(const Tree::Entry& left, NameArena::Offset right)const
+    {return left.name_ < right;}
+  };
+
+  template<class Map, class T>
+  bool PinEntry(Map& map, const CacheEntry<T>* ref)
+  {
+    typename Map::ScopedLock lock(map, ref->id_);
+    CacheEntry<T>* entry = lock.Find(ref->id_);
+    if (!entry || !entry->valid_)
+      return false;
+    ++entry->pins_;
+    return true;
+  }
+
+  template<class Map, class T>
+  void UnpinEntry(Map& map, const CacheEntry<T>* ref)
+  {
+    typename Map::ScopedLock lock(map, ref->id_);
+    CacheEntry<T>* entry = lock.Find(ref->id_);
+    if (entry && entry->pins_ > 0)
+      --entry->pins_;
+  }
+
+  const char* const SnapshotFileName = "ObjectCache.snapshot";
+
+  fs::path& RepositoryPath()
+  {
+    static fs::path path(".");
+    return path;
+  }
+
+  struct ReaderSettings
+  {
+    ReaderSettings():mode_(CacheThread::Mode_Native),workers_(0),request_window_(0){}
+    CacheThread::Mode mode_;
+    size_t            workers_;
+    size_t            request_window_;
+  };
+
+  ReaderSettings& Readers()
+  {
+    static ReaderSettings readers;
+    return readers;
+  }
+
+  //Adds every valid tree to a snapshot
+  struct SnapshotTree
+  {
+    SnapshotTree(CacheSnapshotWriter& writer, const NameArena& names):writer_(writer),names_(names){}
+    void operator()(const CacheTree& tree)const
+    {
+      if (!tree.valid_)
+        return;
+      CacheSnapshot::Entries entries;
+      entries.reserve(tree.data_.children_.size());
+      for (Tree::Children::const_iterator ii = tree.data_.children_.begin(); ii != tree.data_.children_.end(); ++ii)
+      {
+        //Entries which are neither blobs or trees (ie submodules) aren't shown so aren't saved
+        if (ii->kind_ == Tree::Entry::Kind_None)
+          continue;
+        entries.push_back(CacheSnapshot::Entry());
+        CacheSnapshot::Entry& entry = entries.back();
+        entry.name_.assign(names_.data(ii->name_), names_.length(ii->name_));
+        entry.tree_ = ii->kind_ == Tree::Entry::Kind_Tree;
+        entry.id_   = entry.tree_ ? ii->tree()->id_ : ii->blob()->id_;
+      }
+      writer_.AddTree(tree.id_, entries);
+    }
+    CacheSnapshotWriter& writer_;
+    const NameArena&     names_;
+  };
+
+  //Adds every valid blob to a snapshot
+  struct SnapshotBlob
+  {
+    SnapshotBlob(CacheSnapshotWriter& writer):writer_(writer){}
+    void operator()(const CacheBlob& blob)const
+    {
+      if (blob.valid_)
+        writer_.AddBlob(blob.id_, blob.data_);
+    }
+    CacheSnapshotWriter& writer_;
+  };
+
+  //The CLOCK eviction step: used entries get a second chance, others drop their data and go
+  //back to being invalid stubs. Pinned entries are being read and are left alone.
+  struct Evict
+  {
+    template<class T>
+    size_t operator()(CacheEntry<T>& entry)const
+    {
+      if (entry.pins_ != 0)
+        return 0;
+      if (entry.referenced_)
+      {
+        entry.referenced_ = false;
+        return 0;
+      }
+      if (!entry.valid_)
+        return 0;
+      size_t size = DataSize(entry.data_);
+      entry.valid_ = false;
+      ReleaseData(entry.data_);
+      return size;
+    }
+  };
+
+}
 
 //-----------------------------------------------------------------------------
+
+QString Tree::Entry::name()const
+{
+  return Cache::lease()->names().Text(name_);
+}
+
 //-----------------------------------------------------------------------------
+
+CacheId Tree::Entry::id()const
+{
+  if (CacheTreeRef tree = this->tree())
+    return tree->id_;
+  if (CacheBlobRef blob = this->blob())
+    return blob->id_;
+  return CacheId();
+}
+
 //-----------------------------------------------------------------------------
 
 Cache::Cache(boost::restricted)
 : log_("Cache")
-, cache_thread_(log_/"Thread", "/home/james/scm/qsmp/build/qsmp_indexer/test/")
+, log_profile_(log_/"Profile")
+, memory_budget_(DefaultMemoryBudget)
+, snapshot_budget_(DefaultSnapshotBudget)
+, snapshot_(log_/"Snapshot")
+, refs_(log_/"Refs")
+, cache_thread_(log_/"Thread", RepositoryPath(), Readers().mode_, Readers().workers_)
 {
-  LOG(log_) << "Init";
+  FLOG(log_, "Init: Repository %1%") % RepositoryPath().string();
+  if (Readers().request_window_ != 0)
+    cache_thread_.SetRequestWindow(Readers().request_window_);
+  refs_.Open(RepositoryPath());
+  boost::unique_lock<boost::shared_mutex> lock(snapshot_lock_);
+  snapshot_.Open(PersistantPath(SnapshotFileName));
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::SetRepository(const fs::path& repository)
+{
+  RepositoryPath() = repository;
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::SetReaders(CacheThread::Mode mode, size_t workers, size_t request_window)
+{
+  Readers().mode_           = mode;
+  Readers().workers_        = workers;
+  Readers().request_window_ = request_window;
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::SaveSnapshot()
+{
+  LOG(log_) << "Saving snapshot";
+  fs::path path = PersistantPath(SnapshotFileName);
+  CacheSnapshotWriter writer(log_/"Snapshot", path);
+  tree_cache_.ForEach(SnapshotTree(writer, names_));
+  blob_cache_.ForEach(SnapshotBlob(writer));
+  {
+    //Lookups can carry on reading the old snapshot while it's copied
+    boost::shared_lock<boost::shared_mutex> lock(snapshot_lock_);
+    writer.Merge(snapshot_, snapshot_budget_);
+  }
+
+  //The old file has to be unmapped before it can be replaced
+  boost::unique_lock<boost::shared_mutex> lock(snapshot_lock_);
+  snapshot_.Close();
+  if (writer.Commit())
+    snapshot_.Open(path);
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::LoadTree(const CacheId& id)
+{
+  CacheSnapshot::Entries entries;
+  {
+    boost::shared_lock<boost::shared_mutex> lock(snapshot_lock_);
+    if (!snapshot_.ReadTree(id, entries))
+      return;
+  }
+  FLOG(log_, "Loaded tree from snapshot: Id %1%") % id;
+
+  //Subtrees are left as stubs so that they are only loaded when they are looked up
+  Tree tree;
+  tree.id_ = id;
+  tree.children_.resize(entries.size());
+  Tree::Children::iterator child = tree.children_.begin();
+  for (CacheSnapshot::Entries::iterator ii = entries.begin(); ii != entries.end(); ++ii, ++child)
+  {
+    NameArena::Offset name = names_.Intern(ii->name_.data(), ii->name_.size());
+    if (ii->tree_)
+      *child = Tree::Entry(name, StubTree(ii->id_));
+    else
+      *child = Tree::Entry(name, LookupCacheBlob(ii->id_));
+  }
+  SetTree(id, tree);
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::LoadBlob(const CacheId& id)
+{
+  Blob blob;
+  {
+    boost::shared_lock<boost::shared_mutex> lock(snapshot_lock_);
+    if (!snapshot_.ReadBlob(id, blob))
+      return;
+  }
+  SetBlob(id, blob);
+}
+
+//-----------------------------------------------------------------------------
+
+CacheTreeRef Cache::StubTree(const CacheId& id)
+{
+  TreeCache::ScopedLock lock(tree_cache_, id);
+  return &lock.FindOrInsert(id, CacheTree(id));
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::SetMemoryBudget(size_t bytes)
+{
+  FLOG(log_, "Memory budget: %1% bytes") % bytes;
+  memory_budget_ = bytes;
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::SetSnapshotBudget(boost::uint64_t bytes)
+{
+  FLOG(log_, "Snapshot budget: %1% bytes") % bytes;
+  snapshot_budget_ = bytes;
+}
+
+//-----------------------------------------------------------------------------
+
+bool Cache::Pin(CacheBlobRef blob)
+{
+  return PinEntry(blob_cache_, blob);
+}
+
+//-----------------------------------------------------------------------------
+
+bool Cache::Pin(CacheTreeRef tree)
+{
+  return PinEntry(tree_cache_, tree);
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::Unpin(CacheBlobRef blob)
+{
+  UnpinEntry(blob_cache_, blob);
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::Unpin(CacheTreeRef tree)
+{
+  UnpinEntry(tree_cache_, tree);
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::LogStatistics()
+{
+  //Gathering the statistics locks every shard of every cache, which isn't worth doing after each
+  //task unless someone is going to read them
+  if (log_profile_.mute(LogSeverity_Normal))
+    return;
+  BlobCache::Statistics blobs     = blob_cache_.statistics();
+  TreeCache::Statistics trees     = tree_cache_.statistics();
+  CommitCache::Statistics commits = commit_cache_.statistics();
+  PathCache::Statistics paths     = path_cache_.statistics();
+  FLOG(log_profile_, "Blobs: %1% entries, %2% bytes, %3% hits, %4% misses, %5% evictions, %6% locks, %7% contended")
+    % blobs.size_ % blobs.bytes_ % blobs.hits_ % blobs.misses_ % blobs.evictions_ % blobs.acquired_ % blobs.contended_;
+  FLOG(log_profile_, "Trees: %1% entries, %2% bytes, %3% hits, %4% misses, %5% evictions, %6% locks, %7% contended")
+    % trees.size_ % trees.bytes_ % trees.hits_ % trees.misses_ % trees.evictions_ % trees.acquired_ % trees.contended_;
+  FLOG(log_profile_, "Commits: %1% entries, %2% hits, %3% misses, %4% locks, %5% contended")
+    % commits.size_ % commits.hits_ % commits.misses_ % commits.acquired_ % commits.contended_;
+  FLOG(log_profile_, "Paths: %1% trees, %2% bytes, %3% hits, %4% misses, %5% evictions, %6% locks, %7% contended")
+    % paths.size_ % paths.bytes_ % paths.hits_ % paths.misses_ % paths.evictions_ % paths.acquired_ % paths.contended_;
 }
 
 //-----------------------------------------------------------------------------
@@ -759,14 +2182,20 @@ Cache::Cache(boost::restricted)
 CacheBlobRef Cache::LookupCacheBlob(const CacheId& id)
 {
   FLOG(log_, "Lookup cache blob: Id %1%") % id;
-  lock_guard lock(cache_lock_);
-  BlobCache::iterator ii = blob_cache_.find(id);
-  if (ii == blob_cache_.end())
+  CacheBlob* blob;
   {
-    std::pair<CacheId,CacheBlob> blob(id,CacheBlob(id));
-    ii = blob_cache_.insert(blob).first;
+    BlobCache::ScopedLock lock(blob_cache_, id);
+    blob = &lock.FindOrInsert(id, CacheBlob(id));
+    blob->referenced_ = true;
+    if (blob->valid_)
+    {
+      lock.CountHit();
+      return blob;
+    }
+    lock.CountMiss();
   }
-  return &(ii->second);
+  LoadBlob(id);
+  return blob;
 }
 
 //-----------------------------------------------------------------------------
@@ -774,14 +2203,20 @@ CacheBlobRef Cache::LookupCacheBlob(const CacheId& id)
 CacheTreeRef Cache::LookupCacheTree(const CacheId& id)
 {
   FLOG(log_, "Lookup cache tree: Id %1%") % id;
-  lock_guard lock(cache_lock_);
-  TreeCache::iterator ii = tree_cache_.find(id);
-  if (ii == tree_cache_.end())
+  CacheTree* tree;
   {
-    std::pair<CacheId,CacheTree> tree(id,CacheTree(id));
-    ii = tree_cache_.insert(tree).first;
+    TreeCache::ScopedLock lock(tree_cache_, id);
+    tree = &lock.FindOrInsert(id, CacheTree(id));
+    tree->referenced_ = true;
+    if (tree->valid_)
+    {
+      lock.CountHit();
+      return tree;
+    }
+    lock.CountMiss();
   }
-  return &(ii->second);
+  LoadTree(id);
+  return tree;
 }
 
 //-----------------------------------------------------------------------------
@@ -789,14 +2224,14 @@ CacheTreeRef Cache::LookupCacheTree(const CacheId& id)
 CacheCommitRef Cache::LookupCacheCommit(const CacheId& id)
 {
   FLOG(log_, "Lookup cache commit: Id %1%") % id;
-  lock_guard lock(cache_lock_);
-  CommitCache::iterator ii = commit_cache_.find(id);
-  if (ii == commit_cache_.end())
-  {
-    std::pair<CacheId,CacheCommit> commit(id,CacheCommit(id));
-    ii = commit_cache_.insert(commit).first;
-  }
-  return &(ii->second);
+  CommitCache::ScopedLock lock(commit_cache_, id);
+  CacheCommit& commit = lock.FindOrInsert(id, CacheCommit(id));
+  commit.referenced_ = true;
+  if (commit.valid_)
+    lock.CountHit();
+  else
+    lock.CountMiss();
+  return &commit;
 }
 
 //-----------------------------------------------------------------------------
@@ -804,84 +2239,336 @@ CacheCommitRef Cache::LookupCacheCommit(const CacheId& id)
 CacheBlobRef Cache::LookupBlob(const CacheId& id)
 {
   FLOG(log_, "Lookup blob: Id %1%") % id;
-  lock_guard lock(cache_lock_);
-  CacheBlobRef blob = &blob_cache_[id];
+  CacheBlobRef blob = LookupCacheBlob(id);
+  if (!blob->valid_)
+    Fetch(id);
+  return blob;
+}
+
+//-----------------------------------------------------------------------------
+
+CacheFuture Cache::Fetch(const CacheId& id)
+{
+  return Fetch(std::vector<CacheId>(1, id));
+}
+
+//-----------------------------------------------------------------------------
+
+CacheFuture Cache::Fetch(const std::vector<CacheId>& ids)
+{
+  FLOG(log_, "Fetch: %1% objects") % ids.size();
+  CachePromise promise;
+  AddThreadTask(spnew<CacheFetch>(ids, promise));
+  return promise.future();
+}
+
+//-----------------------------------------------------------------------------
+
+CacheTreeRef Cache::LookupTree(const CacheId& id, size_t depth_to_load)
+{
+  FLOG(log_, "Lookup tree: Id %1%, Depth %2%") % id % depth_to_load;
+  CacheTreeRef tree = LookupCacheTree(id);
+  if (depth_to_load > 0)
+    Prefetch(id, depth_to_load);
+  return tree;
+}
+
+//-----------------------------------------------------------------------------
+
+CacheCommitRef Cache::LookupCommit(const CacheId& id, size_t depth_to_load)
+{
+  FLOG(log_, "Lookup commit: Id %1%, Depth %2%") % id % depth_to_load;
+  CacheCommitRef commit = LookupCacheCommit(id);
+  if (!commit->valid_ || depth_to_load > 0)
+    PrefetchCommit(id, depth_to_load);
+  return commit;
+}
+
+//-----------------------------------------------------------------------------
 
+CacheCommitRef Cache::LookupCommit(const Path& repo, const Path& head, size_t depth_to_load)
+{
+  FLOG(log_, "Lookup commit: Repo %1%, Head %2%, Depth %3%") % repo.string() % head.string() % depth_to_load;
+  //Objects can only be read from the one repository
+  if (!repo.empty() && fs::system_complete(repo) != fs::system_complete(refs_.repository()))
   {
-    //Now we need to go out to git to get the blob data
+    FWARNING(log_, "%1% isn't the cache's repository") % repo.string();
+    return NULL;
   }
 
-  return blob;
+  CacheId id;
+  if (!refs_.Resolve(head.string(), &id))
+    return NULL;
+  return LookupCommit(id, depth_to_load);
 }
 
 //-----------------------------------------------------------------------------
 
-CacheBlobRef Cache::SetBlob(const CacheId& id, const Blob& blob)
+void Cache::Prefetch(const CacheId& tree, size_t depth, SubtreeCallback on_subtree, PrefetchCallback on_finish)
 {
-  FLOG(log_, "Set blob: Id %1%") % id;
-  lock_guard lock(cache_lock_);
-  BlobCache::iterator ii = blob_cache_.find(id);
-  if (ii == blob_cache_.end())
+  AddThreadTask(spnew<CachePrefetch>(log_/"Prefetch", tree, false, depth, on_subtree, on_finish));
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::PrefetchCommit(const CacheId& commit, size_t depth, SubtreeCallback on_subtree, PrefetchCallback on_finish)
+{
+  AddThreadTask(spnew<CachePrefetch>(log_/"Prefetch", commit, true, depth, on_subtree, on_finish));
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::DiffTrees(const CacheId& old_tree, const CacheId& new_tree, DiffCallback on_change, PrefetchCallback on_finish)
+{
+  AddThreadTask(spnew<CacheTreeDiff>(log_/"Diff", old_tree, new_tree, false, on_change, on_finish));
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::DiffCommits(const CacheId& old_commit, const CacheId& new_commit, DiffCallback on_change, PrefetchCallback on_finish)
+{
+  AddThreadTask(spnew<CacheTreeDiff>(log_/"Diff", old_commit, new_commit, true, on_change, on_finish));
+}
+//-----------------------------------------------------------------------------
+
+Cache::PathComponents Cache::SplitPath(const Path& path)
+{
+  PathComponents components;
+  for (Path::iterator ii = path.begin(); ii != path.end(); ++ii)
+  {
+    std::string name = Path(*ii).string();
+    if (name.empty() || name == "/" || name == ".")
+      continue;
+    components.push_back(name);
+  }
+  return components;
+}
+
+//-----------------------------------------------------------------------------
+
+Cache::FindResult Cache::FindChild(CacheTreeRef tree, const std::string& name, Tree::Entry* entry)
+{
+  //A name which has never been interned can't be in any tree we have loaded, but we still need
+  //to know whether this tree has been loaded to tell a missing name from an unloaded tree
+  NameArena::Offset offset;
+  bool known = names_.Find(name.data(), name.size(), &offset) && offset != 0;
+
+  {
+    PathCache::ScopedLock lock(path_cache_, tree->id_);
+    CachePathIndex* index = lock.Find(tree->id_);
+    if (index && index->valid_)
+    {
+      lock.CountHit();
+      index->referenced_ = true;
+      return FindName(index->data_, known, offset, entry);
+    }
+    lock.CountMiss();
+  }
+
+  //First time through this tree, or its index has been evicted. Index its children so the rest
+  //of the names in it are found without walking the children again.
+  Tree::Children children;
   {
-    std::pair<CacheId,CacheBlob> to_insert;
-    to_insert.first        = id;
-    to_insert.second.id_   = id;
-    to_insert.second.data_ = blob;
-    ii = blob_cache_.insert(to_insert).first;
+    CachePin<Tree> pin(tree);
+    if (!pin)
+      return Find_NotLoaded;
+    children = tree->data_.children_;
   }
-  else if (!ii->second.valid_)
+  std::sort(children.begin(), children.end(), NameLess());
+
+  PathCache::ScopedLock lock(path_cache_, tree->id_);
+  CachePathIndex& index = lock.FindOrInsert(tree->id_, CachePathIndex(tree->id_));
+  index.referenced_ = true;
+  if (!index.valid_)
   {
-    ii->second.valid_ = true;
-    ii->second.data_ = blob;
+    index.data_.swap(children);
+    index.valid_ = true;
+    lock.Charge(DataSize(index.data_));
+    lock.Sweep(memory_budget_ / 3 / PathCache::shard_count(), &index, Evict());
   }
-  return &ii->second;
+  return FindName(index.data_, known, offset, entry);
 }
 
 //-----------------------------------------------------------------------------
 
-CacheTreeRef Cache::SetTree(const CacheId& id, const Tree& tree)
+Cache::FindResult Cache::FindName(const Tree::Children& children, bool known, NameArena::Offset offset, Tree::Entry* entry)
 {
-  FLOG(log_, "Set tree: Id %1%") % id;
-  lock_guard lock(cache_lock_);
-  TreeCache::iterator ii = tree_cache_.find(id);
-  if (ii == tree_cache_.end())
+  if (!known)
+    return Find_NotFound;
+  Tree::Children::const_iterator child = std::lower_bound(children.begin(), children.end(), offset, NameLess());
+  if (child == children.end() || child->name_ != offset)
+    return Find_NotFound;
+  *entry = *child;
+  return Find_Found;
+}
+
+//-----------------------------------------------------------------------------
+
+bool Cache::WalkPath(const PathComponents& components, size_t* depth, Tree::Entry* entry)
+{
+  for (; *depth < components.size(); ++*depth)
   {
-    std::pair<CacheId,CacheTree> to_insert;
-    to_insert.first         = id;
-    to_insert.second.id_    = id;
-    to_insert.second.data_  = tree;
-    to_insert.second.valid_ = true;
-    ii = tree_cache_.insert(to_insert).first;
+    CacheTreeRef tree = entry->tree();
+    if (!tree)
+    {
+      //Trying to go down through a blob
+      *entry = Tree::Entry();
+      return true;
+    }
+
+    //Pulls the tree in from the snapshot if it's there and marks it as used
+    tree = LookupCacheTree(tree->id_);
+
+    Tree::Entry child;
+    switch (FindChild(tree, components[*depth], &child))
+    {
+    case Find_Found:
+      *entry = child;
+      break;
+    case Find_NotFound:
+      *entry = Tree::Entry();
+      return true;
+    case Find_NotLoaded:
+      return false;
+    }
   }
-  else if (!ii->second.valid_)
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool Cache::ResolvePath(const CacheId& root, const Path& path, Tree::Entry* entry, ResolveCallback on_resolved)
+{
+  FLOG(log_, "Resolve path: Root %1%, Path %2%") % root % path.string();
+  PathComponents components = SplitPath(path);
+  size_t depth = 0;
+  *entry = Tree::Entry(0, LookupCacheTree(root));
+  if (WalkPath(components, &depth, entry))
+    return true;
+
+  if (on_resolved)
+    AddThreadTask(spnew<CachePathResolve>(log_/"Resolve", root, std::vector<Path>(1, path), on_resolved));
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+
+void Cache::ResolvePaths(const CacheId& root, const std::vector<Path>& paths, ResolveCallback on_resolved)
+{
+  FLOG(log_, "Resolve paths: Root %1%, %2% paths") % root % paths.size();
+  AddThreadTask(spnew<CachePathResolve>(log_/"Resolve", root, paths, on_resolved));
+}
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //Once a path has been resolved in the background the object at it is loaded like any other lookup
+  void LoadResolved(const Cache::Path& path, const Tree::Entry& entry, size_t depth_to_load)
   {
-    ii->second.data_ = tree;
-    ii->second.valid_ = true;
+    if (CacheTreeRef tree = entry.tree())
+    {
+      if (depth_to_load > 0)
+        Cache::lease()->Prefetch(tree->id_, depth_to_load);
+    }
+    else if (CacheBlobRef blob = entry.blob())
+    {
+      if (!blob->valid_)
+        Cache::lease()->LookupBlob(blob->id_);
+    }
   }
-  return &ii->second;
 }
 
 //-----------------------------------------------------------------------------
 
-CacheCommitRef Cache::SetCommit(const CacheId& id, const Commit& commit)
+bool Cache::LookupPath(const Path& repo, const Path& head, const Path& path, size_t depth_to_load, Tree::Entry* entry)
 {
-  FLOG(log_, "Set commit: Id %1%") % id;
-  lock_guard lock(cache_lock_);
-  CommitCache::iterator ii = commit_cache_.find(id);
-  if (ii == commit_cache_.end())
+  CacheCommitRef commit = LookupCommit(repo, head);
+  if (!commit || !commit->valid_ || !commit->data_.tree())
+    return false;
+
+  if (!ResolvePath(commit->data_.tree()->id_, path, entry, boost::bind(&LoadResolved, _1, _2, depth_to_load)))
+    return false;
+  LoadResolved(path, *entry, depth_to_load);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+CacheBlobRef Cache::LookupBlob(const Path& repo, const Path& head, const Path& path)
+{
+  FLOG(log_, "Lookup blob: Repo %1%, Head %2%, Path %3%") % repo.string() % head.string() % path.string();
+  Tree::Entry entry;
+  if (!LookupPath(repo, head, path, 0, &entry))
+    return NULL;
+  return entry.blob();
+}
+
+//-----------------------------------------------------------------------------
+
+CacheTreeRef Cache::LookupTree(const Path& repo, const Path& head, const Path& path, size_t depth_to_load)
+{
+  FLOG(log_, "Lookup tree: Repo %1%, Head %2%, Path %3%, Depth %4%") % repo.string() % head.string() % path.string() % depth_to_load;
+  Tree::Entry entry;
+  if (!LookupPath(repo, head, path, depth_to_load, &entry))
+    return NULL;
+  return entry.tree();
+}
+
+//-----------------------------------------------------------------------------
+
+CacheBlobRef Cache::SetBlob(const CacheId& id, const Blob& blob, bool pin)
+{
+  FLOG(log_, "Set blob: Id %1%") % id;
+  BlobCache::ScopedLock lock(blob_cache_, id);
+  CacheBlob& entry = lock.FindOrInsert(id, CacheBlob(id));
+  entry.referenced_ = true;
+  if (pin)
+    ++entry.pins_;
+  if (!entry.valid_)
+  {
+    entry.data_  = blob;
+    entry.valid_ = true;
+    lock.Charge(DataSize(entry.data_));
+    lock.Sweep(memory_budget_ / 3 / BlobCache::shard_count(), &entry, Evict());
+  }
+  return &entry;
+}
+
+//-----------------------------------------------------------------------------
+
+CacheTreeRef Cache::SetTree(const CacheId& id, const Tree& tree, bool pin)
+{
+  FLOG(log_, "Set tree: Id %1%") % id;
+  TreeCache::ScopedLock lock(tree_cache_, id);
+  CacheTree& entry = lock.FindOrInsert(id, CacheTree(id));
+  entry.referenced_ = true;
+  if (pin)
+    ++entry.pins_;
+  if (!entry.valid_)
   {
-    std::pair<CacheId,CacheCommit> to_insert;
-    to_insert.first        = id;
-    to_insert.second.id_   = id;
-    to_insert.second.data_ = commit;
-    ii = commit_cache_.insert(to_insert).first;
+    entry.data_  = tree;
+    entry.valid_ = true;
+    lock.Charge(DataSize(entry.data_));
+    lock.Sweep(memory_budget_ / 3 / TreeCache::shard_count(), &entry, Evict());
   }
-  else if (!ii->second.valid_)
+  return &entry;
+}
+
+//-----------------------------------------------------------------------------
+
+CacheCommitRef Cache::SetCommit(const CacheId& id, const Commit& commit)
+{
+  FLOG(log_, "Set commit: Id %1%") % id;
+  CommitCache::ScopedLock lock(commit_cache_, id);
+  CacheCommit& entry = lock.FindOrInsert(id, CacheCommit(id));
+  entry.referenced_ = true;
+  if (!entry.valid_)
   {
-    ii->second.valid_ = true;
-    ii->second.data_  = commit;
+    entry.data_  = commit;
+    entry.valid_ = true;
   }
-  return &ii->second;
+  return &entry;
 }
 
 //-----------------------------------------------------------------------------
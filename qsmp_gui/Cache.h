@@ -21,137 +21,40 @@
 #include <qsmp_gui/common.h>
 
 #include <algorithm>
+#include <boost/atomic.hpp>
 #include <boost/iostreams/device/file_descriptor.hpp>
 #include <boost/iostreams/stream.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/optional.hpp>
 #include <boost/ptr_container/ptr_map.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <qsmp_gui/CacheFuture.h>
+#include <qsmp_gui/CacheId.h>
+#include <qsmp_gui/CacheSnapshot.h>
+#include <qsmp_gui/GitObjectStore.h>
+#include <qsmp_gui/GitRefs.h>
+#include <qsmp_gui/NameArena.h>
 #include <qsmp_gui/ViewSelector.h>
-#include <qsmp_gui/Process.h>
+#include <qsmp_lib/Process.h>
+#include <qsmp_gui/ShardedMap.h>
+#include <qsmp_gui/SpscRing.h>
+#include <QtCore/qbytearray.h>
 
 
 QSMP_BEGIN
 
 
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-
-inline uint8_t FromHex(char ch)
-{
-  uint8_t ret = 0;
-  if ('0' <= ch && ch <= '9')
-    ret = ch - '0';
-  else if ('a' <= ch && ch <= 'f')
-    ret = ch - 'a' + 10;
-  else if ('A' <= ch && ch <= 'F')
-    ret = ch - 'A' + 10;
-  return ret;
-}
-inline char ToHexLow(uint8_t v)
-{
-  v &= 0x0F;
-  if (v < 10)
-    return '0' + v;
-  else
-    return 'a' - 10 + v;
-}
-inline char ToHexHigh(uint8_t v)
-{
-  v >>= 4;
-  if (v < 10)
-    return '0' + v;
-  else
-    return 'a' - 10 + v;
-}
-
-class CacheId
-{
-public:
-  CacheId(){}
-  CacheId(const char* string)
-  {
-    FromTextString(boost::as_literal(string));
-  }
-
-  const QString& string()const{return string_;}
-
-  bool operator==(const CacheId& r)const
-  {
-    return boost::equals(data_,r.data_);
-  }
-  bool operator!=(const CacheId& r)const
-  {
-    return !(*this == r);
-  }
-  template<class Range1T>
-  void FromTextString(const Range1T& range)
-  {
-    ASSERTE("Cache",boost::size(range) == 40);
-    typename boost::range_iterator<Range1T>::type ii = boost::begin(range);
-    string_ = QString::fromAscii(&*ii, 40);
-    for(size_t i = 0; i < 20; ++i)
-    {
-      data_[i]  = 0xF0 & (FromHex(*ii++) << 4);
-      data_[i] |= 0x0F & (FromHex(*ii++));
-    }
-  }
-  template<class Range1T>
-  void FromBinString(const Range1T& range)
-  {
-    ASSERTE("Cache",boost::size(range) == 20);
-    std::copy(boost::begin(range),boost::end(range),data_.begin());
-    char output[40];
-    for(size_t i = 0; i < 20; ++i)
-    {
-      output[2*i]   = ToHexHigh(data_[i]);
-      output[2*i+1] = ToHexLow(data_[i]);
-    }
-    string_ = QString::fromAscii(output,40);
-  }
-private:
-  friend size_t hash_value(const CacheId& id);
-  template<class CharT, class traits>
-  friend std::basic_ostream<CharT, traits>& operator<<(std::basic_ostream<CharT, traits>& stream, const CacheId& r);
-  template<class CharT, class InItrT>
-  friend class CacheIdInputFacet;
-  template<class CharT, class InItrT>
-  friend class CacheIdOutputFacet;
-
-
-  boost::array<uint8_t,20> data_;
-  QString                  string_;
-};
-
-//-----------------------------------------------------------------------------
-
-BOOST_STATIC_ASSERT(sizeof(uint8_t)*20 > sizeof(size_t));
-
-inline size_t hash_value(const CacheId& id)
-{
-  return *reinterpret_cast<const size_t*>(&id.data_[0]);
-}
-
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-
-template<class CharT, class traits>
-std::basic_ostream<CharT, traits>& operator<<(std::basic_ostream<CharT, traits>& stream, const CacheId& r)
-{
-  char output[40];
-  for(size_t i = 0; i < 20; ++i)
-  {
-    output[2*i]   = ToHexHigh(r.data_[i]);
-    output[2*i+1] = ToHexLow(r.data_[i]);
-  }
-  stream.write(output,40);
-  return stream;
-}
-
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
@@ -179,28 +82,46 @@ template<class T>
 class CacheEntry
 {
 public:
-  CacheEntry():valid_(false){}
+  CacheEntry():valid_(false),referenced_(false),pins_(0){}
   friend class Cache;
   friend class cache::BlobState;
   friend class cache::TreeState;
   friend class cache::CommitState;
 
-  explicit CacheEntry(const CacheId& id):id_(id),valid_(false){}
-  explicit CacheEntry(const CacheId& id, const T& data):id_(id),data_(data),valid_(false){}
-
-  CacheId     id_;
-  bool        valid_;
-  T           data_;
+  explicit CacheEntry(const CacheId& id):id_(id),valid_(false),referenced_(false),pins_(0){}
+  explicit CacheEntry(const CacheId& id, const T& data):id_(id),valid_(false),referenced_(false),pins_(0),data_(data){}
+  //Only used to insert entries into the map, so never copies a pin
+  CacheEntry(const CacheEntry& other)
+    : id_(other.id_),valid_(other.valid_.load()),referenced_(other.referenced_.load()),pins_(0),data_(other.data_){}
+
+  CacheId             id_;
+  //Both are read without the shard lock. Only read data_ while the entry is pinned (see
+  //CachePin), valid_ on its own may be cleared by an eviction at any time.
+  boost::atomic<bool> valid_;
+  //Set whenever the entry is looked up, cleared as the eviction clock passes it
+  boost::atomic<bool> referenced_;
+  //Pinned entries are skipped by the eviction clock, guarded by the shard lock
+  size_t              pins_;
+  T                   data_;
+private:
+  CacheEntry& operator=(const CacheEntry&);
 };
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
-typedef QString Blob;
+//Blobs are kept as the raw bytes from git. QByteArray is implicitly shared so handing a blob out
+//of the cache only bumps a reference count. Use BlobText to decode it for display.
+typedef QByteArray Blob;
 typedef CacheEntry<Blob> CacheBlob;
 typedef const CacheBlob* CacheBlobRef;
 
+inline QString BlobText(const Blob& blob)
+{
+  return QString::fromUtf8(blob.constData(), blob.size());
+}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
@@ -211,12 +132,30 @@ typedef const CacheTree* CacheTreeRef;
 class Tree
 {
 public:
+  //Entries are kept small as there is one for every file in the library. The name is an offset
+  //in the cache's name arena, only decode it with name() when it is going to be displayed.
   struct Entry
   {
-    Entry():blob_(NULL),tree_(NULL){}
-    QString       name_;
-    CacheBlobRef  blob_;
-    CacheTreeRef  tree_;
+    enum Kind
+    {
+      Kind_None,
+      Kind_Blob,
+      Kind_Tree,
+    };
+
+    Entry():name_(0),kind_(Kind_None),object_(NULL){}
+    Entry(NameArena::Offset name, CacheBlobRef blob):name_(name),kind_(Kind_Blob),object_(blob){}
+    Entry(NameArena::Offset name, CacheTreeRef tree):name_(name),kind_(Kind_Tree),object_(tree){}
+
+    CacheBlobRef blob()const{return kind_ == Kind_Blob ? static_cast<CacheBlobRef>(object_) : NULL;}
+    CacheTreeRef tree()const{return kind_ == Kind_Tree ? static_cast<CacheTreeRef>(object_) : NULL;}
+    QString      name()const;
+    //The id of the blob or tree, all zeros for Kind_None
+    CacheId      id()const;
+
+    NameArena::Offset name_;
+    Kind              kind_;
+    const void*       object_;
   };
   typedef std::vector<Entry> Children;
   friend class cache::TreeState;
@@ -236,6 +175,12 @@ class Commit
 public:
   Commit():tree_(NULL){}
   explicit Commit(CacheTreeRef tree);
+
+  const CacheId&                     id()const{return id_;}
+  const QString&                     message()const{return message_;}
+  CacheTreeRef                       tree()const{return tree_;}
+  const std::vector<CacheCommitRef>& parents()const{return parents_;}
+  const boost::posix_time::ptime&    commit_date()const{return commit_date_;}
 private:
   friend class cache::CommitState;
   CacheId                               id_;
@@ -249,11 +194,24 @@ private:
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
+class CacheWorker;
+
 class CacheThread
 {
   QSMP_NON_COPYABLE(CacheThread);
 public:
-  CacheThread(LogContext log, const fs::path& path);
+  //Native reads the object database directly, CatFile goes through a git cat-file --batch process.
+  //If the object database can't be opened then we fall back to CatFile.
+  enum Mode
+  {
+    Mode_Native,
+    Mode_CatFile,
+  };
+
+  //Objects are read by a pool of workers, each with its own read thread and git process or
+  //object store. workers defaults to one per core.
+  CacheThread(LogContext log, const fs::path& path, Mode mode = Mode_Native, size_t workers = 0);
+  ~CacheThread();
 
   typedef boost::function<void ()> FinishCallback;
   typedef boost::function<void (const CacheId&)> RequestCallback;
@@ -263,44 +221,152 @@ public:
     virtual void OnCommit(CacheCommitRef commit){}
     virtual void OnTree(CacheTreeRef tree){}
     virtual void OnBlob(CacheBlobRef blob){}
+    //git doesn't have the object, it won't be returned
+    virtual void OnMissing(const CacheId& id){}
   };
 
+  //Any number of tasks can be running at once. Each object read is given to the task which
+  //requested it, and requests from all tasks are interleaved into the same stream to git.
   void AddTask(shared_ptr<Task> task);
 
-  void OnCommit(CacheCommitRef commit);
-  void OnTree(CacheTreeRef tree);
-  void OnBlob(CacheBlobRef blob);
+  //The maximum number of requests which have been sent to git but not yet returned. Further
+  //requests are queued and sent as objects come back.
+  void SetRequestWindow(size_t window);
+
+  //Called from the worker read threads. Objects are handed over through each worker's ring,
+  //after which the worker calls Wake in case the write thread has gone to sleep. Missing
+  //objects are rare enough to go through the locked queue.
+  void Wake(){idle_signal_.Notify();}
+  void OnMissing(const CacheId& id);
 
 private:
-  void ReadThread();
+  enum
+  {
+    DefaultRequestWindow = 256,
+    //Points on the hash ring per worker, more points evens out the share each worker gets
+    VirtualNodes         = 64,
+  };
+
+  typedef std::vector<shared_ptr<Task> >                     Waiters;
+  typedef boost::unordered_map<CacheId,Waiters>              PendingRequests;
+  typedef std::map<Task*,shared_ptr<Task> >                  ActiveTasks;
+  typedef std::vector<std::pair<size_t,size_t> >             HashRing;
+
   void WriteThread();
-  void RequestId(const CacheId& id);
-  void Finish();
+  bool DrainWorkers();
+  bool IsIdle();
+  void StartTask(shared_ptr<Task> task);
+  bool PopWaiters(const CacheId& id, Waiters* waiters);
+  template<class Ref>
+  void Deliver(Ref object, void (Task::*callback)(Ref));
+  void DeliverMissing(const CacheId& id);
+  void RequestId(Task* task, const CacheId& id);
+  void SendRequests();
+  void Finish(Task* task);
+  CacheWorker& Route(const CacheId& id);
 
   typedef boost::lock_guard<boost::mutex> guard;
 
   const LogContext                      log_;
   const LogContext                      log_write_;
   const LogContext                      log_write_profile_;
-  const LogContext                      log_read_;
-
-  std::queue<shared_ptr<Task> >         task_queue_;
-  shared_ptr<Task>                      current_task_;
-  boost::mutex                          task_queue_lock_;
-  boost::condition_variable             task_signal_;
 
+  //New tasks and missing objects, guarded by cache_queues_lock_. The objects themselves come
+  //in through the workers' rings.
   boost::mutex                          cache_queues_lock_;
-  boost::condition_variable             cache_queues_signal_;
-  std::deque<CacheCommitRef>            commit_queue_;
-  std::deque<CacheTreeRef>              tree_queue_;
-  std::deque<CacheBlobRef>              blob_queue_;
+  std::deque<shared_ptr<Task> >         task_queue_;
+  std::deque<CacheId>                   missing_queue_;
+  //The write thread sleeps on this once the queues and rings are empty
+  IdleSignal                            idle_signal_;
+
+  //Only used by the write thread. Every id which has been asked for but not yet returned has
+  //one entry in pending_ holding each task waiting on it. An id is only sent to git by the
+  //first request for it, later requests are attached to that one and all of the waiters are
+  //given the object when it comes back.
+  ActiveTasks                           active_tasks_;
+  PendingRequests                       pending_;
+  std::deque<CacheId>                   unsent_requests_;
+  size_t                                requests_in_flight_;
+  size_t                                request_window_;
+  size_t                                requests_;
+  size_t                                coalesced_requests_;
+
+  //Requests are routed to the worker owning the next point on the ring after the id's hash
+  boost::ptr_vector<CacheWorker>        workers_;
+  HashRing                              ring_;
 
+  boost::thread                         write_thread_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//A single reader of the object database along with the thread parsing its output
+class CacheWorker
+{
+  QSMP_NON_COPYABLE(CacheWorker);
+public:
+  CacheWorker(LogContext log, CacheThread* thread, const fs::path& path, CacheThread::Mode mode);
+
+  //Both are only called from the cache thread's write thread. Requests are batched until the
+  //next Flush.
+  void Request(const CacheId& id);
+  void Flush();
+
+  //Called from the read thread as each object is parsed
+  void OnCommit(CacheCommitRef commit);
+  void OnTree(CacheTreeRef tree);
+  void OnBlob(CacheBlobRef blob);
+  void OnMissing(const CacheId& id);
 
-  Process                               git_;
-  io::stream<io::file_descriptor_sink>  git_stdin_;
+  //Objects are passed to the write thread as pointers with their type in the low bits, every
+  //cache entry is at least 4 byte aligned so they are always free
+  enum Tag
+  {
+    Tag_Commit = 0,
+    Tag_Tree   = 1,
+    Tag_Blob   = 2,
+    TagMask    = 3,
+  };
+  typedef boost::uintptr_t TaggedObject;
+
+  enum
+  {
+    RingCapacity = 4096,
+  };
+
+  //Only called from the write thread, false once the ring is empty
+  bool Pop(TaggedObject& object){return ring_.TryPop(object);}
+  bool empty()const{return ring_.empty();}
+
+private:
+  void ReadThread();
+  void NativeReadThread();
+  void Push(const void* object, Tag tag);
+
+  typedef boost::lock_guard<boost::mutex> guard;
+
+  const LogContext                      log_;
+  CacheThread*                          thread_;
+  CacheThread::Mode                     mode_;
+
+  //Parsed objects on their way to the write thread. This worker's read thread is the only
+  //producer and the write thread the only consumer.
+  SpscRing<TaggedObject,RingCapacity>   ring_;
+
+  //Native mode
+  GitObjectStore                        store_;
+  std::vector<CacheId>                  request_batch_;
+  boost::mutex                          request_queue_lock_;
+  boost::condition_variable             request_queue_signal_;
+  std::deque<CacheId>                   request_queue_;
+
+  //CatFile mode
+  boost::scoped_ptr<Process>                                git_;
+  boost::scoped_ptr<io::stream<io::file_descriptor_sink> >  git_stdin_;
 
   boost::thread                         read_thread_;
-  boost::thread                         write_thread_;
 };
 
 //-----------------------------------------------------------------------------
@@ -315,6 +381,13 @@ public:
 
   Cache(boost::restricted);
 
+  //The repository objects and refs are read from. Has to be set before the cache is first
+  //leased, defaults to the current directory.
+  static void SetRepository(const fs::path& repository);
+  //How objects are read, see CacheThread. These also have to be set before the cache is first
+  //leased, a workers or request_window of 0 keeps the default.
+  static void SetReaders(CacheThread::Mode mode, size_t workers, size_t request_window = 0);
+
   
   //The Lookup functions are split up into two sections and lookup two different data types:
   //1. LookupCacheX: only lookups the item from the cache and will not go out to git to get the data
@@ -328,10 +401,34 @@ public:
   //As a side note: note that all data in the cache is _owned_ by the cache and thus will not be
   //valid if the cache is cleared/destroyed
 
+  //Blob data and tree children are evicted once the cache holds more than the memory budget.
+  //The entries themselves are kept so refs stay valid, they just go back to being invalid and
+  //will be fetched again by the next LookupX. Entries which have been looked up recently are
+  //given a second chance before they are evicted.
+  void SetMemoryBudget(size_t bytes);
+
+  //A pinned entry isn't evicted, so its data can be read without holding any lock until it is
+  //unpinned. Pin returns false without pinning if the entry isn't valid, every Pin which
+  //succeeds has to be matched by an Unpin. Use CachePin where the pin doesn't outlive a scope.
+  bool Pin(CacheBlobRef blob);
+  bool Pin(CacheTreeRef tree);
+  void Unpin(CacheBlobRef blob);
+  void Unpin(CacheTreeRef tree);
+
+  //Trees and blobs are saved to a snapshot in the settings directory on shutdown and loaded from
+  //it by LookupCacheTree/LookupCacheBlob as they are needed. Objects from the previous snapshot
+  //are carried across while the file stays under the snapshot budget, those which weren't used
+  //this time are the first to go.
+  void SaveSnapshot();
+  void SetSnapshotBudget(boost::uint64_t bytes);
+
   CacheBlobRef   LookupCacheBlob(const CacheId& id);
   CacheTreeRef   LookupCacheTree(const CacheId& id);
   CacheCommitRef LookupCacheCommit(const CacheId& id);
 
+  //depth_to_load is the number of levels of trees to fetch including the one looked up, along
+  //with the blobs in each of them. For commits a depth of 0 only loads the commit itself, anything
+  //more loads the commit's tree to that depth.
   CacheBlobRef   LookupBlob(const CacheId& id);
   CacheBlobRef   LookupBlob(const Path& repo, const Path& head, const Path& path);
   CacheTreeRef   LookupTree(const CacheId& id, size_t depth_to_load = 1);
@@ -339,27 +436,170 @@ public:
   CacheCommitRef LookupCommit(const CacheId& id, size_t depth_to_load = 0);
   CacheCommitRef LookupCommit(const Path& repo, const Path& head, size_t depth_to_load = 0);
 
-  CacheBlobRef   SetBlob(const CacheId& id, const Blob& blob);
-  CacheTreeRef   SetTree(const CacheId& id, const Tree& tree);
+  //Fetches the objects from git whether they are loaded already or not. The future is ready once
+  //every one has arrived in the cache (or git has said it doesn't have it), continuations run on
+  //the cache thread. Futures can be chained with Then/ThenFetch and joined with WhenAll so a
+  //traversal doesn't need its own task to count what it's waiting for.
+  CacheFuture    Fetch(const CacheId& id);
+  CacheFuture    Fetch(const std::vector<CacheId>& ids);
+
+  //Fetches a tree breadth first down to depth levels along with the blobs at each level. Each level
+  //is requested from git in one burst and ids are only requested once however many times they
+  //appear. on_subtree is called for each tree once it and everything under it (to the depth) has
+  //been loaded and on_finish once the whole prefetch is done, both on the cache thread. The tree
+  //has to be pinned to read its children as they may have been evicted since.
+  typedef boost::function<void (CacheTreeRef)> SubtreeCallback;
+  typedef boost::function<void ()>             PrefetchCallback;
+  void Prefetch(const CacheId& tree, size_t depth,
+                SubtreeCallback on_subtree = SubtreeCallback(),
+                PrefetchCallback on_finish = PrefetchCallback());
+  //As Prefetch, but starts by loading the commit then its tree
+  void PrefetchCommit(const CacheId& commit, size_t depth,
+                      SubtreeCallback on_subtree = SubtreeCallback(),
+                      PrefetchCallback on_finish = PrefetchCallback());
+
+  //Finds the object at path below the root tree. If every tree on the way is already loaded the
+  //entry is filled in straight away and true is returned. Otherwise the missing trees are fetched
+  //and on_resolved is called on the cache thread once the path has been resolved. The entry is
+  //Kind_None if the path doesn't exist.
+  typedef boost::function<void (const Path&, const Tree::Entry&)> ResolveCallback;
+  bool ResolvePath(const CacheId& root, const Path& path, Tree::Entry* entry,
+                   ResolveCallback on_resolved = ResolveCallback());
+  //Resolves many paths below the same root at once, the trees missing on the way to any of them
+  //are requested together. on_resolved is called for every path on the cache thread.
+  void ResolvePaths(const CacheId& root, const std::vector<Path>& paths, ResolveCallback on_resolved);
+
+  //Compares two trees and reports each path which differs between them on the cache thread.
+  //Subtrees with the same id on both sides are skipped without being loaded. A directory which
+  //only exists on one side is reported once as added or removed rather than file by file, and
+  //a path which changes between a file and a directory is reported as removed then added.
+  //on_finish is called once the whole diff has been reported.
+  struct TreeChange
+  {
+    enum Kind
+    {
+      Change_Added,
+      Change_Removed,
+      Change_Modified,
+    };
+    TreeChange(Kind kind, const Path& path, const Tree::Entry& old_entry, const Tree::Entry& new_entry)
+      : kind_(kind),path_(path),old_(old_entry),new_(new_entry){}
+    Kind        kind_;
+    Path        path_;
+    //Kind_None on the side the path doesn't exist
+    Tree::Entry old_;
+    Tree::Entry new_;
+  };
+  typedef boost::function<void (const TreeChange&)> DiffCallback;
+  void DiffTrees(const CacheId& old_tree, const CacheId& new_tree,
+                 DiffCallback on_change, PrefetchCallback on_finish = PrefetchCallback());
+  //As DiffTrees, starting from the trees of two commits
+  void DiffCommits(const CacheId& old_commit, const CacheId& new_commit,
+                   DiffCallback on_change, PrefetchCallback on_finish = PrefetchCallback());
+
+  //Walks from entry down the path components starting at depth, using only what is already in
+  //the cache. Returns false with entry and depth left at the first tree which isn't loaded,
+  //otherwise returns true with entry set to the result.
+  typedef std::vector<std::string> PathComponents;
+  static PathComponents SplitPath(const Path& path);
+  bool WalkPath(const PathComponents& components, size_t* depth, Tree::Entry* entry);
+
+  //The workers pass pin so that the object can't be evicted before the write thread has handed
+  //it to the tasks waiting on it, the write thread unpins it once it has
+  CacheBlobRef   SetBlob(const CacheId& id, const Blob& blob, bool pin = false);
+  CacheTreeRef   SetTree(const CacheId& id, const Tree& tree, bool pin = false);
   CacheCommitRef SetCommit(const CacheId& id, const Commit& commit);
 
+  //Tree entry names are interned here
+  NameArena& names(){return names_;}
+
+  //Views can listen here to find out when a ref they are showing has moved
+  GitRefs& refs(){return refs_;}
+
   void AddThreadTask(shared_ptr<CacheThread::Task> task)
   {cache_thread_.AddTask(task);}
 
+  //Logs the size, lock contention, hit rate and evictions of each of the maps to the Profile context
+  void LogStatistics();
+
 private:
-  typedef boost::unordered_map<CacheId,CacheBlob>   BlobCache;
-  typedef boost::unordered_map<CacheId,CacheTree>   TreeCache;
-  typedef boost::unordered_map<CacheId,CacheCommit> CommitCache;
-  typedef boost::lock_guard<boost::mutex> lock_guard;
+  typedef ShardedMap<CacheId,CacheBlob>   BlobCache;
+  typedef ShardedMap<CacheId,CacheTree>   TreeCache;
+  typedef ShardedMap<CacheId,CacheCommit> CommitCache;
+  typedef CacheEntry<Tree::Children>       CachePathIndex;
+  typedef ShardedMap<CacheId,CachePathIndex> PathCache;
+
+  enum FindResult
+  {
+    Find_Found,
+    Find_NotFound,
+    Find_NotLoaded,
+  };
+  //Looks name up in the path cache, adding the tree's children to it the first time through
+  //or after they have been evicted
+  FindResult FindChild(CacheTreeRef tree, const std::string& name, Tree::Entry* entry);
+  //Binary searches a tree's children sorted by name offset
+  static FindResult FindName(const Tree::Children& children, bool known, NameArena::Offset offset, Tree::Entry* entry);
+
+  //Finds the object at path below the commit for head, prefetching it to depth_to_load
+  bool LookupPath(const Path& repo, const Path& head, const Path& path, size_t depth_to_load, Tree::Entry* entry);
+
+  //These fill an invalid entry from the snapshot
+  void LoadTree(const CacheId& id);
+  void LoadBlob(const CacheId& id);
+  //Returns the entry for id without looking in the snapshot or touching the counters
+  CacheTreeRef StubTree(const CacheId& id);
 
   LogContext    log_;
+  LogContext    log_profile_;
 
-  CacheThread   cache_thread_;
+  //Split evenly between the blob, tree and path shards
+  size_t        memory_budget_;
+  boost::uint64_t snapshot_budget_;
 
-  boost::mutex  cache_lock_;
+  //Each map is locked per shard so the reader, task and gui threads only
+  //contend when they hit the same shard
   BlobCache     blob_cache_;
   TreeCache     tree_cache_;
   CommitCache   commit_cache_;
+
+  //The children of each tree which has been looked up by path, sorted by name offset. A tree's
+  //children are added and evicted together, so a valid entry tells a name which isn't there
+  //apart from a tree which hasn't been added yet. This is charged and evicted separately from
+  //the trees so paths can still be resolved through trees whose children have been.
+  PathCache     path_cache_;
+
+  NameArena     names_;
+
+  CacheSnapshot       snapshot_;
+  boost::shared_mutex snapshot_lock_;
+
+  GitRefs       refs_;
+
+  CacheThread   cache_thread_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//Pins an entry for as long as it is in scope, if the entry is valid. Thus
+//  CachePin<Tree> pin(tree);
+//  if (pin)
+//    ... read tree->data_ ...
+template<class T>
+class CachePin
+{
+  QSMP_NON_COPYABLE(CachePin);
+  typedef const CacheEntry<T>* Ref;
+  typedef Ref CachePin::*SafeBool;
+public:
+  explicit CachePin(Ref entry):entry_(Cache::lease()->Pin(entry) ? entry : NULL){}
+  ~CachePin(){if (entry_) Cache::lease()->Unpin(entry_);}
+
+  operator SafeBool()const{return entry_ ? &CachePin::entry_ : NULL;}
+private:
+  Ref entry_;
 };
 
 //-----------------------------------------------------------------------------
@@ -0,0 +1,167 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include "stdafx.h"
+#include <qsmp_gui/CacheFuture.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  void RunThen(CacheFuture::Callback f, CachePromise next)
+  {
+    f();
+    next.SetReady();
+  }
+
+  void ForwardReady(CachePromise next)
+  {
+    next.SetReady();
+  }
+
+  void RunThenFetch(CacheFuture::FutureCallback f, CachePromise next)
+  {
+    f().Then(boost::bind(&ForwardReady, next));
+  }
+
+  //Counts down the futures given to WhenAll
+  struct Countdown
+  {
+    Countdown(size_t count):count_(count){}
+    boost::mutex  lock_;
+    size_t        count_;
+    CachePromise  promise_;
+  };
+
+  void CountdownArrived(boost::shared_ptr<Countdown> countdown)
+  {
+    {
+      boost::lock_guard<boost::mutex> lock(countdown->lock_);
+      if (--countdown->count_ != 0)
+        return;
+    }
+    countdown->promise_.SetReady();
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+CacheFuture::CacheFuture()
+: state_(new State)
+{
+  state_->ready_ = true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheFuture::is_ready()const
+{
+  boost::lock_guard<boost::mutex> lock(state_->lock_);
+  return state_->ready_;
+}
+
+//-----------------------------------------------------------------------------
+
+CacheFuture CacheFuture::Then(Callback f)const
+{
+  CachePromise next;
+  OnReady(boost::bind(&RunThen, f, next));
+  return next.future();
+}
+
+//-----------------------------------------------------------------------------
+
+CacheFuture CacheFuture::ThenFetch(FutureCallback f)const
+{
+  CachePromise next;
+  OnReady(boost::bind(&RunThenFetch, f, next));
+  return next.future();
+}
+
+//-----------------------------------------------------------------------------
+
+CacheFuture CacheFuture::WhenAll(const std::vector<CacheFuture>& futures)
+{
+  if (futures.empty())
+    return CacheFuture();
+
+  boost::shared_ptr<Countdown> countdown(new Countdown(futures.size()));
+  for (std::vector<CacheFuture>::const_iterator ii = futures.begin(); ii != futures.end(); ++ii)
+    ii->OnReady(boost::bind(&CountdownArrived, countdown));
+  return countdown->promise_.future();
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheFuture::OnReady(Callback f)const
+{
+  {
+    boost::lock_guard<boost::mutex> lock(state_->lock_);
+    if (!state_->ready_)
+    {
+      state_->continuations_.push_back(f);
+      return;
+    }
+  }
+  f();
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheFuture::SetReady(boost::shared_ptr<State> state)
+{
+  std::vector<Callback> continuations;
+  {
+    boost::lock_guard<boost::mutex> lock(state->lock_);
+    if (state->ready_)
+      return;
+    state->ready_ = true;
+    continuations.swap(state->continuations_);
+  }
+  //Run without the lock so they can add continuations of their own
+  for (std::vector<Callback>::iterator ii = continuations.begin(); ii != continuations.end(); ++ii)
+    (*ii)();
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+CachePromise::CachePromise()
+: state_(new CacheFuture::State)
+{
+}
+
+//-----------------------------------------------------------------------------
+
+void CachePromise::SetReady()
+{
+  CacheFuture::SetReady(state_);
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
@@ -0,0 +1,102 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_CACHEFUTURE_H_
+#define QSMP_CACHEFUTURE_H_
+
+#include <qsmp_gui/common.h>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <vector>
+
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+class CachePromise;
+
+//Something which will be done at some point, usually a batch of objects arriving in the cache.
+//Futures carry no value, once one is ready the objects can be looked up with LookupCacheX.
+//
+//Continuations are run by whichever thread makes the future ready (the cache thread for
+//fetches), or straight away by the caller if it is ready already. Copies of a future all
+//refer to the same state.
+class CacheFuture
+{
+public:
+  typedef boost::function<void ()>        Callback;
+  typedef boost::function<CacheFuture ()> FutureCallback;
+
+  //A future which is already ready
+  CacheFuture();
+
+  bool is_ready()const;
+
+  //Calls f once this is ready, the returned future is ready once f has returned
+  CacheFuture Then(Callback f)const;
+  //Calls f once this is ready, the returned future is ready once the future f returns is. This is
+  //how one fetch is chained on to another, eg fetching the blobs of a tree once it has arrived.
+  CacheFuture ThenFetch(FutureCallback f)const;
+
+  //Ready once all of the futures are
+  static CacheFuture WhenAll(const std::vector<CacheFuture>& futures);
+
+private:
+  friend class CachePromise;
+  struct State
+  {
+    State():ready_(false){}
+    boost::mutex          lock_;
+    bool                  ready_;
+    std::vector<Callback> continuations_;
+  };
+
+  explicit CacheFuture(boost::shared_ptr<State> state):state_(state){}
+  void OnReady(Callback f)const;
+  static void SetReady(boost::shared_ptr<State> state);
+
+  boost::shared_ptr<State> state_;
+};
+
+//-----------------------------------------------------------------------------
+
+//The producing side of a future
+class CachePromise
+{
+public:
+  CachePromise();
+
+  CacheFuture future()const{return CacheFuture(state_);}
+  //Runs the continuations, only the first call does anything
+  void        SetReady();
+
+private:
+  boost::shared_ptr<CacheFuture::State> state_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
+
+#endif
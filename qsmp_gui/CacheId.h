@@ -0,0 +1,218 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_CACHEID_H_
+#define QSMP_CACHEID_H_
+
+#include <qsmp_gui/common.h>
+
+#include <algorithm>
+#include <boost/array.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/range.hpp>
+#include <boost/range/as_literal.hpp>
+#include <boost/static_assert.hpp>
+#include <cstring>
+#include <ostream>
+#include <qsmp_lib/Log.h>
+#include <QtCore/qstring.h>
+
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace cacheid
+{
+  //Defined in a template so that the tables can live in the header
+  template<int Dummy>
+  struct HexTables
+  {
+    //Nibble value of each character, 0xFF for characters which aren't hex digits
+    static const uint8_t from_hex_[256];
+    //The two lower case hex digits of each byte value
+    static const char    to_hex_[513];
+  };
+
+  template<int Dummy>
+  const uint8_t HexTables<Dummy>::from_hex_[256] =
+  {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  };
+
+  template<int Dummy>
+  const char HexTables<Dummy>::to_hex_[513] =
+  "000102030405060708090a0b0c0d0e0f"
+  "101112131415161718191a1b1c1d1e1f"
+  "202122232425262728292a2b2c2d2e2f"
+  "303132333435363738393a3b3c3d3e3f"
+  "404142434445464748494a4b4c4d4e4f"
+  "505152535455565758595a5b5c5d5e5f"
+  "606162636465666768696a6b6c6d6e6f"
+  "707172737475767778797a7b7c7d7e7f"
+  "808182838485868788898a8b8c8d8e8f"
+  "909192939495969798999a9b9c9d9e9f"
+  "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+  "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+  "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+  "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+  "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+  "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+  typedef HexTables<0> Hex;
+}
+
+//-----------------------------------------------------------------------------
+
+inline uint8_t FromHex(char ch)
+{
+  uint8_t ret = cacheid::Hex::from_hex_[uint8_t(ch)];
+  return ret == 0xFF ? 0 : ret;
+}
+
+//Writes the two hex digits for v to output
+inline void ToHex(uint8_t v, char* output)
+{
+  output[0] = cacheid::Hex::to_hex_[2*v];
+  output[1] = cacheid::Hex::to_hex_[2*v+1];
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//The 20 byte SHA1 of a git object. This is a plain value so that it can be copied and compared
+//cheaply and embedded in every cache entry, the hex form is only built when it is asked for.
+class CacheId
+{
+public:
+  enum
+  {
+    Size    = 20,
+    HexSize = 40,
+  };
+
+  CacheId()
+  {
+    data_.assign(0);
+  }
+  CacheId(const char* string)
+  {
+    FromTextString(boost::as_literal(string));
+  }
+
+  QString string()const
+  {
+    char output[HexSize];
+    ToHex(output);
+    return QString::fromAscii(output,HexSize);
+  }
+  const boost::array<uint8_t,20>& data()const{return data_;}
+
+  //Writes the 40 hex digits to output, no terminator is added
+  void ToHex(char* output)const
+  {
+    for(size_t i = 0; i < Size; ++i)
+      qsmp::ToHex(data_[i], output + 2*i);
+  }
+
+  bool operator==(const CacheId& r)const
+  {
+    return memcmp(data_.data(), r.data_.data(), Size) == 0;
+  }
+  bool operator!=(const CacheId& r)const
+  {
+    return !(*this == r);
+  }
+  template<class Range1T>
+  void FromTextString(const Range1T& range)
+  {
+    ASSERTE("Cache",boost::size(range) == HexSize);
+    typename boost::range_iterator<Range1T>::type ii = boost::begin(range);
+    for(size_t i = 0; i < Size; ++i)
+    {
+      uint8_t high = FromHex(*ii++);
+      uint8_t low  = FromHex(*ii++);
+      data_[i] = uint8_t(high << 4) | low;
+    }
+  }
+  template<class Range1T>
+  void FromBinString(const Range1T& range)
+  {
+    ASSERTE("Cache",boost::size(range) == Size);
+    std::copy(boost::begin(range),boost::end(range),data_.begin());
+  }
+private:
+  boost::array<uint8_t,20> data_;
+};
+
+BOOST_STATIC_ASSERT(sizeof(CacheId) == CacheId::Size);
+
+//-----------------------------------------------------------------------------
+
+//SHA1s are evenly distributed already but the bytes are run through the 64 bit murmur3
+//finaliser anyway so that nothing depends on that
+inline size_t hash_value(const CacheId& id)
+{
+  boost::uint64_t h;
+  memcpy(&h, id.data().data(), sizeof(h));
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return size_t(h);
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+template<class CharT, class traits>
+std::basic_ostream<CharT, traits>& operator<<(std::basic_ostream<CharT, traits>& stream, const CacheId& r)
+{
+  char output[CacheId::HexSize];
+  r.ToHex(output);
+  stream.write(output,CacheId::HexSize);
+  return stream;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
+
+#endif
+
@@ -15,7 +15,6 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
  ******************************************************************************/
 
-
 #include "stdafx.h"
 #include "qsmp_gui/CacheModel.h"
 #include "qsmp_gui/CacheModel.moc"
@@ -27,182 +26,314 @@ QSMP_BEGIN
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
-class CacheModelFetchMore : public CacheThread::Task
+CacheModel::CacheModel(CacheTreeRef tree)
+: root_(tree, NULL, -1, 0),
+  next_serial_(1)
 {
-public:
-  CacheModelFetchMore(LogContext log, const CacheId& parent, boost::function<void ()> onfinish)
-    : log_(log),
-      model_finish_(onfinish),
-      parent_(parent)
-  {
-  }
+  serials_[root_.serial_] = &root_;
+}
 
-  void operator()(CacheThread::FinishCallback finish,
-                  CacheThread::RequestCallback request)
-  {
-    task_finish_  = finish;
-    request_      = request;
-    count_        = 0;
-    count_++;
-    request_(parent_);
-  }
-private:
-  virtual void OnTree(CacheTreeRef tree)
-  {
-    for(Tree::Children::const_iterator ii = tree->data_.children_.begin();
-        ii != tree->data_.children_.end();
-        ++ii)
-    {
-      if (ii->blob_ && !ii->blob_->valid_)
-      {
-        count_++;
-        request_(ii->blob_->id_);
-      }
-    }
+//-----------------------------------------------------------------------------
 
-    if (--count_ == 0)
-      Finish();
-  }
-  virtual void OnBlob(CacheBlobRef blob)
-  {
-    if (--count_ == 0)
-      Finish();
-  }
-  void Finish()
-  {
-    FLOG(log_, "Finished: %1%") % parent_;
-    model_finish_();
-    task_finish_();
-  }
+CacheModel::~CacheModel()
+{
+}
 
-  LogContext log_;
-  int     count_;
-  CacheId parent_;
-  boost::function<void ()> model_finish_;
-  CacheThread::FinishCallback task_finish_;
-  CacheThread::RequestCallback request_;
-};
+//-----------------------------------------------------------------------------
+
+bool CacheModel::CopyChildren(Directory* directory, Tree::Children* children)const
+{
+  //Gives the cache a chance to fill the tree from its snapshot
+  CacheTreeRef tree = directory->tree_;
+  if (!tree->valid_)
+    Cache::lease()->LookupCacheTree(tree->id_);
+
+  CachePin<Tree> pin(tree);
+  if (!pin)
+    return false;
+  *children = tree->data_.children_;
+  return true;
+}
 
 //-----------------------------------------------------------------------------
+
+void CacheModel::Fill(Directory* directory, Tree::Children& children)const
+{
+  directory->children_.swap(children);
+  directory->fetching_.assign(directory->children_.size(), false);
+  directory->loaded_ = true;
+}
+
 //-----------------------------------------------------------------------------
+
+bool CacheModel::Load(Directory* directory)const
+{
+  if (directory->loaded_)
+    return true;
+  Tree::Children children;
+  if (!CopyChildren(directory, &children))
+    return false;
+  Fill(directory, children);
+  return true;
+}
+
 //-----------------------------------------------------------------------------
 
-QVariant CacheModelNode::data(int column, int role)const
+CacheModel::Directory* CacheModel::DirectoryAt(const QModelIndex& index)const
 {
-  if (role == Qt::DisplayRole)
-  {
-    switch(column)
-    {
-    case 0:
-      return name_;
-    case 1:
-      return id_;
-    case 2:
-      return data_;
-    }
-  }
-  return QVariant();
+  if (Directory* directory = FindDirectory(index))
+    return directory;
+
+  Directory* parent = static_cast<Directory*>(index.internalPointer());
+  int row = index.row();
+  CacheTreeRef tree = parent->children_[row].tree();
+  if (!tree)
+    return NULL;
+  Directory* directory = new Directory(tree, parent, row, next_serial_++);
+  parent->directories_.insert(row, directory);
+  serials_[directory->serial_] = directory;
+  return directory;
 }
 
 //-----------------------------------------------------------------------------
 
-void CacheModelNode::fetchMore()
+CacheModel::Directory* CacheModel::FindDirectory(const QModelIndex& index)const
 {
-  if (!requested_more_children_)
-  {
-    //We only want to send off a cache request once
-    requested_more_children_ = true;
-    if (tree_->valid_)
-    {
-      AddChildrenFromCache(false);
-    }
-    else
-    {
-      Cache::lease()->AddThreadTask(
-        spnew<CacheModelFetchMore>("Fetch",
-                                   tree_->id_, 
-                                   boost::bind(InvokeMethod(model(),"IndexLoaded"),"QModelIndex",index(0))));
-      AddLoadingChild();
-    }
-  }
+  if (!index.isValid())
+    return &root_;
+
+  Directory* parent = static_cast<Directory*>(index.internalPointer());
+  boost::ptr_map<int,Directory>::iterator ii = parent->directories_.find(index.row());
+  if (ii == parent->directories_.end())
+    return NULL;
+  return ii->second;
 }
 
 //-----------------------------------------------------------------------------
 
-void CacheModelNode::AddChildrenFromCache(bool remove_loading)
+CacheModel::Directory* CacheModel::FindDirectory(int serial)const
 {
-  if (remove_loading)
-    RemoveChildren(0,1);
+  Serials::iterator ii = serials_.find(serial);
+  if (ii == serials_.end())
+    return NULL;
+  return ii->second;
+}
 
-  const Tree::Children& children = tree_->data_.children_;
-  more_children_ = false;
+//-----------------------------------------------------------------------------
+
+void CacheModel::Forget(Directory* directory)
+{
+  serials_.erase(directory->serial_);
+  for (boost::ptr_map<int,Directory>::iterator ii = directory->directories_.begin(); ii != directory->directories_.end(); ++ii)
+    Forget(ii->second);
+}
 
-  BeginAddChildren(children.size());
-  CacheModel* m = model();
+//-----------------------------------------------------------------------------
 
-  CacheModelNode* child = AddChildren(children.size());
-  for(Tree::Children::const_iterator ii = children.begin();
-      ii != children.end();
-      ++ii, ++child)
+const Tree::Entry* CacheModel::EntryAt(const QModelIndex& index)const
+{
+  if (!index.isValid())
+    return NULL;
+  Directory* parent = static_cast<Directory*>(index.internalPointer());
+  return &parent->children_[index.row()];
+}
+
+//-----------------------------------------------------------------------------
+
+QModelIndex CacheModel::IndexOf(Directory* directory)const
+{
+  if (!directory->parent_)
+    return QModelIndex();
+  return createIndex(directory->row_, 0, directory->parent_);
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheModel::canFetchMore(const QModelIndex& parent)const
+{
+  Directory* directory = DirectoryAt(parent);
+  return directory && !directory->requested_ && !Load(directory);
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheModel::fetchMore(const QModelIndex& parent)
+{
+  Directory* directory = DirectoryAt(parent);
+  if (!directory || directory->requested_ || Load(directory))
+    return;
+
+  //We only want to send off a cache request once
+  directory->requested_ = true;
+  Cache::lease()->Fetch(directory->tree_->id_)
+    .Then(boost::bind(InvokeMethod(this,"TreeLoaded"),"int",directory->serial_));
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheModel::TreeLoaded(int serial)
+{
+  Directory* directory = FindDirectory(serial);
+  if (!directory || directory->loaded_)
+    return;
+  QModelIndex index = IndexOf(directory);
+
+  //The tree is only read once, so the rows inserted are the rows announced even if the cache
+  //evicts it in the meantime
+  Tree::Children children;
+  if (!CopyChildren(directory, &children))
+    return;
+  if (children.empty())
   {
-    if (ii->blob_)
-      child->Init(ii->blob_, ii->name_);
-    else if (ii->tree_)
-      child->Init(ii->tree_, ii->name_);
+    Fill(directory, children);
+    return;
   }
-
-  EndAddChildren(m);
+  beginInsertRows(index, 0, int(children.size()) - 1);
+  Fill(directory, children);
+  endInsertRows();
 }
 
 //-----------------------------------------------------------------------------
 
-void CacheModelNode::AddLoadingChild()
+void CacheModel::FetchBlobs(Directory* directory, int row)const
 {
-  BeginAddChildren(1);
+  int first = std::max(row - int(PrefetchMargin), 0);
+  int last  = std::min(row + int(PrefetchMargin), int(directory->children_.size()) - 1);
 
-  CacheModel* m = model();
+  std::vector<CacheId> ids;
+  for (int i = first; i <= last; i++)
+  {
+    CacheBlobRef blob = directory->children_[i].blob();
+    if (!blob || blob->valid_ || directory->fetching_[i])
+      continue;
+    directory->fetching_[i] = true;
+    ids.push_back(blob->id_);
+  }
+  if (ids.empty())
+    return;
+
+  Cache::lease()->Fetch(ids)
+    .Then(boost::bind(InvokeMethod(const_cast<CacheModel*>(this),"BlobsLoaded"),
+                      "int",directory->serial_,
+                      "int",first,
+                      "int",last));
+}
 
-  CacheModelNode* child = AddChildren(1);
-  child->name_ = "Loading ...";
+//-----------------------------------------------------------------------------
 
-  EndAddChildren(m);
+void CacheModel::BlobsLoaded(int serial, int first, int last)
+{
+  Directory* directory = FindDirectory(serial);
+  if (!directory || !directory->loaded_)
+    return;
+  QModelIndex parent = IndexOf(directory);
+
+  //If the blobs are evicted they will be fetched again the next time they are shown
+  for (int i = first; i <= last; i++)
+    directory->fetching_[i] = false;
+  dataChanged(index(first, 0, parent), index(last, columnCount() - 1, parent));
 }
 
 //-----------------------------------------------------------------------------
 
-void CacheModelNode::Init(CacheTreeRef tree, const QString& name)
+void CacheModel::Collapsed(const QModelIndex& index)
 {
-  name_ = name;
-  id_   = tree->id_.string();
-  tree_ = tree;
-  more_children_ = !(tree->valid_ && tree->data_.children_.empty());
+  if (!index.isValid())
+    return;
+  Directory* parent = static_cast<Directory*>(index.internalPointer());
+  boost::ptr_map<int,Directory>::iterator ii = parent->directories_.find(index.row());
+  if (ii == parent->directories_.end())
+    return;
+
+  //The rows go with the directory so the view drops any indexes it holds into them, they come
+  //back from the cache when the directory is next expanded
+  Directory* directory = ii->second;
+  int rows = directory->loaded_ ? int(directory->children_.size()) : 0;
+  if (rows > 0)
+    beginRemoveRows(index, 0, rows - 1);
+  Forget(directory);
+  parent->directories_.erase(ii);
+  if (rows > 0)
+    endRemoveRows();
 }
 
 //-----------------------------------------------------------------------------
 
-void CacheModelNode::Init(CacheBlobRef blob, const QString& name)
+int CacheModel::columnCount(const QModelIndex& parent)const
 {
-  name_ = name;
-  id_   = blob->id_.string();
-  blob_ = blob;
-  data_ = blob->data_;
+  return 3;
 }
 
 //-----------------------------------------------------------------------------
+
+QVariant CacheModel::data(const QModelIndex& index, int role)const
+{
+  const Tree::Entry* entry = EntryAt(index);
+  if (!entry || role != Qt::DisplayRole)
+    return QVariant();
+
+  switch(index.column())
+  {
+  case 0:
+    return Cache::lease()->names().Text(entry->name_);
+  case 1:
+    return entry->id().string();
+  case 2:
+    if (CacheBlobRef blob = entry->blob())
+    {
+      CachePin<Blob> pin(blob);
+      if (pin)
+        return BlobText(blob->data_);
+      FetchBlobs(static_cast<Directory*>(index.internalPointer()), index.row());
+    }
+    break;
+  }
+  return QVariant();
+}
+
 //-----------------------------------------------------------------------------
+
+bool CacheModel::hasChildren(const QModelIndex& parent)const
+{
+  //Don't create a directory just to answer this
+  if (!parent.isValid())
+    return true;
+  const Tree::Entry* entry = EntryAt(parent);
+  if (!entry->tree())
+    return false;
+  Directory* directory = FindDirectory(parent);
+  return !directory || !directory->loaded_ || !directory->children_.empty();
+}
+
 //-----------------------------------------------------------------------------
 
-CacheModel::CacheModel(CacheTreeRef tree)
-: Base(this)
+int CacheModel::rowCount(const QModelIndex& parent)const
 {
-  FromIndex(QModelIndex())->Init(tree, "/");
+  if (parent.column() > 0)
+    return 0;
+  Directory* directory = DirectoryAt(parent);
+  if (!directory || !directory->loaded_)
+    return 0;
+  return int(directory->children_.size());
 }
 
 //-----------------------------------------------------------------------------
 
-void CacheModel::IndexLoaded(const QModelIndex& index)
+QModelIndex CacheModel::index(int row, int column, const QModelIndex& parent)const
 {
-  FromIndex(index)->AddChildrenFromCache(true);
+  Directory* directory = DirectoryAt(parent);
+  if (!directory || !directory->loaded_ || row < 0 || row >= int(directory->children_.size()))
+    return QModelIndex();
+  return createIndex(row, column, directory);
+}
+
+//-----------------------------------------------------------------------------
+
+QModelIndex CacheModel::parent(const QModelIndex& index)const
+{
+  if (!index.isValid())
+    return QModelIndex();
+  return IndexOf(static_cast<Directory*>(index.internalPointer()));
 }
 
 //-----------------------------------------------------------------------------
@@ -210,4 +341,3 @@ void CacheModel::IndexLoaded(const QModelIndex& index)
 //-----------------------------------------------------------------------------
 
 QSMP_END
-
@@ -19,61 +19,102 @@
 #define QSMP_CACHEVIEW_H_
 
 #include <qsmp_gui/common.h>
+#include <boost/ptr_container/ptr_map.hpp>
+#include <boost/unordered_map.hpp>
 #include <qsmp_gui/Cache.h>
-#include <qsmp_gui/TreeModel.h>
+#include <QtCore/QAbstractItemModel>
+#include <vector>
 
 QSMP_BEGIN
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
-class CacheModel;
 
-class CacheModelNode : public TreeModelNode<CacheModelNode, CacheModel>
+//Shows a tree from the cache. Rows aren't backed by nodes of their own, every index points at the
+//directory holding it and the row is read straight out of that directory's copy of the tree's
+//children. Thus a directory with 100k files costs one entry per file and the row count is known as
+//soon as the tree is loaded.
+//
+//Blobs are only fetched for the rows the view actually asks for along with a margin either side,
+//and nothing is kept per row once the fetch is done so rows which scroll out of view hold nothing
+//but their entry. Their data lives in the cache and is evicted along with everything else.
+//
+//A directory is only created once the view looks inside it, and is dropped along with everything
+//below it when the view collapses it. It's recreated from the cache when it's next expanded.
+class CacheModel : public QAbstractItemModel
 {
+  Q_OBJECT
 public:
-  typedef TreeModelNode<CacheModelNode, CacheModel> Base;
-
-  CacheModelNode(CacheModel* model)
-    : Base(model),
-      tree_(NULL),blob_(NULL),commit_(NULL),more_children_(false),requested_more_children_(false)
-  {}
+  CacheModel(CacheTreeRef tree);
+  ~CacheModel();
 
-  bool        canFetchMore()const{return more_children_;}
-  int         columnCount()const{return 3;}
-  QVariant    data(int column, int role)const;
-  void        fetchMore();
-  bool        hasChildren()const{return Base::hasChildren() || more_children_;}
+  virtual bool        canFetchMore(const QModelIndex& parent)const;
+  virtual int         columnCount(const QModelIndex& parent = QModelIndex())const;
+  virtual QVariant    data(const QModelIndex& index, int role = Qt::DisplayRole)const;
+  virtual void        fetchMore(const QModelIndex& parent);
+  virtual bool        hasChildren(const QModelIndex& parent = QModelIndex())const;
+  virtual int         rowCount(const QModelIndex& parent = QModelIndex())const;
+  virtual QModelIndex index(int row, int column, const QModelIndex& parent = QModelIndex())const;
+  virtual QModelIndex parent(const QModelIndex& index)const;
 
-  void        AddChildrenFromCache(bool remove_loading);
-  void        AddLoadingChild();
-  void        Init(CacheTreeRef   tree, const QString& name);
-  void        Init(CacheBlobRef   blob, const QString& name);
-  void        Init(CacheCommitRef commit, const QString& name);
+public Q_SLOTS:
+  //Requests refer to their directory by serial number, so one which completes after its
+  //directory has been dropped is ignored
+  void TreeLoaded(int serial);
+  void BlobsLoaded(int serial, int first, int last);
+  //Connected to the view's collapsed signal
+  void Collapsed(const QModelIndex& index);
 
 private:
-  QString                    name_;
-  QString                    id_;
-  QString                    data_;
-  CacheTreeRef               tree_;
-  CacheBlobRef               blob_;
-  CacheCommitRef             commit_;
-  bool                       requested_more_children_;
-  bool                       more_children_;
-};
-
-//-----------------------------------------------------------------------------
-
-class CacheModel : public TreeModel<CacheModelNode, CacheModel>
-{
-  Q_OBJECT
-public:
-  typedef TreeModel<CacheModelNode, CacheModel> Base;
-
-  CacheModel(CacheTreeRef tree);
+  enum
+  {
+    //Rows either side of the one asked for whose blobs are fetched with it
+    PrefetchMargin = 64,
+  };
 
-public Q_SLOTS:
-  void IndexLoaded(const QModelIndex& index);
+  struct Directory
+  {
+    Directory(CacheTreeRef tree, Directory* parent, int row, int serial)
+      : tree_(tree),parent_(parent),row_(row),serial_(serial),loaded_(false),requested_(false){}
+
+    CacheTreeRef                  tree_;
+    Directory*                    parent_;
+    int                           row_;
+    int                           serial_;
+    //A copy of the tree's children, so rows don't change under the view if the cache evicts them
+    Tree::Children                children_;
+    bool                          loaded_;
+    bool                          requested_;
+    //Rows with a blob fetch outstanding
+    std::vector<bool>             fetching_;
+    //Only the children which have been looked into have a directory
+    boost::ptr_map<int,Directory> directories_;
+  };
+  typedef boost::unordered_map<int,Directory*> Serials;
+
+  //The directory for the row at index, NULL if it's a blob. The directory is created the first
+  //time it's needed.
+  Directory*         DirectoryAt(const QModelIndex& index)const;
+  //As DirectoryAt but NULL rather than creating the directory
+  Directory*         FindDirectory(const QModelIndex& index)const;
+  Directory*         FindDirectory(int serial)const;
+  //Removes the directory and everything below it from serials_
+  void               Forget(Directory* directory);
+  const Tree::Entry* EntryAt(const QModelIndex& index)const;
+  QModelIndex        IndexOf(Directory* directory)const;
+  //Copies the tree's children out if the tree is loaded (or in the snapshot)
+  bool               CopyChildren(Directory* directory, Tree::Children* children)const;
+  //Gives the directory its rows
+  void               Fill(Directory* directory, Tree::Children& children)const;
+  //Fills the directory if its tree is loaded
+  bool               Load(Directory* directory)const;
+  void               FetchBlobs(Directory* directory, int row)const;
+
+  mutable Directory  root_;
+  //Every directory which currently exists
+  mutable Serials    serials_;
+  mutable int        next_serial_;
 };
 
 //-----------------------------------------------------------------------------
@@ -86,7 +127,10 @@ public:
   CacheView(const CacheId& id)
     : model_(Cache::lease()->LookupCacheTree(id))
   {
+    //Otherwise the view asks every row for its size which would fetch every blob
+    setUniformRowHeights(true);
     setModel(&model_);
+    connect(this,SIGNAL(collapsed(const QModelIndex&)),&model_,SLOT(Collapsed(const QModelIndex&)));
   }
 private:
   CacheModel model_;
@@ -100,4 +144,3 @@ QSMP_END
 
 
 #endif
-
@@ -0,0 +1,441 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include "stdafx.h"
+#include <qsmp_gui/CacheSnapshot.h>
+
+#include <algorithm>
+#include <cstring>
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  const char            SnapshotMagic[8] = {'Q','S','M','P','S','N','A','P'};
+  const boost::uint32_t SnapshotVersion  = 1;
+
+  template<class Record>
+  bool IdLess(const Record& record, const uint8_t* id)
+  {
+    return memcmp(record.id_, id, 20) < 0;
+  }
+
+  template<class Record>
+  bool RecordLess(const Record& l, const Record& r)
+  {
+    return memcmp(l.id_, r.id_, 20) < 0;
+  }
+
+  template<class Record>
+  const Record* FindRecord(const Record* begin, const Record* end, const uint8_t* id)
+  {
+    const Record* record = std::lower_bound(begin, end, id, &IdLess<Record>);
+    if (record == end || memcmp(record->id_, id, 20) != 0)
+      return NULL;
+    return record;
+  }
+
+  //Checks that count records of type T starting at offset lie within a file of size bytes
+  template<class T>
+  bool InFile(boost::uint64_t offset, boost::uint64_t count, boost::uint64_t size)
+  {
+    return offset <= size && count <= (size - offset) / sizeof(T);
+  }
+
+  CacheId ToCacheId(const uint8_t* id)
+  {
+    CacheId ret;
+    ret.FromBinString(boost::make_iterator_range(id, id + 20));
+    return ret;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+CacheSnapshot::CacheSnapshot(LogContext log)
+: log_(log),
+  header_(NULL),
+  trees_(NULL),
+  blobs_(NULL),
+  entries_(NULL),
+  strings_(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheSnapshot::Open(const fs::path& path)
+{
+  Close();
+  if (!fs::exists(path))
+  {
+    FLOG(log_, "No snapshot at %1%") % path;
+    return false;
+  }
+
+  try
+  {
+    file_.open(path.string());
+  }
+  catch(std::exception& e)
+  {
+    FWARNING(log_, "Failed to map snapshot %1%: %2%") % path % e.what();
+    return false;
+  }
+
+  const char*     data = file_.data();
+  boost::uint64_t size = file_.size();
+  const snapshot::Header* header = reinterpret_cast<const snapshot::Header*>(data);
+  if (size < sizeof(snapshot::Header)
+   || memcmp(header->magic_, SnapshotMagic, sizeof(SnapshotMagic)) != 0
+   || header->version_ != SnapshotVersion
+   || header->file_size_ != size
+   || !InFile<snapshot::TreeRecord>(header->trees_, header->tree_count_, size)
+   || !InFile<snapshot::BlobRecord>(header->blobs_, header->blob_count_, size)
+   || !InFile<snapshot::EntryRecord>(header->entries_, header->entry_count_, size)
+   || !InFile<char>(header->strings_, header->strings_size_, size))
+  {
+    FWARNING(log_, "Ignoring invalid snapshot %1%") % path;
+    file_.close();
+    return false;
+  }
+
+  tree_used_.reset(new boost::atomic<bool>[header->tree_count_]);
+  blob_used_.reset(new boost::atomic<bool>[header->blob_count_]);
+  for (boost::uint32_t i = 0; i < header->tree_count_; i++)
+    tree_used_[i].store(false);
+  for (boost::uint32_t i = 0; i < header->blob_count_; i++)
+    blob_used_[i].store(false);
+
+  header_  = header;
+  trees_   = reinterpret_cast<const snapshot::TreeRecord*>(data + header->trees_);
+  blobs_   = reinterpret_cast<const snapshot::BlobRecord*>(data + header->blobs_);
+  entries_ = reinterpret_cast<const snapshot::EntryRecord*>(data + header->entries_);
+  strings_ = data + header->strings_;
+  FLOG(log_, "Opened snapshot %1%: %2% trees, %3% blobs") % path % header->tree_count_ % header->blob_count_;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheSnapshot::Close()
+{
+  header_  = NULL;
+  trees_   = NULL;
+  blobs_   = NULL;
+  entries_ = NULL;
+  strings_ = NULL;
+  tree_used_.reset();
+  blob_used_.reset();
+  if (file_.is_open())
+    file_.close();
+}
+
+//-----------------------------------------------------------------------------
+
+const snapshot::TreeRecord* CacheSnapshot::FindTree(const uint8_t* id)const
+{
+  if (!header_)
+    return NULL;
+  return FindRecord(trees_, trees_ + header_->tree_count_, id);
+}
+
+//-----------------------------------------------------------------------------
+
+const snapshot::BlobRecord* CacheSnapshot::FindBlob(const uint8_t* id)const
+{
+  if (!header_)
+    return NULL;
+  return FindRecord(blobs_, blobs_ + header_->blob_count_, id);
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheSnapshot::ReadTree(const CacheId& id, Entries& entries)const
+{
+  const snapshot::TreeRecord* tree = FindTree(id.data().data());
+  if (!tree)
+    return false;
+  if (!ReadEntries(*tree, entries))
+  {
+    FWARNING(log_, "Damaged tree record: Id %1%") % id;
+    return false;
+  }
+  tree_used_[tree - trees_].store(true, boost::memory_order_relaxed);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheSnapshot::ReadEntries(const snapshot::TreeRecord& tree, Entries& entries)const
+{
+  if (tree.first_entry_ > header_->entry_count_
+   || tree.entry_count_ > header_->entry_count_ - tree.first_entry_)
+    return false;
+
+  entries.clear();
+  entries.resize(tree.entry_count_);
+  const snapshot::EntryRecord* record = entries_ + tree.first_entry_;
+  for (Entries::iterator ii = entries.begin(); ii != entries.end(); ++ii, ++record)
+  {
+    if (record->name_offset_ > header_->strings_size_
+     || record->name_length_ > header_->strings_size_ - record->name_offset_)
+      return false;
+    ii->id_   = ToCacheId(record->id_);
+    ii->name_.assign(strings_ + record->name_offset_, record->name_length_);
+    ii->tree_ = record->is_tree_ != 0;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheSnapshot::ReadBlob(const CacheId& id, QByteArray& blob)const
+{
+  const snapshot::BlobRecord* record = FindBlob(id.data().data());
+  if (!record)
+    return false;
+  if (record->offset_ > header_->file_size_
+   || record->length_ > header_->file_size_ - record->offset_)
+  {
+    FWARNING(log_, "Damaged blob record: Id %1%") % id;
+    return false;
+  }
+  blob = QByteArray(file_.data() + record->offset_, int(record->length_));
+  blob_used_[record - blobs_].store(true, boost::memory_order_relaxed);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+CacheSnapshotWriter::CacheSnapshotWriter(LogContext log, const fs::path& path)
+: log_(log),
+  path_(path),
+  temp_path_(path.string() + ".new"),
+  file_(temp_path_.string().c_str(), std::ios::binary | std::ios::trunc),
+  offset_(sizeof(snapshot::Header))
+{
+  //The header is filled in by Commit once the tables have been written
+  snapshot::Header header;
+  memset(&header, 0, sizeof(header));
+  file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheSnapshotWriter::Added(const uint8_t* id)
+{
+  return !added_.insert(std::string(reinterpret_cast<const char*>(id), 20)).second;
+}
+
+//-----------------------------------------------------------------------------
+
+boost::uint32_t CacheSnapshotWriter::AddString(const char* string, size_t length)
+{
+  //Names like "Artist" repeat in nearly every tree so they are only stored once
+  std::string key(string, length);
+  boost::unordered_map<std::string,boost::uint32_t>::iterator ii = string_offsets_.find(key);
+  if (ii != string_offsets_.end())
+    return ii->second;
+  boost::uint32_t offset = boost::uint32_t(strings_.size());
+  strings_.insert(strings_.end(), string, string + length);
+  string_offsets_.insert(std::make_pair(key, offset));
+  return offset;
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheSnapshotWriter::AddTree(const CacheId& id, const CacheSnapshot::Entries& entries)
+{
+  if (Added(id.data().data()))
+    return;
+  snapshot::TreeRecord tree;
+  std::copy(id.data().begin(), id.data().end(), tree.id_);
+  tree.first_entry_ = boost::uint32_t(entries_.size());
+  tree.entry_count_ = boost::uint32_t(entries.size());
+  tree.padding_     = 0;
+  for (CacheSnapshot::Entries::const_iterator ii = entries.begin(); ii != entries.end(); ++ii)
+  {
+    snapshot::EntryRecord entry;
+    std::copy(ii->id_.data().begin(), ii->id_.data().end(), entry.id_);
+    entry.name_offset_ = AddString(ii->name_.data(), ii->name_.size());
+    entry.name_length_ = boost::uint32_t(ii->name_.size());
+    entry.is_tree_     = ii->tree_ ? 1 : 0;
+    entries_.push_back(entry);
+  }
+  trees_.push_back(tree);
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheSnapshotWriter::AddBlob(const CacheId& id, const QByteArray& blob)
+{
+  if (Added(id.data().data()))
+    return;
+  AddBlob(id.data().data(), blob.constData(), blob.size());
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheSnapshotWriter::AddBlob(const uint8_t* id, const char* data, size_t length)
+{
+  snapshot::BlobRecord blob;
+  std::copy(id, id + 20, blob.id_);
+  blob.length_ = boost::uint32_t(length);
+  blob.offset_ = offset_;
+  file_.write(data, length);
+  offset_ += length;
+  blobs_.push_back(blob);
+}
+
+//-----------------------------------------------------------------------------
+
+boost::uint64_t CacheSnapshotWriter::size()const
+{
+  return offset_
+       + strings_.size()
+       + entries_.size() * sizeof(snapshot::EntryRecord)
+       + trees_.size() * sizeof(snapshot::TreeRecord)
+       + blobs_.size() * sizeof(snapshot::BlobRecord);
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheSnapshotWriter::Merge(const CacheSnapshot& old, boost::uint64_t budget)
+{
+  if (!old.is_open())
+    return;
+  LOG(log_) << "Merging previous snapshot";
+
+  MergeRecords(old, true, budget);
+  MergeRecords(old, false, budget);
+}
+
+//-----------------------------------------------------------------------------
+
+void CacheSnapshotWriter::MergeRecords(const CacheSnapshot& old, bool used, boost::uint64_t budget)
+{
+  size_t dropped = 0;
+  CacheSnapshot::Entries entries;
+  for (boost::uint32_t i = 0; i < old.header_->tree_count_; i++)
+  {
+    const snapshot::TreeRecord* tree = old.trees_ + i;
+    if (old.tree_used_[i].load(boost::memory_order_relaxed) != used
+     || added_.count(std::string(reinterpret_cast<const char*>(tree->id_), 20)))
+      continue;
+    if (size() >= budget)
+    {
+      dropped++;
+      continue;
+    }
+    if (old.ReadEntries(*tree, entries))
+      AddTree(ToCacheId(tree->id_), entries);
+  }
+
+  for (boost::uint32_t i = 0; i < old.header_->blob_count_; i++)
+  {
+    const snapshot::BlobRecord* blob = old.blobs_ + i;
+    if (old.blob_used_[i].load(boost::memory_order_relaxed) != used
+     || blob->offset_ > old.header_->file_size_
+     || blob->length_ > old.header_->file_size_ - blob->offset_
+     || added_.count(std::string(reinterpret_cast<const char*>(blob->id_), 20)))
+      continue;
+    if (size() + blob->length_ > budget)
+    {
+      dropped++;
+      continue;
+    }
+    Added(blob->id_);
+    AddBlob(blob->id_, old.file_.data() + blob->offset_, blob->length_);
+  }
+
+  if (dropped > 0)
+    FLOG(log_, "Dropped %1% %2% objects to stay under %3% bytes") % dropped % (used ? "used" : "unused") % budget;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CacheSnapshotWriter::Commit()
+{
+  std::sort(trees_.begin(), trees_.end(), &RecordLess<snapshot::TreeRecord>);
+  std::sort(blobs_.begin(), blobs_.end(), &RecordLess<snapshot::BlobRecord>);
+
+  snapshot::Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic_, SnapshotMagic, sizeof(SnapshotMagic));
+  header.version_      = SnapshotVersion;
+  header.tree_count_   = boost::uint32_t(trees_.size());
+  header.blob_count_   = boost::uint32_t(blobs_.size());
+  header.entry_count_  = boost::uint32_t(entries_.size());
+
+  //Pad so that the records which follow are 8 byte aligned in the mapping
+  header.strings_      = offset_;
+  header.strings_size_ = strings_.size();
+  strings_.resize((offset_ + strings_.size() + 7) / 8 * 8 - offset_);
+  if (!strings_.empty())
+    file_.write(&strings_[0], strings_.size());
+  offset_ += strings_.size();
+
+  header.entries_      = offset_;
+  if (!entries_.empty())
+    file_.write(reinterpret_cast<const char*>(&entries_[0]), entries_.size() * sizeof(snapshot::EntryRecord));
+  offset_ += entries_.size() * sizeof(snapshot::EntryRecord);
+
+  header.trees_        = offset_;
+  if (!trees_.empty())
+    file_.write(reinterpret_cast<const char*>(&trees_[0]), trees_.size() * sizeof(snapshot::TreeRecord));
+  offset_ += trees_.size() * sizeof(snapshot::TreeRecord);
+
+  header.blobs_        = offset_;
+  if (!blobs_.empty())
+    file_.write(reinterpret_cast<const char*>(&blobs_[0]), blobs_.size() * sizeof(snapshot::BlobRecord));
+  offset_ += blobs_.size() * sizeof(snapshot::BlobRecord);
+
+  header.file_size_    = offset_;
+  file_.seekp(0);
+  file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file_.close();
+
+  if (file_.fail())
+  {
+    FWARNING(log_, "Failed to write snapshot %1%") % temp_path_;
+    fs::remove(temp_path_);
+    return false;
+  }
+
+  //rename won't replace an existing file on all platforms
+  if (fs::exists(path_))
+    fs::remove(path_);
+  fs::rename(temp_path_, path_);
+  FLOG(log_, "Wrote snapshot %1%: %2% trees, %3% blobs, %4% bytes")
+    % path_ % trees_.size() % blobs_.size() % offset_;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
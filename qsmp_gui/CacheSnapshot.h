@@ -0,0 +1,194 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_CACHESNAPSHOT_H_
+#define QSMP_CACHESNAPSHOT_H_
+
+#include <qsmp_gui/common.h>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <fstream>
+#include <qsmp_gui/CacheId.h>
+#include <qsmp_lib/Log.h>
+#include <QtCore/qbytearray.h>
+#include <QtCore/qstring.h>
+#include <string>
+#include <vector>
+
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace snapshot
+{
+  //The on disk layout, all integers are in native byte order. The file is:
+  //  Header, blob data, string table, tree entries, tree index, blob index
+  //Both indices are sorted by id so they can be binary searched straight out of the mapping.
+  struct Header
+  {
+    char             magic_[8];
+    boost::uint32_t  version_;
+    boost::uint32_t  tree_count_;
+    boost::uint32_t  blob_count_;
+    boost::uint32_t  entry_count_;
+    boost::uint64_t  trees_;
+    boost::uint64_t  blobs_;
+    boost::uint64_t  entries_;
+    boost::uint64_t  strings_;
+    boost::uint64_t  strings_size_;
+    boost::uint64_t  file_size_;
+  };
+
+  struct TreeRecord
+  {
+    uint8_t          id_[20];
+    boost::uint32_t  first_entry_;
+    boost::uint32_t  entry_count_;
+    boost::uint32_t  padding_;
+  };
+
+  struct EntryRecord
+  {
+    uint8_t          id_[20];
+    boost::uint32_t  name_offset_;
+    boost::uint32_t  name_length_;
+    boost::uint32_t  is_tree_;
+  };
+
+  struct BlobRecord
+  {
+    uint8_t          id_[20];
+    boost::uint32_t  length_;
+    boost::uint64_t  offset_;
+  };
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//A read only snapshot of parsed trees and blobs saved by a previous run. The file is mmap'd and
+//records are only decoded as they are asked for. Since the records are keyed by object id they
+//never go stale; a damaged record is logged and treated as missing so the object is fetched
+//from git instead.
+//
+//Reads are thread safe once Open has returned. Each record read is remembered so that the next
+//snapshot can keep what was used this run in preference to what wasn't.
+class CacheSnapshot
+{
+  QSMP_NON_COPYABLE(CacheSnapshot);
+public:
+  struct Entry
+  {
+    Entry():tree_(false){}
+    CacheId      id_;
+    std::string  name_;   //UTF-8
+    bool         tree_;
+  };
+  typedef std::vector<Entry> Entries;
+
+  CacheSnapshot(LogContext log);
+
+  //Returns false if the file is missing or isn't a valid snapshot, the snapshot is then empty
+  bool Open(const fs::path& path);
+  void Close();
+  bool is_open()const{return header_ != NULL;}
+
+  bool ReadTree(const CacheId& id, Entries& entries)const;
+  bool ReadBlob(const CacheId& id, QByteArray& blob)const;
+
+private:
+  friend class CacheSnapshotWriter;
+
+  const snapshot::TreeRecord* FindTree(const uint8_t* id)const;
+  const snapshot::BlobRecord* FindBlob(const uint8_t* id)const;
+  bool ReadEntries(const snapshot::TreeRecord& tree, Entries& entries)const;
+
+  const LogContext              log_;
+  io::mapped_file_source        file_;
+  const snapshot::Header*       header_;
+  const snapshot::TreeRecord*   trees_;
+  const snapshot::BlobRecord*   blobs_;
+  const snapshot::EntryRecord*  entries_;
+  const char*                   strings_;
+  //Whether each tree and blob record has been read since Open
+  boost::scoped_array<boost::atomic<bool> > tree_used_;
+  boost::scoped_array<boost::atomic<bool> > blob_used_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//Writes a new snapshot next to path and then moves it into place on Commit. Blob data is
+//streamed straight to the file, everything else is held until Commit.
+class CacheSnapshotWriter
+{
+  QSMP_NON_COPYABLE(CacheSnapshotWriter);
+public:
+  CacheSnapshotWriter(LogContext log, const fs::path& path);
+
+  //Objects which have already been added are ignored
+  void AddTree(const CacheId& id, const CacheSnapshot::Entries& entries);
+  void AddBlob(const CacheId& id, const QByteArray& blob);
+
+  //Copies across the objects in old which haven't been added while the snapshot is under budget
+  //bytes. Objects read from old this run are copied first, the ones which weren't are the first
+  //to be dropped.
+  void Merge(const CacheSnapshot& old, boost::uint64_t budget);
+
+  //Finishes the file and replaces the snapshot at path with it
+  bool Commit();
+
+private:
+  boost::uint32_t AddString(const char* string, size_t length);
+  void AddBlob(const uint8_t* id, const char* data, size_t length);
+  bool Added(const uint8_t* id);
+  //The size the file would be if it were committed now
+  boost::uint64_t size()const;
+  //Copies the records of old whose used flag matches used
+  void MergeRecords(const CacheSnapshot& old, bool used, boost::uint64_t budget);
+
+  const LogContext                                      log_;
+  fs::path                                              path_;
+  fs::path                                              temp_path_;
+  std::ofstream                                         file_;
+  boost::uint64_t                                       offset_;
+  std::vector<char>                                     strings_;
+  boost::unordered_map<std::string,boost::uint32_t>     string_offsets_;
+  std::vector<snapshot::TreeRecord>                     trees_;
+  std::vector<snapshot::BlobRecord>                     blobs_;
+  std::vector<snapshot::EntryRecord>                    entries_;
+  boost::unordered_set<std::string>                     added_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
+
+#endif
@@ -0,0 +1,210 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_CATFILESCANNER_H_
+#define QSMP_CATFILESCANNER_H_
+
+#include <qsmp_gui/common.h>
+
+#include <cstring>
+#include <stddef.h>
+
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//Scanners for the git cat-file output and the tree/commit object formats. These work in place on
+//the read buffer, so the results point into the buffer and are only valid until it's next modified.
+//
+//Each scanner returns a pointer to just after what it consumed, or NULL if there isn't enough data
+//in [start,end) yet. If the data is malformed then invalid is set and the return value is the
+//point to resume scanning from.
+
+namespace cache
+{
+
+  //---------------------------------------------------------------------------
+
+  struct TreeEntryScan
+  {
+    unsigned int mode_;
+    const char*  name_;
+    size_t       name_length_;
+    const char*  id_;  //20 byte binary id
+  };
+
+  //"<octal mode> <name>\0<20 byte id>"
+  inline const char* ScanTreeEntry(const char* start, const char* end, TreeEntryScan& entry, bool& invalid)
+  {
+    invalid = false;
+    const char* space = static_cast<const char*>(memchr(start, ' ', end - start));
+    if (!space)
+      return NULL;
+
+    const char* name = space + 1;
+    const char* nul  = static_cast<const char*>(memchr(name, '\0', end - name));
+    if (!nul || end - (nul + 1) < 20)
+      return NULL;
+
+    //A bad mode still skips the whole entry so the next one is read from the right place
+    unsigned int mode = 0;
+    for (const char* ii = start; ii < space; ++ii)
+    {
+      unsigned int digit = static_cast<unsigned char>(*ii) - '0';
+      if (digit > 7)
+      {
+        invalid = true;
+        return nul + 1 + 20;
+      }
+      mode = (mode << 3) | digit;
+    }
+
+    entry.mode_        = mode;
+    entry.name_        = name;
+    entry.name_length_ = nul - name;
+    entry.id_          = nul + 1;
+    return nul + 1 + 20;
+  }
+
+  //---------------------------------------------------------------------------
+
+  inline bool IsHexString(const char* start, size_t length)
+  {
+    for (const char* ii = start; ii < start + length; ++ii)
+    {
+      char ch = *ii;
+      if (!(('0' <= ch && ch <= '9') || ('a' <= ch && ch <= 'f') || ('A' <= ch && ch <= 'F')))
+        return false;
+    }
+    return true;
+  }
+
+  //---------------------------------------------------------------------------
+
+  struct CatFileHeaderScan
+  {
+    const char* id_;  //40 character hex id
+    const char* type_;
+    size_t      type_length_;
+    size_t      length_;
+    bool        missing_;
+  };
+
+  //"<40 hex id> <type> <length>\n" or "<40 hex id> missing\n", optionally preceded by the newline
+  //that terminates the previous object
+  inline const char* ScanCatFileHeader(const char* start, const char* end, CatFileHeaderScan& header, bool& invalid)
+  {
+    invalid = false;
+    if (start < end && *start == '\n')
+      ++start;
+
+    const char* newline = static_cast<const char*>(memchr(start, '\n', end - start));
+    if (!newline)
+      return NULL;
+
+    const char* type = start + 41;
+    if (newline - start < 41 + 1 || start[40] != ' ' || !IsHexString(start, 40))
+    {
+      invalid = true;
+      return newline + 1;
+    }
+
+    header.id_      = start;
+    header.missing_ = false;
+    header.length_  = 0;
+
+    const char* space = static_cast<const char*>(memchr(type, ' ', newline - type));
+    if (!space)
+    {
+      header.missing_     = true;
+      header.type_        = type;
+      header.type_length_ = newline - type;
+      invalid = !(header.type_length_ == 7 && !memcmp(type, "missing", 7));
+      return newline + 1;
+    }
+
+    header.type_        = type;
+    header.type_length_ = space - type;
+    for (const char* ii = space + 1; ii < newline; ++ii)
+    {
+      unsigned int digit = static_cast<unsigned char>(*ii) - '0';
+      if (digit > 9)
+      {
+        invalid = true;
+        return newline + 1;
+      }
+      header.length_ = header.length_ * 10 + digit;
+    }
+    return newline + 1;
+  }
+
+  //---------------------------------------------------------------------------
+
+  struct CommitHeaderScan
+  {
+    const char* key_;
+    size_t      key_length_;
+    const char* value_;
+    size_t      value_length_;
+    //The line starts with a space and carries on the value of the previous header, as in gpgsig
+    //and mergetag. The key is empty and the value is the line without the leading space.
+    bool        continuation_;
+  };
+
+  //A single "<key> <value>\n" header line. The blank line ending the headers is returned with an
+  //empty key and continuation_ unset.
+  inline const char* ScanCommitHeader(const char* start, const char* end, CommitHeaderScan& header)
+  {
+    const char* newline = static_cast<const char*>(memchr(start, '\n', end - start));
+    if (!newline)
+      return NULL;
+
+    header.continuation_ = (start < newline && *start == ' ');
+    const char* space = static_cast<const char*>(memchr(start, ' ', newline - start));
+    if (!space)
+      space = newline;
+
+    header.key_          = start;
+    header.key_length_   = space - start;
+    header.value_        = (space < newline) ? space + 1 : newline;
+    header.value_length_ = newline - header.value_;
+    return newline + 1;
+  }
+
+  //---------------------------------------------------------------------------
+
+  inline bool KeyEquals(const CommitHeaderScan& header, const char* key)
+  {
+    size_t length = strlen(key);
+    return header.key_length_ == length && !memcmp(header.key_, key, length);
+  }
+
+  //---------------------------------------------------------------------------
+
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
+
+#endif
+
@@ -0,0 +1,603 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include "stdafx.h"
+#include <qsmp_gui/GitObjectStore.h>
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <zlib.h>
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  inline boost::uint32_t ReadNetwork32(const uint8_t* p)
+  {
+    return (boost::uint32_t(p[0]) << 24)
+         | (boost::uint32_t(p[1]) << 16)
+         | (boost::uint32_t(p[2]) << 8)
+         |  boost::uint32_t(p[3]);
+  }
+
+  //---------------------------------------------------------------------------
+
+  inline uInt ClampInput(size_t size)
+  {
+    return uInt(std::min<size_t>(size, std::numeric_limits<uInt>::max()));
+  }
+
+  //---------------------------------------------------------------------------
+
+  //Inflates a zlib stream that is expected to produce exactly size bytes
+  bool Inflate(const uint8_t* begin, const uint8_t* end, char* output, size_t size)
+  {
+    //zlib refuses a NULL output buffer even when it isn't going to write to it
+    char dummy;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK)
+      return false;
+    stream.next_in   = const_cast<Bytef*>(begin);
+    stream.avail_in  = ClampInput(end - begin);
+    stream.next_out  = reinterpret_cast<Bytef*>(size ? output : &dummy);
+    stream.avail_out = uInt(size);
+    int ret = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    return ret == Z_STREAM_END && stream.avail_out == 0;
+  }
+
+  //---------------------------------------------------------------------------
+
+  //Size varints used in delta headers
+  bool ReadDeltaSize(const uint8_t*& p, const uint8_t* end, size_t& size)
+  {
+    size = 0;
+    int shift = 0;
+    uint8_t c;
+    do
+    {
+      if (p >= end)
+        return false;
+      c = *p++;
+      size |= size_t(c & 0x7F) << shift;
+      shift += 7;
+    } while (c & 0x80);
+    return true;
+  }
+
+  //---------------------------------------------------------------------------
+
+  GitObjectType FromLooseType(const char* begin, const char* end)
+  {
+    size_t length = end - begin;
+    if (length == 6 && !memcmp(begin, "commit", 6))
+      return GitObjectType_Commit;
+    else if (length == 4 && !memcmp(begin, "tree", 4))
+      return GitObjectType_Tree;
+    else if (length == 4 && !memcmp(begin, "blob", 4))
+      return GitObjectType_Blob;
+    else if (length == 3 && !memcmp(begin, "tag", 3))
+      return GitObjectType_Tag;
+    else
+      return GitObjectType_None;
+  }
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+bool GitPack::Open(const fs::path& idx_path)
+{
+  path_ = idx_path;
+  std::string pack_path = idx_path.string();
+  pack_path.replace(pack_path.size() - 4, 4, ".pack");
+
+  try
+  {
+    idx_.open(idx_path.string());
+    pack_.open(pack_path);
+  }
+  catch(std::exception& e)
+  {
+    FWARNING(log_, "Failed to map pack %1%: %2%") % idx_path.string() % e.what();
+    return false;
+  }
+
+  const uint8_t* idx = reinterpret_cast<const uint8_t*>(idx_.data());
+  size_t idx_size = idx_.size();
+  if (idx_size < 8 + 256 * 4 || pack_.size() < 12 + 20 || memcmp(pack_.data(), "PACK", 4))
+  {
+    FWARNING(log_, "Invalid pack %1%") % idx_path.string();
+    return false;
+  }
+
+  if (!memcmp(idx, "\377tOc", 4))
+  {
+    version_ = ReadNetwork32(idx + 4);
+    fanout_  = idx + 8;
+  }
+  else
+  {
+    version_ = 1;
+    fanout_  = idx;
+  }
+  count_ = ReadNetwork32(fanout_ + 255 * 4);
+  ids_   = fanout_ + 256 * 4;
+
+  //v2: ids, crcs, 32 bit offsets then 64 bit offsets
+  //v1: a 32 bit offset followed by the id for each entry
+  size_t table_size = (version_ == 2) ? count_ * (20 + 4 + 4) : count_ * (4 + 20);
+  if (version_ > 2 || size_t(ids_ - idx) + table_size > idx_size)
+  {
+    FWARNING(log_, "Unsupported pack index %1%: version %2%") % idx_path.string() % version_;
+    return false;
+  }
+
+  FLOG(log_, "Opened pack %1%: version %2%, %3% objects") % idx_path.string() % version_ % count_;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitPack::Find(const CacheId& id, boost::uint64_t& offset)const
+{
+  const uint8_t* sha1   = id.data().data();
+  size_t         stride = (version_ == 2) ? 20 : 24;
+  const uint8_t* ids    = (version_ == 2) ? ids_ : ids_ + 4;
+
+  boost::uint32_t begin = sha1[0] ? ReadNetwork32(fanout_ + (sha1[0] - 1) * 4) : 0;
+  boost::uint32_t end   = ReadNetwork32(fanout_ + sha1[0] * 4);
+  while (begin < end)
+  {
+    boost::uint32_t mid = begin + (end - begin) / 2;
+    int cmp = memcmp(sha1, ids + mid * stride, 20);
+    if (cmp < 0)
+    {
+      end = mid;
+    }
+    else if (cmp > 0)
+    {
+      begin = mid + 1;
+    }
+    else if (version_ == 2)
+    {
+      const uint8_t* offsets = ids_ + count_ * (20 + 4);
+      boost::uint32_t small_offset = ReadNetwork32(offsets + mid * 4);
+      if (small_offset & 0x80000000)
+      {
+        const uint8_t* large = offsets + count_ * 4 + (small_offset & 0x7FFFFFFF) * 8;
+        if (large + 8 > reinterpret_cast<const uint8_t*>(idx_.data()) + idx_.size())
+          return false;
+        offset = (boost::uint64_t(ReadNetwork32(large)) << 32) | ReadNetwork32(large + 4);
+      }
+      else
+      {
+        offset = small_offset;
+      }
+      return offset < boost::uint64_t(pack_end() - pack_begin());
+    }
+    else
+    {
+      offset = ReadNetwork32(ids_ + mid * stride);
+      return offset < boost::uint64_t(pack_end() - pack_begin());
+    }
+  }
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+GitObjectStore::GitObjectStore(LogContext log)
+: log_(log),
+  packs_time_(0),
+  delta_base_bytes_(0),
+  delta_base_evict_(0)
+{
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitObjectStore::Open(const fs::path& repository)
+{
+  if (fs::is_directory(repository / ".git" / "objects"))
+    objects_ = repository / ".git" / "objects";
+  else if (fs::is_directory(repository / "objects"))
+    objects_ = repository / "objects";
+  else
+  {
+    FWARNING(log_, "No object database found in %1%") % repository.string();
+    return false;
+  }
+
+  FLOG(log_, "Opened object database %1%") % objects_.string();
+  ScanPacks();
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void GitObjectStore::ScanPacks()
+{
+  fs::path pack_dir = objects_ / "pack";
+  if (!fs::is_directory(pack_dir))
+    return;
+
+  packs_time_ = fs::last_write_time(pack_dir);
+  for (fs::directory_iterator ii(pack_dir), end; ii != end; ++ii)
+  {
+    if (ii->path().extension() != ".idx")
+      continue;
+
+    bool have_pack = false;
+    for (boost::ptr_vector<GitPack>::const_iterator jj = packs_.begin(); jj != packs_.end(); ++jj)
+      have_pack = have_pack || jj->path() == ii->path();
+
+    if (have_pack)
+      continue;
+
+    std::auto_ptr<GitPack> pack(new GitPack(log_ / "Pack"));
+    if (pack->Open(ii->path()))
+      packs_.push_back(pack.release());
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitObjectStore::Read(const CacheId& id, GitObject& object)
+{
+  return Read(id, object, 0);
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitObjectStore::Read(const CacheId& id, GitObject& object, size_t depth)
+{
+  boost::uint64_t offset;
+  for (boost::ptr_vector<GitPack>::const_iterator ii = packs_.begin(); ii != packs_.end(); ++ii)
+  {
+    if (ii->Find(id, offset))
+      return ReadPacked(*ii, offset, object, depth);
+  }
+
+  if (ReadLoose(id, object))
+    return true;
+
+  //The object may have been written by a git gc or a new import since we last looked
+  fs::path pack_dir = objects_ / "pack";
+  if (fs::is_directory(pack_dir) && fs::last_write_time(pack_dir) != packs_time_)
+  {
+    size_t old_packs = packs_.size();
+    ScanPacks();
+    for (boost::ptr_vector<GitPack>::const_iterator ii = packs_.begin() + old_packs; ii != packs_.end(); ++ii)
+    {
+      if (ii->Find(id, offset))
+        return ReadPacked(*ii, offset, object, depth);
+    }
+  }
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitObjectStore::ReadLoose(const CacheId& id, GitObject& object)
+{
+  char hex[CacheId::HexSize + 1];
+  id.ToHex(hex);
+  hex[CacheId::HexSize] = '\0';
+
+  fs::path path = objects_ / std::string(hex, 2) / std::string(hex + 2);
+  std::ifstream file(path.string().c_str(), std::ios::in | std::ios::binary);
+  if (!file)
+    return false;
+
+  std::vector<char> compressed((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (compressed.empty())
+    return false;
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit(&stream) != Z_OK)
+    return false;
+
+  //Inflate enough to read the "<type> <size>\0" header then inflate the rest straight into place
+  char header[64];
+  stream.next_in   = reinterpret_cast<Bytef*>(&compressed[0]);
+  stream.avail_in  = ClampInput(compressed.size());
+  stream.next_out  = reinterpret_cast<Bytef*>(header);
+  stream.avail_out = sizeof(header);
+  int ret = inflate(&stream, Z_SYNC_FLUSH);
+
+  char* header_end = header + sizeof(header) - stream.avail_out;
+  char* space      = std::find(header, header_end, ' ');
+  char* nul        = std::find(space, header_end, '\0');
+  if ((ret != Z_OK && ret != Z_STREAM_END) || nul == header_end)
+  {
+    FWARNING(log_, "Corrupt loose object %1%") % hex;
+    inflateEnd(&stream);
+    return false;
+  }
+
+  object.type_ = FromLooseType(header, space);
+  size_t size  = strtoul(space + 1, NULL, 10);
+  object.data_.resize(size);
+
+  size_t already = std::min(size_t(header_end - nul - 1), size);
+  std::copy(nul + 1, nul + 1 + already, object.data_.begin());
+  if (ret != Z_STREAM_END && already < size)
+  {
+    stream.next_out  = reinterpret_cast<Bytef*>(&object.data_[already]);
+    stream.avail_out = uInt(size - already);
+    ret = inflate(&stream, Z_FINISH);
+  }
+  inflateEnd(&stream);
+
+  //A stream which ends early would otherwise leave the tail of the object zero filled
+  size_t header_size = nul + 1 - header;
+  if (ret != Z_STREAM_END || stream.total_out != header_size + size || object.type_ == GitObjectType_None)
+  {
+    FWARNING(log_, "Corrupt loose object %1%") % hex;
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitObjectStore::ReadPacked(const GitPack& pack, boost::uint64_t offset, GitObject& object, size_t depth)
+{
+  const uint8_t* p   = pack.pack_begin() + offset;
+  const uint8_t* end = pack.pack_end();
+
+  //Object header: 3 bits of type and a variable length size
+  uint8_t c = *p++;
+  GitObjectType   type  = GitObjectType((c >> 4) & 0x07);
+  boost::uint64_t size  = c & 0x0F;
+  int             shift = 4;
+  while (c & 0x80)
+  {
+    if (p >= end)
+      return false;
+    c = *p++;
+    size |= boost::uint64_t(c & 0x7F) << shift;
+    shift += 7;
+  }
+
+  switch (type)
+  {
+  case GitObjectType_Commit:
+  case GitObjectType_Tree:
+  case GitObjectType_Blob:
+  case GitObjectType_Tag:
+    object.type_ = type;
+    object.data_.resize(size_t(size));
+    return Inflate(p, end, object.data_.empty() ? NULL : &object.data_[0], object.data_.size());
+
+  case GitObjectType_OfsDelta:
+  case GitObjectType_RefDelta:
+    break;
+
+  default:
+    FWARNING(log_, "Unknown object type %1% at offset %2% in %3%") % type % offset % pack.path().string();
+    return false;
+  }
+
+  if (depth >= MaxDeltaDepth)
+  {
+    FWARNING(log_, "Delta chain too long at offset %1% in %2%") % offset % pack.path().string();
+    return false;
+  }
+
+  //Find the base object, preferring the delta base cache as delta chains tend to share bases
+  boost::uint64_t base_offset = 0;
+  bool            in_pack     = true;
+  GitObject       base;
+  if (type == GitObjectType_OfsDelta)
+  {
+    if (p >= end)
+      return false;
+    c = *p++;
+    boost::uint64_t distance = c & 0x7F;
+    while (c & 0x80)
+    {
+      if (p >= end)
+        return false;
+      c = *p++;
+      distance = ((distance + 1) << 7) | (c & 0x7F);
+    }
+    //The base has to come before this object and can't be the pack header
+    if (distance == 0 || offset < PackHeaderSize + distance)
+    {
+      FWARNING(log_, "Bad delta base distance %1% at offset %2% in %3%") % distance % offset % pack.path().string();
+      return false;
+    }
+    base_offset = offset - distance;
+  }
+  else
+  {
+    if (end - p < 20)
+      return false;
+    CacheId base_id;
+    base_id.FromBinString(boost::make_iterator_range(p, p + 20));
+    p += 20;
+    in_pack = pack.Find(base_id, base_offset);
+    if (!in_pack && !Read(base_id, base, depth + 1))
+    {
+      FWARNING(log_, "Missing delta base %1%") % base_id;
+      return false;
+    }
+  }
+
+  std::vector<char> delta(size_t(size), 0);
+  if (!Inflate(p, end, delta.empty() ? NULL : &delta[0], delta.size()))
+    return false;
+
+  const std::vector<char>* base_data = &base.data_;
+  GitObjectType            base_type = base.type_;
+  if (in_pack)
+  {
+    const DeltaBase* cached = FindDeltaBase(pack, base_offset);
+    if (!cached)
+    {
+      if (!ReadPacked(pack, base_offset, base, depth + 1))
+        return false;
+      cached = AddDeltaBase(pack, base_offset, base);
+    }
+    if (cached)
+    {
+      base_data = &cached->data_;
+      base_type = cached->type_;
+    }
+    else
+    {
+      base_type = base.type_;
+    }
+  }
+
+  object.type_ = base_type;
+  if (!ApplyDelta(*base_data, delta, object.data_))
+  {
+    FWARNING(log_, "Corrupt delta at offset %1% in %2%") % offset % pack.path().string();
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitObjectStore::ApplyDelta(const std::vector<char>& base, const std::vector<char>& delta, std::vector<char>& result)
+{
+  if (delta.empty())
+    return false;
+
+  const uint8_t* d   = reinterpret_cast<const uint8_t*>(&delta[0]);
+  const uint8_t* end = d + delta.size();
+
+  size_t base_size, result_size;
+  if (!ReadDeltaSize(d, end, base_size) || !ReadDeltaSize(d, end, result_size) || base_size != base.size())
+    return false;
+
+  result.resize(result_size);
+  char* out     = result.empty() ? NULL : &result[0];
+  char* out_end = out + result_size;
+  while (d < end)
+  {
+    uint8_t c = *d++;
+    if (c & 0x80)
+    {
+      //Copy from the base: the low 7 bits say which offset and size bytes follow
+      size_t needed = 0;
+      for (int bit = 0; bit < 7; ++bit)
+        needed += (c >> bit) & 1;
+      if (size_t(end - d) < needed)
+        return false;
+
+      size_t copy_offset = 0, copy_size = 0;
+      if (c & 0x01) copy_offset  = *d++;
+      if (c & 0x02) copy_offset |= size_t(*d++) << 8;
+      if (c & 0x04) copy_offset |= size_t(*d++) << 16;
+      if (c & 0x08) copy_offset |= size_t(*d++) << 24;
+      if (c & 0x10) copy_size    = *d++;
+      if (c & 0x20) copy_size   |= size_t(*d++) << 8;
+      if (c & 0x40) copy_size   |= size_t(*d++) << 16;
+      if (copy_size == 0)
+        copy_size = 0x10000;
+
+      if (copy_offset + copy_size > base.size() || copy_size > size_t(out_end - out))
+        return false;
+      memcpy(out, &base[copy_offset], copy_size);
+      out += copy_size;
+    }
+    else if (c)
+    {
+      //Insert the next c bytes of the delta
+      if (size_t(end - d) < c || size_t(c) > size_t(out_end - out))
+        return false;
+      memcpy(out, d, c);
+      out += c;
+      d   += c;
+    }
+    else
+    {
+      //Reserved
+      return false;
+    }
+  }
+  return out == out_end;
+}
+
+//-----------------------------------------------------------------------------
+
+const GitObjectStore::DeltaBase* GitObjectStore::FindDeltaBase(const GitPack& pack, boost::uint64_t offset)
+{
+  DeltaBase& entry = delta_bases_[size_t(offset ^ (size_t(&pack) >> 4)) % DeltaBaseCacheSize];
+  if (entry.pack_ == &pack && entry.offset_ == offset && entry.type_ != GitObjectType_None)
+    return &entry;
+  else
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+const GitObjectStore::DeltaBase* GitObjectStore::AddDeltaBase(const GitPack& pack, boost::uint64_t offset, GitObject& base)
+{
+  size_t size = base.data_.size();
+  if (size > DeltaBaseCacheMaxBytes / 4)
+    return NULL;
+
+  DeltaBase& entry = delta_bases_[size_t(offset ^ (size_t(&pack) >> 4)) % DeltaBaseCacheSize];
+  ReleaseDeltaBase(entry);
+
+  //Keep the cache under its byte budget by evicting round robin
+  while (delta_base_bytes_ + size > DeltaBaseCacheMaxBytes)
+  {
+    ReleaseDeltaBase(delta_bases_[delta_base_evict_++ % DeltaBaseCacheSize]);
+  }
+
+  entry.pack_   = &pack;
+  entry.offset_ = offset;
+  entry.type_   = base.type_;
+  entry.data_.swap(base.data_);
+  delta_base_bytes_ += size;
+  return &entry;
+}
+
+//-----------------------------------------------------------------------------
+
+void GitObjectStore::ReleaseDeltaBase(DeltaBase& entry)
+{
+  delta_base_bytes_ -= entry.data_.size();
+  std::vector<char>().swap(entry.data_);
+  entry.pack_ = NULL;
+  entry.type_ = GitObjectType_None;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
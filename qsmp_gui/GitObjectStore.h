@@ -0,0 +1,159 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_GITOBJECTSTORE_H_
+#define QSMP_GITOBJECTSTORE_H_
+
+#include <qsmp_gui/common.h>
+
+#include <boost/array.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <qsmp_gui/CacheId.h>
+#include <qsmp_lib/Log.h>
+#include <vector>
+
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//These match the type codes used in the pack file object headers
+enum GitObjectType
+{
+  GitObjectType_None     = 0,
+  GitObjectType_Commit   = 1,
+  GitObjectType_Tree     = 2,
+  GitObjectType_Blob     = 3,
+  GitObjectType_Tag      = 4,
+  GitObjectType_OfsDelta = 6,
+  GitObjectType_RefDelta = 7,
+};
+
+//-----------------------------------------------------------------------------
+
+struct GitObject
+{
+  GitObject():type_(GitObjectType_None){}
+  GitObjectType     type_;
+  std::vector<char> data_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//A single pack file and its index, both of which are mmap'd for the lifetime of the pack
+class GitPack
+{
+  QSMP_NON_COPYABLE(GitPack);
+public:
+  GitPack(LogContext log):log_(log){}
+
+  bool Open(const fs::path& idx_path);
+
+  //Looks up the pack offset of an object via the fanout table
+  bool Find(const CacheId& id, boost::uint64_t& offset)const;
+
+  const uint8_t* pack_begin()const{return reinterpret_cast<const uint8_t*>(pack_.data());}
+  //The pack trailer contains the pack checksum and no object data
+  const uint8_t* pack_end()const{return pack_begin() + pack_.size() - 20;}
+
+  const fs::path& path()const{return path_;}
+
+private:
+  const LogContext        log_;
+  fs::path                path_;
+  io::mapped_file_source  idx_;
+  io::mapped_file_source  pack_;
+  int                     version_;
+  boost::uint32_t         count_;
+  const uint8_t*          fanout_;
+  const uint8_t*          ids_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//Reads objects directly out of a repository's object database (.git/objects) rather than going
+//through git cat-file. This handles both packed and loose objects including resolving deltas.
+//
+//This class is not thread safe, it is expected that it is only used from a single reader thread.
+class GitObjectStore
+{
+  QSMP_NON_COPYABLE(GitObjectStore);
+public:
+  GitObjectStore(LogContext log);
+
+  //repository can either be the working tree (with a .git directory) or a bare repository
+  bool Open(const fs::path& repository);
+  bool is_open()const{return !objects_.empty();}
+
+  bool Read(const CacheId& id, GitObject& object);
+
+private:
+  struct DeltaBase
+  {
+    DeltaBase():pack_(NULL),offset_(0),type_(GitObjectType_None){}
+    const GitPack*    pack_;
+    boost::uint64_t   offset_;
+    GitObjectType     type_;
+    std::vector<char> data_;
+  };
+  enum
+  {
+    DeltaBaseCacheSize      = 256,
+    DeltaBaseCacheMaxBytes  = 16 * 1024 * 1024,
+    //git's own limit on the length of a delta chain, anything longer is a corrupt pack or a cycle
+    MaxDeltaDepth           = 4095,
+    //The pack header, thus the offset of the first object
+    PackHeaderSize          = 12,
+  };
+
+  void ScanPacks();
+  //depth is the number of deltas already being resolved on the way to this object
+  bool Read(const CacheId& id, GitObject& object, size_t depth);
+  bool ReadLoose(const CacheId& id, GitObject& object);
+  bool ReadPacked(const GitPack& pack, boost::uint64_t offset, GitObject& object, size_t depth);
+  bool ApplyDelta(const std::vector<char>& base, const std::vector<char>& delta, std::vector<char>& result);
+
+  const DeltaBase* FindDeltaBase(const GitPack& pack, boost::uint64_t offset);
+  const DeltaBase* AddDeltaBase(const GitPack& pack, boost::uint64_t offset, GitObject& base);
+  void             ReleaseDeltaBase(DeltaBase& entry);
+
+  const LogContext                              log_;
+  fs::path                                      objects_;
+  std::time_t                                   packs_time_;
+  boost::ptr_vector<GitPack>                    packs_;
+  boost::array<DeltaBase, DeltaBaseCacheSize>   delta_bases_;
+  size_t                                        delta_base_bytes_;
+  size_t                                        delta_base_evict_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
+
+#endif
+
@@ -0,0 +1,409 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include "stdafx.h"
+#include <qsmp_gui/GitRefs.h>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <qsmp_lib/Log.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  bool IsHexId(const std::string& str)
+  {
+    if (str.size() != CacheId::HexSize)
+      return false;
+    for (size_t i = 0; i < str.size(); i++)
+    {
+      if (cacheid::Hex::from_hex_[uint8_t(str[i])] == 0xFF)
+        return false;
+    }
+    return true;
+  }
+
+  const char* const SymbolicPrefix = "ref: ";
+}
+
+//-----------------------------------------------------------------------------
+
+GitRefs::GitRefs(LogContext log)
+: log_(log),
+  packed_read_(false),
+  next_listener_(0)
+#ifdef __linux__
+  , inotify_fd_(-1)
+#endif
+{
+#ifdef __linux__
+  wake_fds_[0] = wake_fds_[1] = -1;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+
+GitRefs::~GitRefs()
+{
+#ifdef __linux__
+  if (watch_thread_.joinable())
+  {
+    char wake = 0;
+    if (write(wake_fds_[1], &wake, 1) != 1)
+      ERRNO_WARNING(log_);
+    watch_thread_.join();
+  }
+  if (inotify_fd_ != -1)
+    close(inotify_fd_);
+  for (int i = 0; i < 2; i++)
+  {
+    if (wake_fds_[i] != -1)
+      close(wake_fds_[i]);
+  }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitRefs::Open(const fs::path& repository)
+{
+  if (fs::is_directory(repository / ".git" / "refs"))
+    git_dir_ = repository / ".git";
+  else if (fs::is_directory(repository / "refs"))
+    git_dir_ = repository;
+  else
+  {
+    FWARNING(log_, "No refs found in %1%") % repository.string();
+    return false;
+  }
+  repository_ = repository;
+  FLOG(log_, "Opened refs in %1%") % git_dir_.string();
+
+#ifdef __linux__
+  inotify_fd_ = inotify_init();
+  if (inotify_fd_ == -1 || pipe(wake_fds_) == -1)
+  {
+    WARNING(log_) << "Unable to watch refs, changes won't be picked up";
+    ERRNO_WARNING(log_);
+    return true;
+  }
+  AddWatches(git_dir_);
+  AddWatches(git_dir_ / "refs");
+  watch_thread_ = boost::thread(boost::bind(&GitRefs::WatchThread, this));
+#endif
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitRefs::Resolve(const std::string& ref, CacheId* id)
+{
+  boost::lock_guard<boost::mutex> lock(lock_);
+  Refs::const_iterator ii = resolved_.find(ref);
+  if (ii != resolved_.end())
+  {
+    *id = ii->second;
+    return true;
+  }
+
+  if (!ResolveLocked(ref, id))
+  {
+    FWARNING(log_, "Unable to resolve %1%") % ref;
+    return false;
+  }
+  FLOG(log_, "Resolved %1% to %2%") % ref % *id;
+  resolved_[ref] = *id;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitRefs::ResolveLocked(const std::string& ref, CacheId* id)
+{
+  if (IsHexId(ref))
+  {
+    *id = CacheId(ref.c_str());
+    return true;
+  }
+  if (!is_open())
+    return false;
+
+  //The same search order as git rev-parse
+  std::vector<std::string> names;
+  names.push_back(ref);
+  if (ref != "HEAD" && !boost::starts_with(ref, "refs/"))
+  {
+    names.push_back("refs/" + ref);
+    names.push_back("refs/tags/" + ref);
+    names.push_back("refs/heads/" + ref);
+    names.push_back("refs/remotes/" + ref);
+    names.push_back("refs/remotes/" + ref + "/HEAD");
+  }
+
+  for (std::vector<std::string>::const_iterator ii = names.begin(); ii != names.end(); ++ii)
+  {
+    if (ReadRef(*ii, 0, id))
+      return true;
+  }
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+
+bool GitRefs::ReadRef(const std::string& name, size_t depth, CacheId* id)
+{
+  fs::path path = git_dir_ / name;
+  if (fs::is_regular_file(path))
+  {
+    fs::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    boost::trim(line);
+
+    if (boost::starts_with(line, SymbolicPrefix))
+    {
+      if (depth >= MaxSymbolicDepth)
+      {
+        FWARNING(log_, "Too many levels of symbolic refs at %1%") % name;
+        return false;
+      }
+      return ReadRef(line.substr(strlen(SymbolicPrefix)), depth + 1, id);
+    }
+    if (IsHexId(line))
+    {
+      *id = CacheId(line.c_str());
+      return true;
+    }
+    FWARNING(log_, "Unable to parse ref %1%: %2%") % name % line;
+    return false;
+  }
+
+  //Loose refs override packed ones, so the packed refs are only looked at once there isn't one
+  if (!packed_read_)
+    ReadPackedRefs();
+  Refs::const_iterator ii = packed_.find(name);
+  if (ii == packed_.end())
+    return false;
+  *id = ii->second;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void GitRefs::ReadPackedRefs()
+{
+  packed_read_ = true;
+  packed_.clear();
+  fs::path path = git_dir_ / "packed-refs";
+  if (!fs::is_regular_file(path))
+    return;
+
+  //Each line is "<id> <ref>", with comments starting with # and the peeled id of the tag above
+  //starting with ^
+  fs::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line))
+  {
+    if (line.empty() || line[0] == '#' || line[0] == '^')
+      continue;
+    if (line.size() < CacheId::HexSize + 2 || line[CacheId::HexSize] != ' ')
+      continue;
+    std::string hex  = line.substr(0, CacheId::HexSize);
+    std::string name = boost::trim_copy(line.substr(CacheId::HexSize + 1));
+    if (!IsHexId(hex))
+      continue;
+    packed_[name] = CacheId(hex.c_str());
+  }
+  FLOG(log_, "Read %1% packed refs") % packed_.size();
+}
+
+//-----------------------------------------------------------------------------
+
+GitRefs::ListenerId GitRefs::AddListener(ChangeCallback callback)
+{
+  boost::lock_guard<boost::mutex> lock(listeners_lock_);
+  ListenerId listener = next_listener_++;
+  listeners_[listener] = callback;
+  return listener;
+}
+
+//-----------------------------------------------------------------------------
+
+void GitRefs::RemoveListener(ListenerId listener)
+{
+  boost::lock_guard<boost::mutex> lock(listeners_lock_);
+  listeners_.erase(listener);
+}
+
+//-----------------------------------------------------------------------------
+
+void GitRefs::Refresh()
+{
+  LOG(log_) << "Refreshing";
+  std::vector<std::pair<std::string,CacheId> > changed;
+  {
+    boost::lock_guard<boost::mutex> lock(lock_);
+    Refs old;
+    old.swap(resolved_);
+    packed_read_ = false;
+    for (Refs::const_iterator ii = old.begin(); ii != old.end(); ++ii)
+    {
+      CacheId id;
+      if (!ResolveLocked(ii->first, &id))
+      {
+        FWARNING(log_, "%1% has gone") % ii->first;
+        continue;
+      }
+      resolved_[ii->first] = id;
+      if (id != ii->second)
+      {
+        FLOG(log_, "%1% moved from %2% to %3%") % ii->first % ii->second % id;
+        changed.push_back(std::make_pair(ii->first, id));
+      }
+    }
+  }
+
+  if (changed.empty())
+    return;
+
+  //The callbacks are copied so they can add and remove listeners
+  Listeners listeners;
+  {
+    boost::lock_guard<boost::mutex> lock(listeners_lock_);
+    listeners = listeners_;
+  }
+  for (size_t i = 0; i < changed.size(); i++)
+  {
+    for (Listeners::const_iterator ii = listeners.begin(); ii != listeners.end(); ++ii)
+      ii->second(changed[i].first, changed[i].second);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+#ifdef __linux__
+
+void GitRefs::AddWatches(const fs::path& dir)
+{
+  int wd = inotify_add_watch(inotify_fd_, dir.string().c_str(),
+                             IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+  if (wd == -1)
+  {
+    FWARNING(log_, "Unable to watch %1%") % dir.string();
+    ERRNO_WARNING(log_);
+    return;
+  }
+  watches_[wd] = dir;
+
+  //Only the refs directory is watched recursively, the git directory itself is only watched
+  //for HEAD and packed-refs
+  if (dir == git_dir_)
+    return;
+  for (fs::directory_iterator ii(dir), end; ii != end; ++ii)
+  {
+    if (fs::is_directory(ii->path()))
+      AddWatches(ii->path());
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void GitRefs::WatchThread()
+{
+  LOG(log_) << "Watching refs";
+  try
+  {
+    //Big enough for a good number of events, each of which is followed by its name
+    std::vector<char> buffer(64 * (sizeof(inotify_event) + NAME_MAX + 1));
+    for (;;)
+    {
+      pollfd fds[2];
+      fds[0].fd     = inotify_fd_;
+      fds[0].events = POLLIN;
+      fds[1].fd     = wake_fds_[0];
+      fds[1].events = POLLIN;
+      if (poll(fds, 2, -1) == -1)
+      {
+        if (errno == EINTR)
+          continue;
+        ERRNO_WARNING(log_);
+        return;
+      }
+      if (fds[1].revents)
+        break;
+
+      ssize_t size = read(inotify_fd_, &buffer[0], buffer.size());
+      if (size <= 0)
+      {
+        if (size == -1 && errno == EINTR)
+          continue;
+        ERRNO_WARNING(log_);
+        return;
+      }
+
+      bool changed = false;
+      for (ssize_t offset = 0; offset < size; )
+      {
+        const inotify_event* event = reinterpret_cast<const inotify_event*>(&buffer[offset]);
+        offset += sizeof(inotify_event) + event->len;
+
+        std::map<int,fs::path>::const_iterator dir = watches_.find(event->wd);
+        if (dir == watches_.end() || event->len == 0)
+          continue;
+        std::string name = event->name;
+
+        //git writes the new ref to a lock file then renames it into place
+        if (boost::ends_with(name, ".lock"))
+          continue;
+        if (dir->second == git_dir_ && name != "HEAD" && name != "packed-refs")
+          continue;
+
+        if ((event->mask & IN_CREATE) && (event->mask & IN_ISDIR))
+          AddWatches(dir->second / name);
+        changed = true;
+      }
+
+      if (changed)
+        Refresh();
+    }
+  }
+  catch(std::exception& e)
+  {
+    FATAL(log_) << e.what();
+  }
+  LOG(log_) << "Stopped watching refs";
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
@@ -0,0 +1,123 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_GITREFS_H_
+#define QSMP_GITREFS_H_
+
+#include <qsmp_gui/common.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/unordered_map.hpp>
+#include <map>
+#include <qsmp_gui/CacheId.h>
+#include <qsmp_lib/Log.h>
+#include <string>
+#include <vector>
+
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//Turns ref names into commit ids by reading HEAD, the loose refs and packed-refs straight out of
+//the repository rather than asking git. Results are cached until the ref files change.
+//
+//On Linux the ref files are watched with inotify, when the indexer (or anyone else) moves a ref
+//every ref which has been resolved so far is looked up again and the listeners are told about
+//those which now point somewhere else. Elsewhere Refresh has to be called to pick up changes.
+class GitRefs
+{
+  QSMP_NON_COPYABLE(GitRefs);
+public:
+  GitRefs(LogContext log);
+  ~GitRefs();
+
+  //repository can either be the working tree (with a .git directory) or a bare repository
+  bool Open(const fs::path& repository);
+  bool is_open()const{return !git_dir_.empty();}
+  const fs::path& repository()const{return repository_;}
+
+  //ref can be a full ref name (refs/heads/master), a short one (master, tags/v1) which is
+  //looked for in the same places as git rev-parse does, HEAD or a 40 digit id
+  bool Resolve(const std::string& ref, CacheId* id);
+
+  //Called from the watch thread with the ref as it was passed to Resolve and its new id
+  typedef boost::function<void (const std::string&, const CacheId&)> ChangeCallback;
+  typedef size_t ListenerId;
+  ListenerId AddListener(ChangeCallback callback);
+  void       RemoveListener(ListenerId listener);
+
+  //Drops the cached refs and tells the listeners about any which have moved
+  void Refresh();
+
+private:
+  enum
+  {
+    //Symbolic refs pointing at symbolic refs are followed this far
+    MaxSymbolicDepth = 5,
+  };
+
+  typedef boost::unordered_map<std::string,CacheId> Refs;
+  typedef std::map<ListenerId,ChangeCallback>       Listeners;
+
+  //Both must hold lock_
+  bool ResolveLocked(const std::string& ref, CacheId* id);
+  bool ReadRef(const std::string& name, size_t depth, CacheId* id);
+  void ReadPackedRefs();
+
+#ifdef __linux__
+  void WatchThread();
+  void AddWatches(const fs::path& dir);
+#endif
+
+  const LogContext          log_;
+  fs::path                  repository_;
+  fs::path                  git_dir_;
+
+  boost::mutex              lock_;
+  //Every ref which has been resolved, by the name it was asked for
+  Refs                      resolved_;
+  //The contents of packed-refs, read the first time a ref isn't found loose
+  Refs                      packed_;
+  bool                      packed_read_;
+
+  boost::mutex              listeners_lock_;
+  Listeners                 listeners_;
+  ListenerId                next_listener_;
+
+#ifdef __linux__
+  int                       inotify_fd_;
+  //Written to on shutdown to wake the watch thread
+  int                       wake_fds_[2];
+  //Watch descriptors of the directories being watched
+  std::map<int,fs::path>    watches_;
+  boost::thread             watch_thread_;
+#endif
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
+
+#endif
@@ -0,0 +1,158 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#include "stdafx.h"
+#include <qsmp_gui/NameArena.h>
+
+#include <boost/functional/hash.hpp>
+#include <cstring>
+#include <qsmp_lib/Log.h>
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+NameArena::NameArena()
+: log_("NameArena"),
+  chunk_count_(0),
+  chunk_used_(ChunkSize)
+{
+  chunks_.assign(NULL);
+  Intern("", 0);
+}
+
+//-----------------------------------------------------------------------------
+
+NameArena::~NameArena()
+{
+  for (size_t i = 0; i < chunk_count_; i++)
+    delete[] chunks_[i];
+}
+
+//-----------------------------------------------------------------------------
+
+NameArena::Offset NameArena::Intern(const char* name, size_t length)
+{
+  if (length > MaxNameLength)
+  {
+    FWARNING(log_, "Truncating %1% byte name") % length;
+    length = MaxNameLength;
+  }
+
+  size_t hash = boost::hash_range(name, name + length);
+  Shard& shard = this->shard(hash);
+  boost::lock_guard<boost::mutex> lock(shard.lock_);
+
+  //Equal names always land in the same shard so holding its lock is enough to stop them being
+  //appended twice
+  if (Offset offset = FindLocked(shard, name, length, hash))
+    return offset;
+  if (length == 0 && !shard.index_.empty())
+    return 0;
+
+  Offset offset = Append(name, length);
+  shard.index_.insert(std::make_pair(hash, offset));
+  return offset;
+}
+
+//-----------------------------------------------------------------------------
+
+NameArena::Offset NameArena::Append(const char* name, size_t length)
+{
+  boost::lock_guard<boost::mutex> lock(chunk_lock_);
+
+  size_t size = LengthSize + length;
+  if (chunk_used_ + size > ChunkSize)
+  {
+    if (chunk_count_ == MaxChunks)
+    {
+      FATAL(log_) << "Out of space for names";
+      return 0;
+    }
+    chunks_[chunk_count_++] = new char[ChunkSize];
+    chunk_used_ = 0;
+  }
+
+  Offset offset = Offset((chunk_count_ - 1) * ChunkSize + chunk_used_);
+  char* p = chunks_[chunk_count_ - 1] + chunk_used_;
+  p[0] = char(length >> 8);
+  p[1] = char(length & 0xFF);
+  memcpy(p + LengthSize, name, length);
+  chunk_used_ += size;
+  return offset;
+}
+
+//-----------------------------------------------------------------------------
+
+bool NameArena::Find(const char* name, size_t length, Offset* offset)
+{
+  if (length == 0)
+  {
+    *offset = 0;
+    return true;
+  }
+  if (length > MaxNameLength)
+    length = MaxNameLength;
+
+  size_t hash = boost::hash_range(name, name + length);
+  Shard& shard = this->shard(hash);
+  boost::lock_guard<boost::mutex> lock(shard.lock_);
+  *offset = FindLocked(shard, name, length, hash);
+  return *offset != 0;
+}
+
+//-----------------------------------------------------------------------------
+
+NameArena::Offset NameArena::FindLocked(const Shard& shard, const char* name, size_t length, size_t hash)const
+{
+  std::pair<Index::const_iterator,Index::const_iterator> range = shard.index_.equal_range(hash);
+  for (Index::const_iterator ii = range.first; ii != range.second; ++ii)
+  {
+    if (this->length(ii->second) == length && memcmp(data(ii->second), name, length) == 0)
+      return ii->second;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+size_t NameArena::count()
+{
+  size_t count = 0;
+  for (size_t i = 0; i < ShardCount; i++)
+  {
+    boost::lock_guard<boost::mutex> lock(shards_[i].lock_);
+    count += shards_[i].index_.size();
+  }
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+
+size_t NameArena::bytes()
+{
+  boost::lock_guard<boost::mutex> lock(chunk_lock_);
+  return chunk_count_ * ChunkSize;
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
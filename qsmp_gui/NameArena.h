@@ -0,0 +1,121 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_NAMEARENA_H_
+#define QSMP_NAMEARENA_H_
+
+#include <qsmp_gui/common.h>
+
+#include <boost/array.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <qsmp_lib/Log.h>
+#include <QtCore/qstring.h>
+
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//Interned storage for tree entry names. Each distinct name is stored once as length prefixed
+//UTF-8 and is referred to by its offset in the arena, so the thousands of trees repeating the
+//same artist and album names share one copy. Names live in fixed size chunks which are never
+//moved or freed, thus an offset stays valid for the lifetime of the arena.
+//
+//The index is split into ShardCount shards picked by the name's hash, each with its own lock, so
+//threads interning different names only meet on the short chunk append. Reading a name takes no
+//lock. Offset 0 is always the empty name.
+class NameArena
+{
+  QSMP_NON_COPYABLE(NameArena);
+public:
+  typedef boost::uint32_t Offset;
+
+  NameArena();
+  ~NameArena();
+
+  //Names longer than MaxNameLength bytes are truncated
+  Offset Intern(const char* name, size_t length);
+  //Looks up a name without adding it, false if it has never been interned
+  bool   Find(const char* name, size_t length, Offset* offset);
+
+  const char* data(Offset offset)const
+  {
+    return chunks_[offset / ChunkSize] + offset % ChunkSize + LengthSize;
+  }
+  size_t length(Offset offset)const
+  {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(chunks_[offset / ChunkSize] + offset % ChunkSize);
+    return (size_t(p[0]) << 8) | p[1];
+  }
+  QString Text(Offset offset)const
+  {
+    return QString::fromUtf8(data(offset), int(length(offset)));
+  }
+
+  size_t count();
+  size_t bytes();
+
+private:
+  enum
+  {
+    ChunkSize     = 1024 * 1024,
+    MaxChunks     = 4096,
+    LengthSize    = 2,
+    MaxNameLength = 0xFFFF,
+    ShardCount    = 16,
+  };
+
+  typedef boost::unordered_multimap<size_t,Offset> Index;
+
+  struct Shard
+  {
+    boost::mutex lock_;
+    //Offsets of the names keyed by the hash of their bytes
+    Index        index_;
+  };
+
+  Shard& shard(size_t hash)
+  {
+    return shards_[(hash ^ (hash >> 16)) % ShardCount];
+  }
+
+  //Must hold the shard's lock, returns 0 if the name isn't there (which is fine as the empty name is)
+  Offset FindLocked(const Shard& shard, const char* name, size_t length, size_t hash)const;
+  //Copies the name into the current chunk, taking chunk_lock_
+  Offset Append(const char* name, size_t length);
+
+  const LogContext                log_;
+  boost::array<Shard,ShardCount>  shards_;
+  //Guards chunks_ and the counters below, always taken after a shard's lock
+  boost::mutex                    chunk_lock_;
+  boost::array<char*,MaxChunks>   chunks_;
+  size_t                          chunk_count_;
+  size_t                          chunk_used_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
+
+#endif
@@ -0,0 +1,209 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_SHARDEDMAP_H_
+#define QSMP_SHARDEDMAP_H_
+
+#include <qsmp_gui/common.h>
+
+#include <algorithm>
+#include <boost/array.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <vector>
+
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//An unordered_map split into ShardCount independently locked shards. The shard is picked from
+//the key's hash so threads looking up different keys rarely wait on each other. Nodes are never
+//moved by an unordered_map so references into a shard stay valid after its lock is released.
+//Every acquisition is counted, and those that had to wait are counted separately so contention
+//can be logged.
+//
+//Each shard also keeps the values it holds on a CLOCK ring along with a running byte count so the
+//owner can trim the shard back to a budget with Sweep. Values are never erased from the map, the
+//owner is expected to release the heavy part of a value and leave a stub behind.
+template<class Key, class Value, size_t ShardCount = 16>
+class ShardedMap
+{
+  QSMP_NON_COPYABLE(ShardedMap);
+  struct Shard;
+public:
+  typedef boost::unordered_map<Key,Value> Map;
+
+  ShardedMap(){}
+
+  //Holds the lock on the shard owning key for its lifetime
+  class ScopedLock
+  {
+    QSMP_NON_COPYABLE(ScopedLock);
+  public:
+    ScopedLock(ShardedMap& map, const Key& key)
+      : shard_(map.shard(key))
+    {
+      if (!shard_.lock_.try_lock())
+      {
+        shard_.lock_.lock();
+        ++shard_.contended_;
+      }
+      ++shard_.acquired_;
+    }
+    ~ScopedLock()
+    {
+      shard_.lock_.unlock();
+    }
+
+    //Finds the value for key, inserting a copy of initial if it isn't there yet
+    Value& FindOrInsert(const Key& key, const Value& initial)
+    {
+      typename Map::iterator ii = shard_.map_.find(key);
+      if (ii == shard_.map_.end())
+      {
+        ii = shard_.map_.insert(typename Map::value_type(key, initial)).first;
+        shard_.clock_.push_back(&ii->second);
+      }
+      return ii->second;
+    }
+
+    //NULL if key isn't in the map
+    Value* Find(const Key& key)
+    {
+      typename Map::iterator ii = shard_.map_.find(key);
+      return ii == shard_.map_.end() ? NULL : &ii->second;
+    }
+
+    void CountHit(){++shard_.hits_;}
+    void CountMiss(){++shard_.misses_;}
+
+    //Adds to or removes from the number of bytes held by the shard
+    void Charge(size_t bytes){shard_.bytes_ += bytes;}
+    void Release(size_t bytes){shard_.bytes_ -= std::min(bytes, shard_.bytes_);}
+
+    //Advances the clock hand until the shard is back under budget or every value has been
+    //visited twice. evict(value) returns the number of bytes it freed, and should return 0
+    //and clear the value's referenced flag if it has been used since the hand last passed,
+    //thus giving it a second chance. keep is never passed to evict.
+    template<class Evict>
+    void Sweep(size_t budget, const Value* keep, Evict evict)
+    {
+      std::vector<Value*>& clock = shard_.clock_;
+      for (size_t visited = 0; shard_.bytes_ > budget && visited < 2 * clock.size(); visited++)
+      {
+        if (shard_.hand_ >= clock.size())
+          shard_.hand_ = 0;
+        Value* value = clock[shard_.hand_++];
+        if (value == keep)
+          continue;
+        size_t freed = evict(*value);
+        if (freed)
+        {
+          Release(freed);
+          ++shard_.evictions_;
+        }
+      }
+    }
+
+  private:
+    Shard& shard_;
+  };
+
+  struct Statistics
+  {
+    Statistics()
+      : size_(0),bytes_(0),acquired_(0),contended_(0),hits_(0),misses_(0),evictions_(0){}
+    size_t size_;
+    size_t bytes_;
+    size_t acquired_;
+    size_t contended_;
+    size_t hits_;
+    size_t misses_;
+    size_t evictions_;
+  };
+
+  //Sums the counters over all shards, locking each in turn
+  Statistics statistics()
+  {
+    Statistics stats;
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      boost::lock_guard<boost::mutex> lock(shards_[i].lock_);
+      stats.size_      += shards_[i].map_.size();
+      stats.bytes_     += shards_[i].bytes_;
+      stats.acquired_  += shards_[i].acquired_;
+      stats.contended_ += shards_[i].contended_;
+      stats.hits_      += shards_[i].hits_;
+      stats.misses_    += shards_[i].misses_;
+      stats.evictions_ += shards_[i].evictions_;
+    }
+    return stats;
+  }
+
+  //Calls f(value) for every value, holding each shard's lock while its values are visited
+  template<class F>
+  void ForEach(F f)
+  {
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      boost::lock_guard<boost::mutex> lock(shards_[i].lock_);
+      for (typename Map::iterator ii = shards_[i].map_.begin(); ii != shards_[i].map_.end(); ++ii)
+        f(ii->second);
+    }
+  }
+
+  static size_t shard_count(){return ShardCount;}
+
+private:
+  struct Shard
+  {
+    Shard()
+      : hand_(0),bytes_(0),acquired_(0),contended_(0),hits_(0),misses_(0),evictions_(0){}
+    boost::mutex         lock_;
+    Map                  map_;
+    std::vector<Value*>  clock_;
+    size_t               hand_;
+    size_t               bytes_;
+    size_t               acquired_;
+    size_t               contended_;
+    size_t               hits_;
+    size_t               misses_;
+    size_t               evictions_;
+  };
+
+  Shard& shard(const Key& key)
+  {
+    //The map buckets use the low bits of the same hash so mix in the high bits to pick the shard
+    size_t hash = boost::hash<Key>()(key);
+    return shards_[(hash ^ (hash >> 16)) % ShardCount];
+  }
+
+  boost::array<Shard,ShardCount> shards_;
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
+
+#endif
@@ -0,0 +1,183 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_SPSCRING_H_
+#define QSMP_SPSCRING_H_
+
+#include <qsmp_gui/common.h>
+
+#include <boost/array.hpp>
+#include <boost/atomic.hpp>
+#include <boost/static_assert.hpp>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+
+QSMP_BEGIN
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//A bounded queue between exactly one producer thread and one consumer thread. Neither side takes
+//a lock, the producer only writes tail_ and the consumer only writes head_. The indices count up
+//forever and are masked to find the slot, thus Capacity has to be a power of two.
+template<class T, size_t Capacity>
+class SpscRing
+{
+  QSMP_NON_COPYABLE(SpscRing);
+  BOOST_STATIC_ASSERT((Capacity & (Capacity - 1)) == 0);
+public:
+  SpscRing():head_(0),tail_(0){}
+
+  //Producer only, false if the ring is full
+  bool TryPush(const T& value)
+  {
+    size_t tail = tail_.load(boost::memory_order_relaxed);
+    if (tail - head_.load(boost::memory_order_acquire) == Capacity)
+      return false;
+    items_[tail & (Capacity - 1)] = value;
+    tail_.store(tail + 1, boost::memory_order_release);
+    return true;
+  }
+
+  //Consumer only, false if the ring is empty
+  bool TryPop(T& value)
+  {
+    size_t head = head_.load(boost::memory_order_relaxed);
+    if (head == tail_.load(boost::memory_order_acquire))
+      return false;
+    value = items_[head & (Capacity - 1)];
+    head_.store(head + 1, boost::memory_order_release);
+    return true;
+  }
+
+  bool empty()const
+  {
+    return head_.load(boost::memory_order_acquire) == tail_.load(boost::memory_order_acquire);
+  }
+
+  static size_t capacity(){return Capacity;}
+
+private:
+  enum
+  {
+    CacheLineSize = 64,
+  };
+
+  boost::array<T,Capacity>  items_;
+  //The two indices are kept on their own cache lines so the threads don't fight over one
+  char                      pad0_[CacheLineSize];
+  boost::atomic<size_t>     head_;
+  char                      pad1_[CacheLineSize - sizeof(boost::atomic<size_t>)];
+  boost::atomic<size_t>     tail_;
+  char                      pad2_[CacheLineSize - sizeof(boost::atomic<size_t>)];
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+//Wakes a consumer thread which has run out of work. Producers call Notify after adding work,
+//which costs a single atomic load unless the consumer is actually asleep, so a busy consumer
+//isn't woken once per item.
+//
+//The consumer calls PrepareWait, checks once more for work and then either calls Wait or
+//CancelWait. Anything added after PrepareWait will see the consumer as idle and signal it, so
+//no wakeup is lost between the check and the Wait. That needs a full fence on both sides: between
+//the producer publishing its work and reading idle_, and between the consumer setting idle_ and
+//looking for work. Otherwise each can read the other's old value and both miss.
+//
+//On linux the sleep is an eventfd, elsewhere or if the eventfd can't be made it is a condition
+//variable.
+class IdleSignal
+{
+  QSMP_NON_COPYABLE(IdleSignal);
+public:
+#ifdef __linux__
+  IdleSignal():idle_(false),signalled_(false),fd_(eventfd(0, 0)){}
+  ~IdleSignal(){if (fd_ >= 0) close(fd_);}
+#else
+  IdleSignal():idle_(false),signalled_(false){}
+#endif
+
+  void PrepareWait()
+  {
+    idle_.store(true);
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+  }
+  void CancelWait(){idle_.store(false);}
+
+  //May return without a Notify, the consumer just goes around its loop again
+  void Wait()
+  {
+#ifdef __linux__
+    if (fd_ >= 0)
+    {
+      eventfd_t count;
+      if (eventfd_read(fd_, &count) != 0)
+        idle_.store(false);
+      return;
+    }
+#endif
+    boost::unique_lock<boost::mutex> lock(lock_);
+    while (!signalled_)
+      signal_.wait(lock);
+    signalled_ = false;
+  }
+
+  void Notify()
+  {
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if (!idle_.load() || !idle_.exchange(false))
+      return;
+#ifdef __linux__
+    if (fd_ >= 0)
+    {
+      eventfd_write(fd_, 1);
+      return;
+    }
+#endif
+    boost::lock_guard<boost::mutex> lock(lock_);
+    signalled_ = true;
+    signal_.notify_one();
+  }
+
+private:
+  boost::atomic<bool>         idle_;
+  boost::mutex                lock_;
+  boost::condition_variable   signal_;
+  bool                        signalled_;
+#ifdef __linux__
+  //-1 if the eventfd couldn't be made
+  int                         fd_;
+#endif
+};
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
+QSMP_END
+
+#endif
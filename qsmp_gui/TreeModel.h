@@ -19,6 +19,7 @@
 #define QSMP_TREEMODEL_H_
 
 #include <qsmp_gui/common.h>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <QtCore/QAbstractItemModel>
 #include <vector>
 
@@ -31,6 +32,28 @@ QSMP_BEGIN
 template<class Node, class Model>
 class TreeModel;
 
+//-----------------------------------------------------------------------------
+
+//Hands out nodes in chunks which never move once allocated, so a node pointer stays valid for the
+//life of the model and a block of children allocated together sits in one contiguous run. Nodes are
+//never freed individually, removed nodes are simply dropped from their parent.
+template<class Node>
+class TreeNodeArena
+{
+public:
+  enum
+  {
+    ChunkSize = 4096,
+  };
+
+  //Returns count contiguous copies of prototype
+  Node*            Allocate(size_t count, const Node& prototype);
+
+private:
+  typedef std::vector<Node> Chunk;
+  boost::ptr_vector<Chunk>  chunks_;
+};
+
 template<class Node, class Model>
 class TreeModelNode
 {
@@ -45,10 +68,10 @@ public:
   void             fetchMore(){}
 
   //Can be overridden in Node .. but should call as well
-  bool             hasChildren()const{return !children_.empty();}
+  bool             hasChildren()const{return row_count_ != 0;}
 
   //Shouldn't be overridden
-  int              rowCount()const{return children_.size();}
+  int              rowCount()const{return row_count_;}
   QModelIndex      index(int col)const;
 
 protected:
@@ -60,10 +83,8 @@ protected:
 
   void             RemoveChildren(int row, size_t count);
 
-  //Create a certain number of children and set them up
-  //WARNING: after a call to either of these two all node pointers may be invalidated (including "this")
-  //         as these will call a resize on the vector where this node is stored
-  //         thus copy out all data to the stack before calling these
+  //Create a certain number of children and set them up. The returned nodes are contiguous and
+  //existing node pointers remain valid.
   Node*            AddChildren(size_t count);
   Node*            InsertChildren(int row, size_t count);
 
@@ -78,11 +99,36 @@ private:
   friend class TreeModel<Node, Model>;
   template<class StreamNode, class StreamModel>
   friend std::ostream& operator<<(std::ostream& stream, const TreeModelNode<StreamNode, StreamModel>& node);
+
+  //A run of children which were allocated together and so sit next to each other in the arena.
+  //row_ is the row of first_, the rest follow on from it.
+  struct Run
+  {
+    Node*          first_;
+    int            row_;
+    int            count_;
+  };
+  struct RunRowLess
+  {
+    bool operator()(int row, const Run& run)const{return row < run.row_;}
+  };
+
+  //Index of the run holding row
+  size_t           RunOf(int row)const;
+  //Splits the run holding row so that one starts at row, returns its index (or the number of runs
+  //if row is one past the end)
+  size_t           SplitAt(int row);
+  //Moves the rows of all children from run first on by delta
+  void             ShiftRows(size_t first, int delta);
+
+  Node*            self(){return static_cast<Node*>(this);}
+  const Node*      self()const{return static_cast<const Node*>(this);}
+
   Model*           model_;
-  int              id_;
   int              row_;
-  int              parent_;
-  std::vector<int> children_;
+  Node*            parent_;
+  int              row_count_;
+  std::vector<Run> children_;
 };
 
 //-----------------------------------------------------------------------------
@@ -135,14 +181,15 @@ protected:
   const Node*         FromIndex(const QModelIndex& index)const;
   QModelIndex         ToIndex(const Node* node, int col)const;
 
-  Node*               root(){return FromIndex(QModelIndex());}
+  Node*               root(){return root_;}
 
 private:
   friend class TreeModelNode<Node, Model>;
-  std::pair<int,Node*>        AddNodes(size_t count);
+  Node*               AddNodes(size_t count);
 
-  std::vector<Node>   data_;
+  TreeNodeArena<Node> nodes_;
   Model*              model_;
+  Node*               root_;
 };
 
 
@@ -18,7 +18,7 @@
 #ifndef QSMP_TREEMODEL_INL_
 #define QSMP_TREEMODEL_INL_
 
-#include <boost/tuple/tuple.hpp>
+#include <algorithm>
 
 QSMP_BEGIN
 
@@ -26,12 +26,33 @@ QSMP_BEGIN
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
+template<class Node>
+Node* TreeNodeArena<Node>::Allocate(size_t count, const Node& prototype)
+{
+  //The chunks are reserved up front and never grown past that so nothing in them ever moves. If
+  //the run doesn't fit in what's left of the last chunk the rest of it is wasted.
+  if (chunks_.empty() || chunks_.back().capacity() - chunks_.back().size() < count)
+  {
+    chunks_.push_back(new Chunk);
+    chunks_.back().reserve(std::max(count, size_t(ChunkSize)));
+  }
+
+  Chunk& chunk = chunks_.back();
+  size_t begin = chunk.size();
+  chunk.insert(chunk.end(), count, prototype);
+  return &chunk[begin];
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+
 template<class Node, class Model> inline
 TreeModelNode<Node, Model>::TreeModelNode(Model* model)
 : model_(model),
-  id_(0),
   row_(-1),
-  parent_(0)
+  parent_(NULL),
+  row_count_(0)
 {
 }
 
@@ -43,7 +64,7 @@ QModelIndex TreeModelNode<Node, Model>::index(int col)const
   if (row_ == -1)
     return QModelIndex();
   else
-    return model_->createIndex(row_, col, id_);
+    return model_->createIndex(row_, col, const_cast<Node*>(self()));
 }
 
 //-----------------------------------------------------------------------------
@@ -51,7 +72,7 @@ QModelIndex TreeModelNode<Node, Model>::index(int col)const
 template<class Node, class Model> inline
 void TreeModelNode<Node, Model>::BeginAddChildren(size_t count)
 {
-  BeginInsertChildren(children_.size(), count);
+  BeginInsertChildren(row_count_, count);
 }
 
 //-----------------------------------------------------------------------------
@@ -72,56 +93,71 @@ void TreeModelNode<Node, Model>::EndInsertChildren(Model* model)
 
 //-----------------------------------------------------------------------------
 
-template<class Node, class Model>
-void TreeModelNode<Node, Model>::RemoveChildren(int row, size_t count)
+template<class Node, class Model> inline
+size_t TreeModelNode<Node, Model>::RunOf(int row)const
 {
-  model_->beginRemoveRows(index(0), row, row + count - 1);
-  children_.erase(children_.begin() + row, children_.begin() + row + count);
-
-  for(size_t i = row; i < children_.size(); i++)
-  {
-    child(i)->row_ -= count;
-  }
-
-  model_->endRemoveRows();
+  return std::upper_bound(children_.begin(), children_.end(), row, RunRowLess()) - children_.begin() - 1;
 }
 
 //-----------------------------------------------------------------------------
 
 template<class Node, class Model>
-Node* TreeModelNode<Node, Model>::AddChildren(size_t count)
+size_t TreeModelNode<Node, Model>::SplitAt(int row)
 {
-  using boost::tie;
-  size_t row = children_.size();
-  children_.insert(children_.end(), count, 0);
+  if (row == row_count_)
+    return children_.size();
+
+  size_t i = RunOf(row);
+  Run& run = children_[i];
+  int offset = row - run.row_;
+  if (offset == 0)
+    return i;
+
+  Run tail;
+  tail.first_  = run.first_ + offset;
+  tail.row_    = row;
+  tail.count_  = run.count_ - offset;
+  run.count_   = offset;
+  children_.insert(children_.begin() + i + 1, tail);
+  return i + 1;
+}
 
-  TreeModel<Node, Model>* model = model_;
+//-----------------------------------------------------------------------------
 
-  int child_id = model->data_.size();
-  for(size_t i = row; i < row + count; i++)
+template<class Node, class Model>
+void TreeModelNode<Node, Model>::ShiftRows(size_t first, int delta)
+{
+  for (size_t i = first; i < children_.size(); i++)
   {
-    children_[i] = child_id++;
+    Run& run = children_[i];
+    run.row_ += delta;
+    for (Node* node = run.first_; node != run.first_ + run.count_; ++node)
+      static_cast<TreeModelNode*>(node)->row_ += delta;
   }
+}
 
-  int begin;
-  Node* pbegin;
-  int id = id_;
-  
-  //After this point 'this' may be invalid as AddNodes may cause a realloc of TreeModel::data_ where
-  //we are stored
-  tie(begin,pbegin) = model->AddNodes(count);
+//-----------------------------------------------------------------------------
 
+template<class Node, class Model>
+void TreeModelNode<Node, Model>::RemoveChildren(int row, size_t count)
+{
+  model_->beginRemoveRows(index(0), row, row + count - 1);
 
-  child_id = begin;
-  for(Node* i = pbegin; i < pbegin + count; i++)
-  {
-    TreeModelNode* node = static_cast<TreeModelNode*>(i);
-    node->row_    = row++;
-    node->parent_ = id;
-    node->id_     = child_id++;
-  }
+  size_t begin = SplitAt(row);
+  size_t end   = SplitAt(row + count);
+  children_.erase(children_.begin() + begin, children_.begin() + end);
+  row_count_ -= count;
+  ShiftRows(begin, -int(count));
 
-  return pbegin;
+  model_->endRemoveRows();
+}
+
+//-----------------------------------------------------------------------------
+
+template<class Node, class Model>
+Node* TreeModelNode<Node, Model>::AddChildren(size_t count)
+{
+  return InsertChildren(row_count_, count);
 }
 
 //-----------------------------------------------------------------------------
@@ -129,40 +165,34 @@ Node* TreeModelNode<Node, Model>::AddChildren(size_t count)
 template<class Node, class Model>
 Node* TreeModelNode<Node, Model>::InsertChildren(int row, size_t count)
 {
-  using boost::tie;
-  for(size_t i = row; i < children_.size(); i++)
+  Node* first = model_->AddNodes(count);
+  for (size_t i = 0; i < count; i++)
   {
-    child(i)->row_ += count;
+    TreeModelNode* node = static_cast<TreeModelNode*>(first + i);
+    node->row_    = row + i;
+    node->parent_ = self();
   }
 
-  children_.insert(children_.begin() + row, count, 0);
-
-  TreeModel<Node, Model>* model = model_;
-
-  int child_id = model->data_.size();
-  for(size_t i = row; i < row + count; i++)
+  size_t i = SplitAt(row);
+  //Children added one at a time in a row are normally next to each other in the arena, in which
+  //case they just extend the previous run
+  if (i > 0 && children_[i-1].first_ + children_[i-1].count_ == first)
   {
-    children_[i] = child_id++;
+    children_[i-1].count_ += count;
   }
-
-  int begin;
-  Node* pbegin;
-  int id = id_;
-
-  //After this point 'this' may be invalid as AddNodes may cause a realloc of TreeModel::data_ where
-  //we are stored
-  tie(begin,pbegin) = model->AddNodes(count);
-
-  child_id = begin;
-  for(Node* i = pbegin; i < pbegin + count; i++)
+  else
   {
-    TreeModelNode* node = static_cast<TreeModelNode*>(i);
-    node->row_    = row++;
-    node->parent_ = id;
-    node->id_     = child_id++;
+    Run run;
+    run.first_ = first;
+    run.row_   = row;
+    run.count_ = count;
+    children_.insert(children_.begin() + i, run);
+    i++;
   }
+  row_count_ += count;
+  ShiftRows(i, count);
 
-  return pbegin;
+  return first;
 }
 
 //-----------------------------------------------------------------------------
@@ -171,8 +201,8 @@ template<class Node, class Model> inline
 void TreeModelNode<Node, Model>::ChildrenUpdated(int row, size_t count)const
 {
   const Node* child_begin = child(row);
-  const Node* child_end   = child(row+count);
-  model_->dataChanged(child_begin->index(0), child_end->index(child_end->rowCount()));
+  const Node* child_end   = child(row + count - 1);
+  model_->dataChanged(child_begin->index(0), child_end->index(child_end->columnCount() - 1));
 }
 
 //-----------------------------------------------------------------------------
@@ -180,13 +210,15 @@ void TreeModelNode<Node, Model>::ChildrenUpdated(int row, size_t count)const
 template<class Node, class Model> inline
 Node* TreeModelNode<Node, Model>::child(int row)
 {
-  return &model_->data_[children_[row]];
+  const Run& run = children_[RunOf(row)];
+  return run.first_ + (row - run.row_);
 }
 
 template<class Node, class Model> inline
 const Node* TreeModelNode<Node, Model>::child(int row)const
 {
-  return &model_->data_[children_[row]];
+  const Run& run = children_[RunOf(row)];
+  return run.first_ + (row - run.row_);
 }
 
 //-----------------------------------------------------------------------------
@@ -198,7 +230,7 @@ TreeModel<Node, Model>::TreeModel(Model* model)
 : model_(model)
 {
   //Add the root node
-  data_.push_back(Node(model));
+  root_ = AddNodes(1);
 }
 
 //-----------------------------------------------------------------------------
@@ -207,10 +239,10 @@ template<class Node, class Model>
 QModelIndex TreeModel<Node, Model>::index(int row, int column, const QModelIndex &parent /* = QModelIndex */)const
 {
   const Node* node = FromIndex(parent);
-  if (!(0 <= row && row < (int)node->children_.size()))
+  if (!(0 <= row && row < node->rowCount()))
     return QModelIndex();
 
-  return createIndex(row, column, node->children_[row]);
+  return createIndex(row, column, const_cast<Node*>(node->child(row)));
 }
 
 //-----------------------------------------------------------------------------
@@ -219,11 +251,11 @@ template<class Node, class Model>
 QModelIndex TreeModel<Node, Model>::parent(const QModelIndex& index)const
 {
   const Node* node   = FromIndex(index);
-  const Node* parent = &data_[node->parent_];
-  if (parent->row_ == -1)
+  const Node* parent = node->parent_;
+  if (!parent || parent->row_ == -1)
     return QModelIndex();
   else
-    return createIndex(parent->row_, 0, node->parent_);
+    return createIndex(parent->row_, 0, const_cast<Node*>(parent));
 }
 
 //-----------------------------------------------------------------------------
@@ -231,13 +263,15 @@ QModelIndex TreeModel<Node, Model>::parent(const QModelIndex& index)const
 template<class Node, class Model> inline
 Node* TreeModel<Node, Model>::FromIndex(const QModelIndex& index)
 {
-  return &data_[(size_t)index.internalPointer()];
+  Node* node = static_cast<Node*>(index.internalPointer());
+  return node ? node : root_;
 }
 
 template<class Node, class Model> inline
 const Node* TreeModel<Node, Model>::FromIndex(const QModelIndex& index)const
 {
-  return &data_[(size_t)index.internalPointer()];
+  const Node* node = static_cast<const Node*>(index.internalPointer());
+  return node ? node : root_;
 }
 
 //-----------------------------------------------------------------------------
@@ -248,18 +282,15 @@ QModelIndex TreeModel<Node, Model>::ToIndex(const Node* node, int col)const
   if (node->row_ == -1)
     return QModelIndex();
   else
-    return createIndex(node->row_, col, node - &data_[0]);
+    return createIndex(node->row_, col, const_cast<Node*>(node));
 }
 
 //-----------------------------------------------------------------------------
 
 template<class Node, class Model> inline
-std::pair<int,Node*> TreeModel<Node, Model>::AddNodes(size_t count)
+Node* TreeModel<Node, Model>::AddNodes(size_t count)
 {
-  int   begin  = data_.size();
-  data_.insert(data_.end(), count, Node(model_));
-  Node* pbegin = &data_[begin];
-  return std::make_pair(begin,pbegin);
+  return nodes_.Allocate(count, Node(model_));
 }
 
 //-----------------------------------------------------------------------------
@@ -269,4 +300,3 @@ std::pair<int,Node*> TreeModel<Node, Model>::AddNodes(size_t count)
 QSMP_END
 
 #endif
-
@@ -31,7 +31,7 @@
 #include <qsmp_gui/Player.h>
 #include <qsmp_gui/PlaylistModel.h>
 #include <qsmp_gui/PlaylistView.h>
-#include <qsmp_gui/Process.h>
+#include <qsmp_lib/Process.h>
 #include <qsmp_gui/utilities.h>
 #include <qsmp_gui/ViewSelector.h>
 #include <qsmp_lib/Log.h>
@@ -91,6 +91,9 @@ int main(int argc, char **argv)
     //Cache::lease();
 
     std::string path = (argc > 1) ? argv[1] : "";
+    //The repository written by qsmp_indexer
+    if (argc > 2)
+      Cache::SetRepository(argv[2]);
 
     std::vector<Media> paths;
     std::copy(recursive_directory_iterator(path),
@@ -143,7 +146,9 @@ int main(int argc, char **argv)
 
     //LuaTcpServer lua;
 
-    return app.exec();
+    int ret = app.exec();
+    Cache::lease()->SaveSnapshot();
+    return ret;
 }
 
 //-----------------------------------------------------------------------------
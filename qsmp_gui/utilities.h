@@ -551,6 +551,17 @@ public:
     QMetaObject::invokeMethod(obj_,member_,type_,ret_,QArgument<T0>(T0Name,a0));
   }
 
+  template<class T0, class T1, class T2>
+  void operator()(const char* T0Name, const T0& a0,
+                  const char* T1Name, const T1& a1,
+                  const char* T2Name, const T2& a2)const
+  {
+    QMetaObject::invokeMethod(obj_,member_,type_,ret_,
+                              QArgument<T0>(T0Name,a0),
+                              QArgument<T1>(T1Name,a1),
+                              QArgument<T2>(T2Name,a2));
+  }
+
 private:
   QObject*               obj_;
   const char*            member_;
@@ -584,6 +595,24 @@ template<class T, class T0, class T1, class T2>
 boost::shared_ptr<T> spnew(const T0& a0, const T1& a1, const T2& a2)
 {return boost::shared_ptr<T>(new T(a0, a1, a2));}
 
+//-----------------------------------------------------------------------------
+
+template<class T, class T0, class T1, class T2, class T3>
+boost::shared_ptr<T> spnew(const T0& a0, const T1& a1, const T2& a2, const T3& a3)
+{return boost::shared_ptr<T>(new T(a0, a1, a2, a3));}
+
+//-----------------------------------------------------------------------------
+
+template<class T, class T0, class T1, class T2, class T3, class T4>
+boost::shared_ptr<T> spnew(const T0& a0, const T1& a1, const T2& a2, const T3& a3, const T4& a4)
+{return boost::shared_ptr<T>(new T(a0, a1, a2, a3, a4));}
+
+//-----------------------------------------------------------------------------
+
+template<class T, class T0, class T1, class T2, class T3, class T4, class T5>
+boost::shared_ptr<T> spnew(const T0& a0, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5)
+{return boost::shared_ptr<T>(new T(a0, a1, a2, a3, a4, a5));}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
@@ -0,0 +1,163 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_INDEXER_FASTIMPORTWRITER_H_
+#define QSMP_INDEXER_FASTIMPORTWRITER_H_
+
+#include <boost/cstdint.hpp>
+#include <boost/scoped_array.hpp>
+#include <errno.h>
+#include <string>
+#include <string.h>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define QSMPINDEXER_BEGIN namespace qsmp_indexer {
+#define QSMPINDEXER_END  }
+
+QSMPINDEXER_BEGIN
+
+//Buffers the fast-import stream and writes it to a file descriptor in large blocks. Everything
+//written has its length known up front (literals, strings or numbers formatted on the stack) so
+//nothing is allocated or measured with strlen per write.
+class FastImportWriter
+{
+public:
+  enum
+  {
+    BufferSize = 1024 * 1024,
+  };
+
+  explicit FastImportWriter(int fd)
+    : fd_(fd),
+      buffer_(new char[BufferSize]),
+      used_(0),
+      written_(0),
+      failed_(false)
+  {
+  }
+
+  ~FastImportWriter()
+  {
+    Flush();
+  }
+
+  void Write(const char* data, size_t size)
+  {
+    if (used_ + size > BufferSize)
+    {
+      Flush();
+      //Not worth copying through the buffer
+      if (size >= BufferSize)
+      {
+        WriteFd(data, size);
+        return;
+      }
+    }
+    memcpy(buffer_.get() + used_, data, size);
+    used_ += size;
+  }
+
+  template<size_t N>
+  void Write(const char (&literal)[N]){Write(literal, N - 1);}
+  void Write(const std::string& str){Write(str.data(), str.size());}
+  void Write(char c)
+  {
+    if (used_ == BufferSize)
+      Flush();
+    buffer_[used_++] = c;
+  }
+
+  void WriteNumber(boost::uint64_t number)
+  {
+    char digits[20];
+    char* begin = digits + sizeof(digits);
+    do
+    {
+      *--begin = char('0' + number % 10);
+      number /= 10;
+    } while (number != 0);
+    Write(begin, digits + sizeof(digits) - begin);
+  }
+
+  //A data command followed by its contents
+  void Data(const char* data, size_t size)
+  {
+    Write("data ");
+    WriteNumber(size);
+    Write('\n');
+    Write(data, size);
+    Write('\n');
+  }
+
+  bool Flush()
+  {
+    WriteFd(buffer_.get(), used_);
+    used_ = 0;
+    return !failed_;
+  }
+
+  //Drops anything not yet flushed and stops writing to the fd, has to be called before the fd is
+  //closed. Later writes fail.
+  void Close()
+  {
+    used_ = 0;
+    fd_   = -1;
+  }
+
+  bool            failed()const{return failed_;}
+  //Bytes handed to the fd so far
+  boost::uint64_t written()const{return written_;}
+
+private:
+  void WriteFd(const char* data, size_t size)
+  {
+    if (fd_ < 0 && size > 0)
+      failed_ = true;
+    while (size > 0 && !failed_)
+    {
+#ifdef WIN32
+      int ret = _write(fd_, data, unsigned(size));
+#else
+      ssize_t ret = ::write(fd_, data, size);
+#endif
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+      {
+        failed_ = true;
+        break;
+      }
+      data     += ret;
+      size     -= ret;
+      written_ += ret;
+    }
+  }
+
+  int                       fd_;
+  boost::scoped_array<char> buffer_;
+  size_t                    used_;
+  boost::uint64_t           written_;
+  bool                      failed_;
+};
+
+QSMPINDEXER_END
+
+#endif
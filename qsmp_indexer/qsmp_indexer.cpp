@@ -15,29 +15,49 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
  ******************************************************************************/
 
+#include <boost/algorithm/string.hpp>
 #include <boost/array.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/static_assert.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/unordered_map.hpp>
 #include <id3/tag.h>
+#include <qsmp_indexer/FastImportWriter.h>
+#include <qsmp_lib/Process.h>
+#include <cstdio>
+#include <deque>
+#include <errno.h>
+#include <fstream>
 #include <iterator>
 #include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <vector>
 #include <string.h>
 #ifdef WIN32
 #include <fcntl.h> //for _O_BINARY
 #include <io.h>    //for _setmode
+#else
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
 using boost::scoped_ptr;
 
-#define QSMPINDEXER_BEGIN namespace qsmp_indexer {
-#define QSMPINDEXER_END  }
-
-
 QSMPINDEXER_BEGIN
 
 const char* id_lookup[] = {
@@ -199,93 +219,131 @@ std::basic_ostream<CharT,traits>& operator<<(std::basic_ostream<CharT,traits>& s
 }
 
 
-void set_id3_metadata(const char* path,
+//A change to a file in the index commit. The commands for each file are built up on the worker
+//threads and written out by the emitter, which is the only place that knows which values have
+//already been written as blobs.
+struct FileCommand
+{
+  enum Kind
+  {
+    Kind_Delete,
+    Kind_Modify,
+    Kind_Copy,
+  };
+
+  FileCommand(Kind kind, const std::string& path, const std::string& data = std::string())
+    : kind_(kind),path_(path),data_(data){}
+
+  Kind        kind_;
+  //The destination for a copy
+  std::string path_;
+  //The contents for a modify or the source path for a copy
+  std::string data_;
+};
+
+typedef std::vector<FileCommand> FileCommands;
+
+void set_id3_metadata(FileCommands& out,
+                      const char* path,
                       const char* frame,
                       int count,
                       const char* field,
                       const char* data)
 {
-  std::cout << "M 644 inline " << "files/" << path 
-            << "/id3/" << frame << '/' << count << '/' << field
-            << '\n'
-            << "data " << std::strlen(data) << '\n'
-            << data << '\n';
+  std::string file = "files/";
+  file += path;
+  file += "/id3/";
+  file += frame;
+  file += '/';
+  file += boost::lexical_cast<std::string>(count);
+  file += '/';
+  file += field;
+  out.push_back(FileCommand(FileCommand::Kind_Modify, file, data));
 }
 
-void set_main_metadata(const char* path,
+void set_main_metadata(FileCommands& out,
+                       const char* path,
                        const char* type,
                        const char* data)
 {
-  std::cout << "M 644 inline " << "files/" << path << "/"
-            << type << "\n"
-            << "data " << std::strlen(data) << "\n"
-            << data << "\n";
+  std::string file = "files/";
+  file += path;
+  file += '/';
+  file += type;
+  out.push_back(FileCommand(FileCommand::Kind_Modify, file, data));
 }
 
-void set_sort_metadata(const char* path,
-                       const char* sort_type,
-                       const char* sort_data)
-{
-  std::cout << "C \"" << "files/" << path << "\" "
-            << "sort1/" 
-            << sort_type << '/';
+//The set_sort_metadata overloads return the path the file was copied to so it can be removed
+//again if the file changes
 
+void append_sort_data(std::string& sort_path, const char* sort_data)
+{
   if (strlen(sort_data) > 0)
-    std::cout << sort_data << '\n';
+    sort_path += sort_data;
   else
-    std::cout << "Unknown" << '\n';
+    sort_path += "Unknown";
 }
 
-void set_sort_metadata(const char* path,
-                       const char* sort_type_1,
-                       const char* sort_data_1,
-                       const char* sort_type_2,
-                       const char* sort_data_2)
+std::string set_sort_metadata(FileCommands& out,
+                              const char* path,
+                              const std::string& sort_path)
 {
-  std::cout << "C \"" << "files/" << path << "\" "
-            << "sort2/" 
-            << sort_type_1 << '/'
-            << sort_type_2 << '/';
-
-  if (strlen(sort_data_1) > 0)
-    std::cout << sort_data_1 << '/';
-  else
-    std::cout << "Unknown" << '/';
-
-  if (strlen(sort_data_2) > 0)
-    std::cout << sort_data_2 << '\n';
-  else
-    std::cout << "Unknown" << '\n';
+  out.push_back(FileCommand(FileCommand::Kind_Copy, sort_path, std::string("files/") + path));
+  return sort_path;
 }
 
-void set_sort_metadata(const char* path,
-                       const char* sort_type_1,
-                       const char* sort_data_1,
-                       const char* sort_type_2,
-                       const char* sort_data_2,
-                       const char* sort_type_3,
-                       const char* sort_data_3)
+std::string set_sort_metadata(FileCommands& out,
+                              const char* path,
+                              const char* sort_type,
+                              const char* sort_data)
 {
-  std::cout << "C \"" << "files/" << path << "\" "
-            << "sort3/" 
-            << sort_type_1 << '/'
-            << sort_type_2 << '/'
-            << sort_type_3 << '/';
-
-  if (strlen(sort_data_1) > 0)
-    std::cout << sort_data_1 << '/';
-  else
-    std::cout << "Unknown" << '/';
+  std::string sort_path = "sort1/";
+  sort_path += sort_type;
+  sort_path += '/';
+  append_sort_data(sort_path, sort_data);
+  return set_sort_metadata(out, path, sort_path);
+}
 
-  if (strlen(sort_data_2) > 0)
-    std::cout << sort_data_2 << '/';
-  else
-    std::cout << "Unknown" << '/';
+std::string set_sort_metadata(FileCommands& out,
+                              const char* path,
+                              const char* sort_type_1,
+                              const char* sort_data_1,
+                              const char* sort_type_2,
+                              const char* sort_data_2)
+{
+  std::string sort_path = "sort2/";
+  sort_path += sort_type_1;
+  sort_path += '/';
+  sort_path += sort_type_2;
+  sort_path += '/';
+  append_sort_data(sort_path, sort_data_1);
+  sort_path += '/';
+  append_sort_data(sort_path, sort_data_2);
+  return set_sort_metadata(out, path, sort_path);
+}
 
-  if (strlen(sort_data_3) > 0)
-    std::cout << sort_data_3 << '\n';
-  else
-    std::cout << "Unknown" << '\n';
+std::string set_sort_metadata(FileCommands& out,
+                              const char* path,
+                              const char* sort_type_1,
+                              const char* sort_data_1,
+                              const char* sort_type_2,
+                              const char* sort_data_2,
+                              const char* sort_type_3,
+                              const char* sort_data_3)
+{
+  std::string sort_path = "sort3/";
+  sort_path += sort_type_1;
+  sort_path += '/';
+  sort_path += sort_type_2;
+  sort_path += '/';
+  sort_path += sort_type_3;
+  sort_path += '/';
+  append_sort_data(sort_path, sort_data_1);
+  sort_path += '/';
+  append_sort_data(sort_path, sort_data_2);
+  sort_path += '/';
+  append_sort_data(sort_path, sort_data_3);
+  return set_sort_metadata(out, path, sort_path);
 }
 
 struct PrintMetadata
@@ -294,13 +352,11 @@ struct PrintMetadata
 
   size_t strip_;
 
-  void operator()(const fs::path& path)const
+  void operator()(const fs::path& path, FileCommands& out, std::vector<std::string>* sort_paths)const
   {
-    if (path.extension() != ".mp3")
-      return;
-
-    ID3_Tag tag(path.string().c_str());
-    const char* stripped_path = path.string().c_str() + strip_;
+    std::string path_string = path.string();
+    ID3_Tag tag(path_string.c_str());
+    const char* stripped_path = path_string.c_str() + strip_;
 
     boost::array<int, ID3FID_LASTFRAMEID> frame_count;
     std::fill(frame_count.begin(),frame_count.end(),0);
@@ -342,7 +398,8 @@ struct PrintMetadata
           if (!field_data || !field_id_string)
             break;
 
-          set_id3_metadata(stripped_path,
+          set_id3_metadata(out,
+                           stripped_path,
                            frame_id_string,
                            frame_count[frame_id],
                            field_id_string,
@@ -366,23 +423,834 @@ struct PrintMetadata
     std::replace(const_cast<char*>(artist), const_cast<char*>(artist + strlen(artist)), '/', '_');
     std::replace(const_cast<char*>(album), const_cast<char*>(album + strlen(album)), '/', '_');
     //delete tag_iterator;
-    set_main_metadata(stripped_path,
+    set_main_metadata(out,
+                      stripped_path,
                       "artist",artist);
-    set_main_metadata(stripped_path,
+    set_main_metadata(out,
+                      stripped_path,
                       "album",album);
-    set_main_metadata(stripped_path,
-                      "title",title);
-    set_sort_metadata(stripped_path,
-                      "artist",artist,
-                      "title",title);
-    set_sort_metadata(stripped_path,
-                      "artist",artist,
-                      "album",album,
+    set_main_metadata(out,
+                      stripped_path,
                       "title",title);
+    sort_paths->push_back(set_sort_metadata(out,
+                                            stripped_path,
+                                            "artist",artist,
+                                            "title",title));
+    sort_paths->push_back(set_sort_metadata(out,
+                                            stripped_path,
+                                            "artist",artist,
+                                            "album",album,
+                                            "title",title));
 
   }
 };
 
+//What a file looked like when it was last indexed. If none of size, mtime and inode have changed
+//the file isn't parsed again.
+struct FileStat
+{
+  FileStat():size_(0),mtime_(0),inode_(0){}
+
+  bool SameFile(const FileStat& other)const
+  {
+    return size_ == other.size_ && mtime_ == other.mtime_ && inode_ == other.inode_;
+  }
+
+  boost::uint64_t          size_;
+  boost::int64_t           mtime_;
+  boost::uint64_t          inode_;
+  //Where the file was copied to under sort*/ so those can be removed when it changes
+  std::vector<std::string> sort_paths_;
+};
+
+FileStat stat_file(const fs::path& path)
+{
+  FileStat stat;
+#ifdef WIN32
+  boost::system::error_code error;
+  stat.size_  = fs::file_size(path, error);
+  stat.mtime_ = fs::last_write_time(path, error);
+#else
+  struct stat buf;
+  if (::stat(path.string().c_str(), &buf) == 0)
+  {
+    stat.size_  = buf.st_size;
+    stat.mtime_ = buf.st_mtime;
+    stat.inode_ = buf.st_ino;
+  }
+#endif
+  return stat;
+}
+
+//Sidecar file holding the FileStat of every file in the last index, keyed by the path as it
+//appears under files/. One file per line with tab separated fields:
+//  size mtime inode path sort_path...
+//Backslashes, tabs and line breaks in the paths are escaped as in C.
+class StatCache
+{
+public:
+  typedef std::map<std::string, FileStat> Files;
+
+  bool Load(const fs::path& path)
+  {
+    std::ifstream in(path.string().c_str(), std::ios::binary);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != header())
+      return false;
+
+    while (std::getline(in, line))
+    {
+      std::vector<std::string> fields;
+      boost::split(fields, line, boost::is_any_of("\t"));
+      //A damaged cache is thrown away and the whole directory is indexed again
+      if (fields.size() < 4)
+      {
+        files_.clear();
+        return false;
+      }
+
+      FileStat stat;
+      try
+      {
+        stat.size_  = boost::lexical_cast<boost::uint64_t>(fields[0]);
+        stat.mtime_ = boost::lexical_cast<boost::int64_t>(fields[1]);
+        stat.inode_ = boost::lexical_cast<boost::uint64_t>(fields[2]);
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+        files_.clear();
+        return false;
+      }
+      for (size_t i = 4; i < fields.size(); i++)
+        stat.sort_paths_.push_back(Unescape(fields[i]));
+      files_[Unescape(fields[3])] = stat;
+    }
+    return true;
+  }
+
+  //Writes to a temporary first so a failed run doesn't leave half a cache behind
+  bool Save(const fs::path& path)const
+  {
+    fs::path temp = path.string() + ".tmp";
+    {
+      std::ofstream out(temp.string().c_str(), std::ios::binary | std::ios::trunc);
+      out << header() << '\n';
+      for (Files::const_iterator ii = files_.begin(); ii != files_.end(); ++ii)
+      {
+        const FileStat& stat = ii->second;
+        out << stat.size_ << '\t' << stat.mtime_ << '\t' << stat.inode_ << '\t' << Escape(ii->first);
+        for (size_t i = 0; i < stat.sort_paths_.size(); i++)
+          out << '\t' << Escape(stat.sort_paths_[i]);
+        out << '\n';
+      }
+      if (!out)
+        return false;
+    }
+    boost::system::error_code error;
+    fs::rename(temp, path, error);
+    return !error;
+  }
+
+  Files files_;
+
+private:
+  static const char* header(){return "qsmp_indexer stat cache 2";}
+
+  static std::string Escape(const std::string& path)
+  {
+    std::string escaped;
+    escaped.reserve(path.size());
+    for (std::string::const_iterator ii = path.begin(); ii != path.end(); ++ii)
+    {
+      switch (*ii)
+      {
+      case '\\': escaped += "\\\\"; break;
+      case '\t': escaped += "\\t";  break;
+      case '\n': escaped += "\\n";  break;
+      case '\r': escaped += "\\r";  break;
+      default:   escaped += *ii;    break;
+      }
+    }
+    return escaped;
+  }
+
+  static std::string Unescape(const std::string& escaped)
+  {
+    std::string path;
+    path.reserve(escaped.size());
+    for (std::string::const_iterator ii = escaped.begin(); ii != escaped.end(); ++ii)
+    {
+      if (*ii != '\\' || ii + 1 == escaped.end())
+      {
+        path += *ii;
+        continue;
+      }
+      switch (*++ii)
+      {
+      case 't': path += '\t'; break;
+      case 'n': path += '\n'; break;
+      case 'r': path += '\r'; break;
+      default:  path += *ii;  break;
+      }
+    }
+    return path;
+  }
+};
+
+//Writes the index commit. Each distinct value is written once as a blob with a mark and later
+//files with the same value refer to the mark, so an artist shared by a thousand files is only sent
+//(and hashed) once. Blobs can't be written in the middle of a commit so the file commands are
+//spooled to a temporary file and the commit is written out from that at the end.
+class IndexCommit
+{
+public:
+  IndexCommit(FastImportWriter& out, bool incremental)
+    : out_(out),
+      incremental_(incremental),
+      spool_file_(NULL),
+      next_mark_(1),
+      commands_(0),
+      commits_(0)
+  {
+    OpenSpool();
+  }
+
+  ~IndexCommit()
+  {
+    CloseSpool();
+  }
+
+  void Write(const FileCommand& command)
+  {
+    FastImportWriter& spool = *spool_;
+    switch (command.kind_)
+    {
+    case FileCommand::Kind_Delete:
+      spool.Write("D ");
+      break;
+    case FileCommand::Kind_Modify:
+      spool.Write("M 644 :");
+      spool.WriteNumber(Mark(command.data_));
+      spool.Write(' ');
+      break;
+    case FileCommand::Kind_Copy:
+      spool.Write("C \"");
+      spool.Write(command.data_);
+      spool.Write("\" ");
+      break;
+    }
+    spool.Write(command.path_);
+    spool.Write('\n');
+    commands_++;
+  }
+
+  void Write(const FileCommands& commands)
+  {
+    for (size_t i = 0; i < commands.size(); i++)
+      Write(commands[i]);
+  }
+
+  //Writes the commit itself and starts spooling the next one. Only the first commit of a full run is
+  //written when empty, returns whether the commit was written
+  bool Finish()
+  {
+    if ((incremental_ || commits_ != 0) && commands_ == 0)
+      return false;
+
+    static const char commit_message[] = "Initial index.";
+    static const char update_message[] = "Update index.";
+    bool initial = !incremental_ && commits_ == 0;
+    if (initial)
+      out_.Write("reset refs/heads/master\n");
+    out_.Write("commit refs/heads/master\n"
+               "committer qsmp_indexer <qsmp_indexer@example.com> now\n");
+    if (initial)
+      out_.Data(commit_message, sizeof(commit_message) - 1);
+    else
+      out_.Data(update_message, sizeof(update_message) - 1);
+    //fast-import only knows about branches it has written itself so the parent has to be named.
+    //Later commits in the same stream follow on from the branch as fast-import has it.
+    if (incremental_ && commits_ == 0)
+      out_.Write("from refs/heads/master^0\n");
+
+    if (!spool_->Flush())
+      throw std::runtime_error("unable to spool the commit to a temporary file");
+    std::rewind(spool_file_);
+    char buffer[64 * 1024];
+    size_t read;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), spool_file_)) > 0)
+      out_.Write(buffer, read);
+    if (std::ferror(spool_file_))
+      throw std::runtime_error("unable to read back the spooled commit");
+
+    CloseSpool();
+    OpenSpool();
+    commands_ = 0;
+    commits_++;
+    return true;
+  }
+
+  //Has fast-import write out everything so far and report back with "progress checkpoint <number>"
+  //once it has. Returns false if the stream couldn't be written.
+  bool Checkpoint(size_t number, size_t files)
+  {
+    out_.Write("checkpoint\n\nprogress checkpoint ");
+    out_.WriteNumber(number);
+    out_.Write(" after ");
+    out_.WriteNumber(files);
+    out_.Write(" files\n\n");
+    return out_.Flush();
+  }
+
+  size_t commits()const{return commits_;}
+  size_t blobs()const{return next_mark_ - 1;}
+
+private:
+  void OpenSpool()
+  {
+    spool_file_ = std::tmpfile();
+    if (!spool_file_)
+      throw std::runtime_error("unable to create a temporary file to spool the commit to");
+    spool_.reset(new FastImportWriter(fileno(spool_file_)));
+  }
+
+  void CloseSpool()
+  {
+    spool_.reset();
+    if (spool_file_)
+      std::fclose(spool_file_);
+    spool_file_ = NULL;
+  }
+
+  size_t Mark(const std::string& data)
+  {
+    Marks::const_iterator ii = marks_.find(data);
+    if (ii != marks_.end())
+      return ii->second;
+
+    out_.Write("blob\nmark :");
+    out_.WriteNumber(next_mark_);
+    out_.Write('\n');
+    out_.Data(data.data(), data.size());
+    marks_.insert(std::make_pair(data, next_mark_));
+    return next_mark_++;
+  }
+
+  typedef boost::unordered_map<std::string, size_t> Marks;
+
+  FastImportWriter&                   out_;
+  const bool                          incremental_;
+  FILE*                               spool_file_;
+  boost::scoped_ptr<FastImportWriter> spool_;
+  Marks                               marks_;
+  size_t                              next_mark_;
+  size_t                              commands_;
+  size_t                              commits_;
+};
+
+//Indexes a directory on several threads while keeping the output identical to a single threaded
+//run. A walker thread lists the mp3s and numbers them, a pool of workers parses the tags into a
+//buffer each and the caller's thread writes the buffers out in walk order.
+//
+//Given the stat cache from the previous run only the difference is written, as a commit on top of
+//the current master. Unchanged files are never handed to the workers, changed ones are removed and
+//written again and files which have gone are removed.
+//
+//With checkpoints enabled the index is committed every so many files and fast-import told to write
+//out what it has. Once the confirm callback says fast-import has got that far the stat cache is
+//saved, so an interrupted run carries on from the last checkpoint the next time.
+class IndexPipeline
+{
+public:
+  enum
+  {
+    //Files walked but not yet written out, caps how far the walker and workers can get ahead of a
+    //slow file at the head of the stream
+    MaxOutstandingPerJob = 64,
+  };
+
+  //Waits for fast-import to reach a checkpoint, returns false if it never will
+  typedef boost::function<bool (size_t checkpoint)> ConfirmCheckpoint;
+
+  IndexPipeline(size_t strip, size_t jobs, const StatCache* previous)
+    : print_(strip),
+      strip_(strip),
+      jobs_(std::max<size_t>(jobs, 1)),
+      previous_(previous),
+      checkpoint_every_(0),
+      walked_(0),
+      emitted_(0),
+      walk_finished_(false),
+      cancelled_(false),
+      since_checkpoint_(0),
+      checkpoints_(0),
+      commits_(0),
+      parsed_(0),
+      skipped_(0),
+      removed_(0),
+      blobs_(0)
+  {
+    if (previous_)
+      current_ = *previous_;
+  }
+
+  //Commits and checkpoints every 'every' files. The stat cache is only saved at a checkpoint if
+  //there is a confirm callback, otherwise there's no knowing whether fast-import got that far.
+  void SetCheckpoints(size_t every, const std::string& stat_cache, const ConfirmCheckpoint& confirm)
+  {
+    checkpoint_every_ = every;
+    stat_cache_       = stat_cache;
+    confirm_          = confirm;
+  }
+
+  //Throws if the run had to be abandoned
+  void Run(const fs::path& directory, FastImportWriter& out)
+  {
+    boost::thread walker(boost::bind(&IndexPipeline::Walk, this, directory));
+    boost::thread_group workers;
+    try
+    {
+      for (size_t i = 0; i < jobs_; i++)
+        workers.create_thread(boost::bind(&IndexPipeline::Work, this));
+
+      IndexCommit commit(out, previous_ != NULL);
+      Emit(commit);
+
+      Join(walker, workers);
+      if (cancelled_)
+        throw std::runtime_error(error_);
+      commit.Finish();
+      commits_ = commit.commits();
+      blobs_   = commit.blobs();
+    }
+    catch (std::exception& e)
+    {
+      //The walker and workers may be blocked waiting for space or work, they have to be stopped
+      //before the pipeline goes away under them
+      Cancel(e.what());
+      Join(walker, workers);
+      throw;
+    }
+  }
+
+  //Only valid once Run has returned
+  const StatCache& current()const{return current_;}
+  size_t           commits()const{return commits_;}
+  size_t           parsed()const{return parsed_;}
+  size_t           skipped()const{return skipped_;}
+  size_t           removed()const{return removed_;}
+  size_t           blobs()const{return blobs_;}
+
+private:
+  //What a worker wrote for an item, along with the sort paths it deleted and copied to
+  struct Done
+  {
+    FileCommands             commands_;
+    std::vector<std::string> deleted_;
+    std::vector<std::string> copied_;
+    std::string              name_;
+    FileStat                 stat_;
+    bool                     parse_;
+  };
+
+  struct Item
+  {
+    Item(size_t sequence, const fs::path& path, const std::string& name)
+      : sequence_(sequence),path_(path),name_(name),parse_(true){}
+    size_t                   sequence_;
+    fs::path                 path_;
+    //The path as it appears under files/
+    std::string              name_;
+    FileStat                 stat_;
+    //Paths to delete before writing the file out again
+    std::vector<std::string> delete_;
+    //False if the file has gone and only needs deleting
+    bool                     parse_;
+  };
+
+  static void DeleteFile(Item* item, const std::string& name, const FileStat& stat)
+  {
+    item->delete_.push_back("files/" + name);
+    item->delete_.insert(item->delete_.end(), stat.sort_paths_.begin(), stat.sort_paths_.end());
+  }
+
+  //Returns false if the run has been cancelled
+  bool Queue(boost::mutex::scoped_lock& lock, const Item& item)
+  {
+    size_t max_outstanding = jobs_ * MaxOutstandingPerJob;
+    while (walked_ - emitted_ >= max_outstanding && !cancelled_)
+      space_signal_.wait(lock);
+    if (cancelled_)
+      return false;
+    work_.push_back(item);
+    work_.back().sequence_ = walked_++;
+    work_signal_.notify_one();
+    return true;
+  }
+
+  static void Join(boost::thread& walker, boost::thread_group& workers)
+  {
+    if (walker.joinable())
+      walker.join();
+    workers.join_all();
+  }
+
+  void Cancel(const std::string& error)
+  {
+    boost::mutex::scoped_lock lock(lock_);
+    cancelled_ = true;
+    error_     = error;
+    work_signal_.notify_all();
+    space_signal_.notify_all();
+  }
+
+  void Walk(fs::path directory)
+  {
+    std::set<std::string> seen;
+    fs::recursive_directory_iterator dir_iter(directory);
+    for (; dir_iter != fs::recursive_directory_iterator(); ++dir_iter)
+    {
+      const fs::path& path = dir_iter->path();
+      if (path.extension() != ".mp3")
+        continue;
+
+      Item item(0, path, path.string().substr(strip_));
+      item.stat_ = stat_file(path);
+
+      if (previous_)
+      {
+        seen.insert(item.name_);
+        StatCache::Files::const_iterator ii = previous_->files_.find(item.name_);
+        if (ii != previous_->files_.end())
+        {
+          if (ii->second.SameFile(item.stat_))
+          {
+            boost::mutex::scoped_lock lock(lock_);
+            skipped_++;
+            continue;
+          }
+          DeleteFile(&item, ii->first, ii->second);
+        }
+      }
+
+      boost::mutex::scoped_lock lock(lock_);
+      if (!Queue(lock, item))
+        return;
+    }
+
+    if (previous_)
+    {
+      for (StatCache::Files::const_iterator ii = previous_->files_.begin(); ii != previous_->files_.end(); ++ii)
+      {
+        if (seen.count(ii->first) != 0)
+          continue;
+        Item item(0, fs::path(), ii->first);
+        item.parse_ = false;
+        DeleteFile(&item, ii->first, ii->second);
+
+        boost::mutex::scoped_lock lock(lock_);
+        if (!Queue(lock, item))
+          return;
+      }
+    }
+
+    boost::mutex::scoped_lock lock(lock_);
+    walk_finished_ = true;
+    work_signal_.notify_all();
+    done_signal_.notify_all();
+  }
+
+  void Work()
+  {
+    for (;;)
+    {
+      boost::mutex::scoped_lock lock(lock_);
+      while (work_.empty() && !walk_finished_ && !cancelled_)
+        work_signal_.wait(lock);
+      if (work_.empty() || cancelled_)
+        return;
+      Item item = work_.front();
+      work_.pop_front();
+      lock.unlock();
+
+      FileCommands commands;
+      for (size_t i = 0; i < item.delete_.size(); i++)
+        commands.push_back(FileCommand(FileCommand::Kind_Delete, item.delete_[i]));
+      if (item.parse_)
+        print_(item.path_, commands, &item.stat_.sort_paths_);
+
+      lock.lock();
+      Done& done = done_[item.sequence_];
+      done.commands_.swap(commands);
+      done.deleted_.swap(item.delete_);
+      done.name_.swap(item.name_);
+      done.parse_ = item.parse_;
+      if (item.parse_)
+      {
+        done.copied_ = item.stat_.sort_paths_;
+        done.stat_.sort_paths_.swap(item.stat_.sort_paths_);
+        done.stat_.size_  = item.stat_.size_;
+        done.stat_.mtime_ = item.stat_.mtime_;
+        done.stat_.inode_ = item.stat_.inode_;
+        parsed_++;
+      }
+      else
+      {
+        removed_++;
+      }
+      if (item.sequence_ == emitted_)
+        done_signal_.notify_one();
+    }
+  }
+
+  void Emit(IndexCommit& commit)
+  {
+    //Whether each sort path touched ends up copied to (true) or deleted (false)
+    std::map<std::string, bool> sort_paths;
+
+    boost::mutex::scoped_lock lock(lock_);
+    for (;;)
+    {
+      std::map<size_t, Done>::iterator ii;
+      while ((ii = done_.find(emitted_)) == done_.end())
+      {
+        if (walk_finished_ && emitted_ == walked_)
+        {
+          RestoreSortPaths(sort_paths, commit);
+          return;
+        }
+        done_signal_.wait(lock);
+      }
+
+      Done done;
+      done.parse_ = ii->second.parse_;
+      done.commands_.swap(ii->second.commands_);
+      done.deleted_.swap(ii->second.deleted_);
+      done.copied_.swap(ii->second.copied_);
+      done.name_.swap(ii->second.name_);
+      done.stat_.sort_paths_.swap(ii->second.stat_.sort_paths_);
+      done.stat_.size_  = ii->second.stat_.size_;
+      done.stat_.mtime_ = ii->second.stat_.mtime_;
+      done.stat_.inode_ = ii->second.stat_.inode_;
+      done_.erase(ii);
+      lock.unlock();
+
+      commit.Write(done.commands_);
+      for (size_t i = 0; i < done.deleted_.size(); i++)
+        sort_paths[done.deleted_[i]] = false;
+      for (size_t i = 0; i < done.copied_.size(); i++)
+        sort_paths[done.copied_[i]] = true;
+
+      //current_ only ever holds what has been written out so it can be saved at a checkpoint
+      if (done.parse_)
+        current_.files_[done.name_] = done.stat_;
+      else
+        current_.files_.erase(done.name_);
+
+      if (checkpoint_every_ != 0 && ++since_checkpoint_ == checkpoint_every_)
+      {
+        std::string error;
+        if (!Checkpoint(sort_paths, commit, &error))
+        {
+          Cancel(error);
+          return;
+        }
+      }
+
+      lock.lock();
+      emitted_++;
+      space_signal_.notify_one();
+    }
+  }
+
+  bool Checkpoint(std::map<std::string, bool>& sort_paths, IndexCommit& commit, std::string* error)
+  {
+    RestoreSortPaths(sort_paths, commit);
+    sort_paths.clear();
+    since_checkpoint_ = 0;
+
+    commit.Finish();
+    if (!commit.Checkpoint(++checkpoints_, emitted_ + 1))
+    {
+      *error = "failed writing the fast-import stream";
+      return false;
+    }
+    if (!confirm_)
+      return true;
+    if (!confirm_(checkpoints_))
+    {
+      *error = "git fast-import stopped before checkpoint " + boost::lexical_cast<std::string>(checkpoints_);
+      return false;
+    }
+    if (!stat_cache_.empty() && !current_.Save(stat_cache_))
+    {
+      *error = "failed writing the stat cache";
+      return false;
+    }
+    return true;
+  }
+
+  //Files with the same tags share a sort path, so deleting a changed file's old sort paths can take
+  //out a copy belonging to a file which is still there. Those are copied back from one of the files.
+  void RestoreSortPaths(const std::map<std::string, bool>& sort_paths, IndexCommit& commit)
+  {
+    std::map<std::string, const std::string*> owners;
+    for (StatCache::Files::const_iterator ii = current_.files_.begin(); ii != current_.files_.end(); ++ii)
+    {
+      const std::vector<std::string>& paths = ii->second.sort_paths_;
+      for (size_t i = 0; i < paths.size(); i++)
+        if (sort_paths.count(paths[i]) != 0)
+          owners[paths[i]] = &ii->first;
+    }
+
+    for (std::map<std::string, bool>::const_iterator ii = sort_paths.begin(); ii != sort_paths.end(); ++ii)
+    {
+      std::map<std::string, const std::string*>::const_iterator owner = owners.find(ii->first);
+      if (!ii->second && owner != owners.end())
+      {
+        FileCommands commands;
+        set_sort_metadata(commands, owner->second->c_str(), ii->first);
+        commit.Write(commands);
+      }
+    }
+  }
+
+  const PrintMetadata           print_;
+  const size_t                  strip_;
+  const size_t                  jobs_;
+  const StatCache*              previous_;
+  size_t                        checkpoint_every_;
+  std::string                   stat_cache_;
+  ConfirmCheckpoint             confirm_;
+
+  boost::mutex                  lock_;
+  boost::condition_variable     work_signal_;
+  boost::condition_variable     done_signal_;
+  boost::condition_variable     space_signal_;
+  std::deque<Item>              work_;
+  //Finished files waiting on an earlier one, keyed by walk order
+  std::map<size_t, Done>        done_;
+  size_t                        walked_;
+  size_t                        emitted_;
+  bool                          walk_finished_;
+  bool                          cancelled_;
+  std::string                   error_;
+
+  //Only touched by the emitter
+  StatCache                     current_;
+  size_t                        since_checkpoint_;
+  size_t                        checkpoints_;
+
+  size_t                        commits_;
+  size_t                        parsed_;
+  size_t                        skipped_;
+  size_t                        removed_;
+  size_t                        blobs_;
+};
+
+#ifdef UNIX
+//Copies whatever git fast-import prints to our stderr, it would block once a pipe filled up
+//otherwise. Progress lines on its stdout tell us how far it has got with the checkpoints.
+class FastImportOutput
+{
+public:
+  FastImportOutput(int stdout_fd, int stderr_fd)
+    : progress_(0),
+      finished_(false)
+  {
+    thread_.reset(new boost::thread(boost::bind(&FastImportOutput::Forward, this, stdout_fd, stderr_fd)));
+  }
+
+  //Returns false if fast-import closed its output before reaching the checkpoint
+  bool WaitForProgress(size_t checkpoint)
+  {
+    boost::mutex::scoped_lock lock(lock_);
+    while (progress_ < checkpoint && !finished_)
+      progress_signal_.wait(lock);
+    return progress_ >= checkpoint;
+  }
+
+  //Returns once the child has closed both
+  void Join()
+  {
+    thread_->join();
+  }
+
+private:
+  void Line(const std::string& line)
+  {
+    std::cerr << line << "\n";
+    unsigned long checkpoint;
+    if (std::sscanf(line.c_str(), "progress checkpoint %lu", &checkpoint) != 1)
+      return;
+    boost::mutex::scoped_lock lock(lock_);
+    progress_ = std::max<size_t>(progress_, checkpoint);
+    progress_signal_.notify_all();
+  }
+
+  void Forward(int stdout_fd, int stderr_fd)
+  {
+    boost::array<pollfd, 2> fds;
+    fds[0].fd     = stdout_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = stderr_fd;
+    fds[1].events = POLLIN;
+
+    char buffer[4096];
+    std::string line;
+    while (fds[0].fd != -1 || fds[1].fd != -1)
+    {
+      if (poll(fds.data(), fds.size(), -1) < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      for (size_t i = 0; i < fds.size(); i++)
+      {
+        if (fds[i].fd == -1 || fds[i].revents == 0)
+          continue;
+        ssize_t read = ::read(fds[i].fd, buffer, sizeof(buffer));
+        if (read < 0 && errno == EINTR)
+          continue;
+        if (read <= 0)
+        {
+          fds[i].fd = -1;
+          continue;
+        }
+        if (i != 0)
+        {
+          std::cerr.write(buffer, read);
+          continue;
+        }
+        for (ssize_t j = 0; j < read; j++)
+        {
+          if (buffer[j] != '\n')
+          {
+            line += buffer[j];
+            continue;
+          }
+          Line(line);
+          line.clear();
+        }
+      }
+    }
+    if (!line.empty())
+      Line(line);
+
+    boost::mutex::scoped_lock lock(lock_);
+    finished_ = true;
+    progress_signal_.notify_all();
+  }
+
+  boost::mutex                     lock_;
+  boost::condition_variable        progress_signal_;
+  size_t                           progress_;
+  bool                             finished_;
+  boost::scoped_ptr<boost::thread> thread_;
+};
+#endif
+
 QSMPINDEXER_END
 
 int main(int argc, char* argv[])
@@ -391,7 +1259,14 @@ int main(int argc, char* argv[])
   po::options_description options;
   options.add_options()
     ("help", "produce help message")
-    ("directory", po::value<std::string>(), "directory to index");
+    ("directory", po::value<std::string>(), "directory to index")
+    ("jobs,j", po::value<size_t>(), "number of threads parsing tags (default: one per core)")
+    ("stat-cache", po::value<std::string>(), "file recording what was indexed, if it exists only changes since are written")
+    ("checkpoint", po::value<size_t>(), "commit every this many files, with --repository an interrupted run resumes from the last one")
+#ifdef UNIX
+    ("repository", po::value<std::string>(), "run git fast-import in this repository rather than writing the stream to stdout")
+#endif
+    ;
   po::positional_options_description positional_options;
   positional_options.add("directory",1);
 
@@ -414,20 +1289,107 @@ int main(int argc, char* argv[])
   _setmode(_fileno(stdout),_O_BINARY);
 #endif
 
-  std::string commit_message("Initial index.");  
-  std::cout << "reset refs/heads/master\n"
-            << "commit refs/heads/master\n"
-            << "committer qsmp_indexer <qsmp_indexer@example.com> now\n"
-            << "data " << commit_message.size() << "\n"
-            << commit_message << "\n";
-
   std::string directory = arg_map["directory"].as<std::string>();
   size_t strip = directory.size();
 
-  fs::recursive_directory_iterator dir_iter(arg_map["directory"].as<std::string>());
-  std::for_each(dir_iter,
-                fs::recursive_directory_iterator(),
-                qsmp_indexer::PrintMetadata(strip));
+  size_t jobs = boost::thread::hardware_concurrency();
+  if (arg_map.count("jobs") != 0)
+    jobs = arg_map["jobs"].as<size_t>();
+
+  qsmp_indexer::StatCache previous;
+  bool incremental = false;
+  if (arg_map.count("stat-cache") != 0)
+    incremental = previous.Load(arg_map["stat-cache"].as<std::string>());
+
+  int out_fd = 1;
+#ifdef UNIX
+  //A failed write to git should be reported rather than kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  boost::scoped_ptr<qsmp::Process> git;
+  boost::scoped_ptr<qsmp_indexer::FastImportOutput> git_output;
+  if (arg_map.count("repository") != 0)
+  {
+    std::vector<std::string> arguments;
+    arguments.push_back("git");
+    arguments.push_back("fast-import");
+    arguments.push_back("--quiet");
+    arguments.push_back("--date-format=now");
+    git.reset(new qsmp::Process(qsmp::LogContext("qsmp_indexer/git", qsmp::LogDefaults_Disable),
+                                "git",
+                                arg_map["repository"].as<std::string>(),
+                                arguments));
+    if (!git->is_running())
+    {
+      std::cerr << "qsmp_indexer: unable to run git fast-import\n";
+      return 1;
+    }
+    out_fd = git->stdin_fd();
+    git_output.reset(new qsmp_indexer::FastImportOutput(git->stdout_fd(), git->stderr_fd()));
+  }
+#endif
+
+  std::string stat_cache;
+  if (arg_map.count("stat-cache") != 0)
+    stat_cache = arg_map["stat-cache"].as<std::string>();
+
+  qsmp_indexer::FastImportWriter out(out_fd);
+  qsmp_indexer::IndexPipeline pipeline(strip, jobs, incremental ? &previous : NULL);
+  if (arg_map.count("checkpoint") != 0)
+  {
+    //Without fast-import's reply there is no telling whether a checkpoint made it to disk
+    qsmp_indexer::IndexPipeline::ConfirmCheckpoint confirm;
+#ifdef UNIX
+    if (git_output)
+      confirm = boost::bind(&qsmp_indexer::FastImportOutput::WaitForProgress, git_output.get(), _1);
+#endif
+    pipeline.SetCheckpoints(arg_map["checkpoint"].as<size_t>(), stat_cache, confirm);
+  }
+
+  bool ok = true;
+  try
+  {
+    pipeline.Run(directory, out);
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "qsmp_indexer: " << e.what() << "\n";
+    ok = false;
+  }
+  if (ok && !out.Flush())
+  {
+    std::cerr << "qsmp_indexer: failed writing the fast-import stream\n";
+    ok = false;
+  }
+
+  std::cerr << "qsmp_indexer: " << pipeline.parsed() << " parsed, "
+            << pipeline.skipped() << " skipped, "
+            << pipeline.removed() << " removed, "
+            << pipeline.blobs() << " distinct values, "
+            << pipeline.commits() << " commits\n";
+
+#ifdef UNIX
+  if (git)
+  {
+    //fast-import keeps whatever it had checkpointed when its input ends early. The writer mustn't
+    //write to the fd number once it has been closed and maybe reused.
+    out.Close();
+    git->CloseStdin();
+    git_output->Join();
+    if (git->WaitForFinish(-1) != 0)
+    {
+      std::cerr << "qsmp_indexer: git fast-import failed\n";
+      ok = false;
+    }
+  }
+#endif
+  if (!ok)
+    return 1;
+  if (!stat_cache.empty() && !pipeline.current().Save(stat_cache))
+  {
+    std::cerr << "qsmp_indexer: failed writing the stat cache\n";
+    return 1;
+  }
 
   return 0;
 }
@@ -16,6 +16,7 @@
  ******************************************************************************/
 
 #include <qsmp_lib/Log.h>
+#include <qsmp_lib/PersistantPath.h>
 
 #include <boost/date_time.hpp>
 #include <boost/filesystem.hpp>
@@ -34,26 +35,6 @@ namespace {
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
-//TODO(james): Move this to someplace where it can be called from other files
-boost::filesystem::path PersistantPath(const std::string& file_name)
-{
-  boost::filesystem::path path;
-#ifdef _WIN32
-  path = getenv("APPDATA");
-  path /= "QSmp";
-#else
-  path = getenv("HOME");
-  path /= ".qsmp";
-#endif
-  boost::filesystem::create_directories(path);
-  path /= file_name;
-  return path;
-}
-
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-//-----------------------------------------------------------------------------
-
 boost::filesystem::path NewLogPath()
 {
   using namespace boost::posix_time;
@@ -64,12 +45,12 @@ boost::filesystem::path NewLogPath()
   ptime time(second_clock::local_time());
 
   str_buf << "Log_" << time << ".log";
-  boost::filesystem::path path = PersistantPath(str_buf.str());
+  boost::filesystem::path path = qsmp::PersistantPath(str_buf.str());
   while(boost::filesystem::exists(path))
   {
     str_buf.clear();
     str_buf << "Log_" << time << "_" << rand() << ".log";
-    path = PersistantPath(str_buf.str());
+    path = qsmp::PersistantPath(str_buf.str());
   }
   return path;
 }
@@ -0,0 +1,34 @@
+/******************************************************************************
+ * Copyright (C) 2008 James McKaskill <jmckaskill@gmail.com>                  *
+ *                                                                            *
+ * This program is free software; you can redistribute it and/or              *
+ * modify it under the terms of the GNU General Public License as             *
+ * published by the Free Software Foundation; either version 2 of             *
+ * the License, or (at your option) any later version.                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ ******************************************************************************/
+
+#ifndef QSMP_PERSISTANTPATH_H_
+#define QSMP_PERSISTANTPATH_H_
+
+#include <qsmp_gui/common.h>
+
+#include <boost/filesystem.hpp>
+#include <string>
+
+QSMP_BEGIN
+
+//Returns the path of file_name in the per user settings directory (%APPDATA%/QSmp or ~/.qsmp),
+//creating the directory if it doesn't exist yet
+boost::filesystem::path PersistantPath(const std::string& file_name);
+
+QSMP_END
+
+#endif
@@ -15,11 +15,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
  ******************************************************************************/
 
-#include "stdafx.h"
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread/thread.hpp>
 #include <qsmp_gui/common.h>
-#include <qsmp_gui/Process.h>
+#include <qsmp_lib/Process.h>
+#ifdef UNIX
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #define foreach BOOST_FOREACH
 
@@ -249,13 +253,17 @@ void PosixProcess::Run()
       for (int j = 0; j < fds[i].size(); j++)
         if(close(fds[i][j]))
           ERRNO_LOG(log_errno_);
-    //change working dir
+    //change working dir, running somewhere else instead could do real damage
     if (chdir(working_dir.c_str()))
+    {
       ERRNO_LOG(log_errno_);
+      _exit(127);
+    }
     //and finally execute the child process
     if (execvp(process_.c_str(), arguments.data()))
       ERRNO_LOG(log_errno_);
-    break;
+    //Don't fall back into the parent's code if the exec failed
+    _exit(127);
   case -1:
     WARNING(log_) << "Fork failed";
     ERRNO_LOG(log_errno_);
@@ -290,6 +298,55 @@ void PosixProcess::Run()
   
 }
 
+//-----------------------------------------------------------------------------
+
+void PosixProcess::CloseStdin()
+{
+  if (stdin_fd_ != -1 && close(stdin_fd_))
+    ERRNO_LOG(log_errno_);
+  stdin_fd_ = -1;
+}
+
+//-----------------------------------------------------------------------------
+
+int PosixProcess::WaitForFinish(int timeout)
+{
+  if (pid_ == -1)
+    return -1;
+
+  int status;
+  pid_t ret;
+  if (timeout < 0)
+  {
+    while ((ret = waitpid(pid_, &status, 0)) == -1 && errno == EINTR)
+      ;
+  }
+  else
+  {
+    //There's no waitpid with a timeout so poll it
+    boost::system_time end = boost::get_system_time() + boost::posix_time::milliseconds(timeout);
+    while ((ret = waitpid(pid_, &status, WNOHANG)) == 0 && boost::get_system_time() < end)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    if (ret == 0)
+      return -1;
+  }
+
+  if (ret == -1)
+  {
+    ERRNO_LOG(log_errno_);
+    return -1;
+  }
+
+  pid_ = -1;
+  if (WIFEXITED(status))
+  {
+    FLOG(log_, "Exited with %1%") % WEXITSTATUS(status);
+    return WEXITSTATUS(status);
+  }
+  FWARNING(log_, "Killed by signal %1%") % WTERMSIG(status);
+  return -1;
+}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
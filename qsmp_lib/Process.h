@@ -15,8 +15,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
  ******************************************************************************/
 
-#ifndef QSMP_GUI_PROCESS_H_
-#define QSMP_GUI_PROCESS_H_
+#ifndef QSMP_LIB_PROCESS_H_
+#define QSMP_LIB_PROCESS_H_
 
 #include <qsmp_gui/common.h>
 
@@ -24,6 +24,9 @@
 #include <qsmp_lib/Log.h>
 #include <string>
 #include <vector>
+#ifdef UNIX
+#include <sys/types.h>
+#endif
 
 
 QSMP_BEGIN
@@ -138,11 +141,16 @@ public:
   int stdout_fd()const{return stdout_fd_;}
   int stderr_fd()const{return stderr_fd_;}
 
+  //Lets the child see the end of its input
+  void CloseStdin();
+
   pid_t pid()const{return pid_;}
 
   void Signal(int signal);
 
   void WaitForStartup(int timeout);
+  //Reaps the child and returns its exit code, or -1 if it was killed or is still running after
+  //timeout ms (a negative timeout waits forever)
   int WaitForFinish(int timeout);
 private:
   const LogContext          log_;